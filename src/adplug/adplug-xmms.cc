@@ -22,6 +22,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <glib.h>
+#include <glib/gstdio.h>
 
 #include "adplug.h"
 #include "emuopl.h"
@@ -30,6 +33,7 @@
 
 #include <libaudcore/audstrings.h>
 #include <libaudcore/i18n.h>
+#include <libaudcore/multihash.h>
 #include <libaudcore/plugin.h>
 #include <libaudcore/runtime.h>
 
@@ -80,6 +84,10 @@ const char * const AdPlugXMMS::exts[] = {
 // Default AdPlug user's configuration subdirectory
 #define ADPLUG_CONFDIR		".adplug"
 
+// Song length cache file, in Audacious' user directory
+#define LENGTHS_FILE		"adplug-lengths"
+#define LENGTHS_HEADER		"# AdPlug song lengths 1\n"
+
 /***** Global variables *****/
 
 // Configuration (and defaults)
@@ -122,6 +130,123 @@ dbg_printf (const char *fmt, ...)
 
 #endif
 
+/***** Song length cache *****/
+
+// Finding the length of a song means playing it through to the end, which
+// can take a second or more per file.  Lengths are therefore cached by a hash
+// of the file contents and subsong, and kept on disk between sessions.
+// read_tuple() is called from several scanner threads at once, so the cache
+// is protected by a mutex.
+
+static pthread_mutex_t lengths_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SimpleHash<String, int> lengths;
+
+static StringBuf
+lengths_path ()
+{
+  return filename_build ({aud_get_path (AudPath::UserDir), LENGTHS_FILE});
+}
+
+static String
+lengths_key (VFSFile & fd, unsigned int subsong)
+{
+  if (fd.fseek (0, VFS_SEEK_SET) < 0)
+    return String ();
+
+  Index<char> data = fd.read_all ();
+  char *sum = g_compute_checksum_for_data (G_CHECKSUM_SHA1,
+   (const unsigned char *) data.begin (), data.len ());
+
+  String key (str_printf ("%s:%u", sum, subsong));
+  g_free (sum);
+  return key;
+}
+
+static void
+lengths_load ()
+{
+  FILE *f = g_fopen (lengths_path (), "r");
+  if (!f)
+    return;
+
+  char line[128];
+  bool valid = fgets (line, sizeof line, f) && !strcmp (line, LENGTHS_HEADER);
+
+  if (valid)
+  {
+    char key[96];
+    int length;
+
+    while (fgets (line, sizeof line, f))
+      if (sscanf (line, "%95s %d", key, &length) == 2)
+        lengths.add (String (key), std::move (length));
+  }
+
+  fclose (f);
+
+  // A file from another version of the cache is started over, since
+  // lengths_add() would otherwise go on appending lines that are never read.
+  if (!valid)
+  {
+    f = g_fopen (lengths_path (), "w");
+    if (f)
+    {
+      fputs (LENGTHS_HEADER, f);
+      fclose (f);
+    }
+  }
+}
+
+// New lengths are appended to the file as they are found, so that nothing is
+// lost if Audacious does not exit cleanly.
+static void
+lengths_add (const String & key, int length)
+{
+  StringBuf path = lengths_path ();
+  bool exists = g_file_test (path, G_FILE_TEST_EXISTS);
+
+  FILE *f = g_fopen (path, "a");
+  if (!f)
+    return;
+
+  if (!exists)
+    fputs (LENGTHS_HEADER, f);
+
+  fprintf (f, "%s %d\n", (const char *) key, length);
+  fclose (f);
+
+  lengths.add (key, std::move (length));
+}
+
+static int
+songlength (CPlayer *p, VFSFile & fd, unsigned int subsong)
+{
+  String key = lengths_key (fd, subsong);
+
+  if (key)
+  {
+    pthread_mutex_lock (&lengths_mutex);
+    int *cached = lengths.lookup (key);
+    int length = cached ? *cached : -1;
+    pthread_mutex_unlock (&lengths_mutex);
+
+    if (length >= 0)
+      return length;
+  }
+
+  int length = p->songlength (subsong);
+
+  if (key)
+  {
+    pthread_mutex_lock (&lengths_mutex);
+    if (!lengths.lookup (key))
+      lengths_add (key, length);
+    pthread_mutex_unlock (&lengths_mutex);
+  }
+
+  return length;
+}
+
 static CPlayer *
 factory (VFSFile & fd, Copl * newopl)
 {
@@ -154,7 +279,7 @@ Tuple AdPlugXMMS::read_tuple (const char * filename, VFSFile & fd)
 
     tuple.set_str (Tuple::Codec, p->gettype().c_str());
     tuple.set_str (Tuple::Quality, _("sequenced"));
-    tuple.set_int (Tuple::Length, p->songlength (plr.subsong));
+    tuple.set_int (Tuple::Length, songlength (p, fd, plr.subsong));
     delete p;
   }
 
@@ -342,6 +467,10 @@ bool AdPlugXMMS::init ()
   }
   dbg_printf (".\n");
 
+  pthread_mutex_lock (&lengths_mutex);
+  lengths_load ();
+  pthread_mutex_unlock (&lengths_mutex);
+
   return true;
 }
 
@@ -354,6 +483,10 @@ void AdPlugXMMS::cleanup ()
 
   plr.filename = String ();
 
+  pthread_mutex_lock (&lengths_mutex);
+  lengths.clear ();
+  pthread_mutex_unlock (&lengths_mutex);
+
   aud_set_bool (CFG_VERSION, "16bit", conf.bit16);
   aud_set_bool (CFG_VERSION, "Stereo", conf.stereo);
   aud_set_int (CFG_VERSION, "Frequency", conf.freq);
@@ -21,18 +21,24 @@
  * Because ALSA is not thread-safe (despite claims to the contrary) we use non-
  * blocking output in the pump thread with the mutex locked, then unlock the
  * mutex and wait for more room in the buffer with poll() while other threads
- * lock the mutex and read the output time.  We poll a pipe of our own as well
- * as the ALSA file descriptors so that we can wake up the pump thread when
+ * lock the mutex to pause, flush, etc.  We poll a pipe of our own as well as
+ * the ALSA file descriptors so that we can wake up the pump thread when
  * needed.
  *
- * When paused, or when it comes to the end of the data given it, the pump will
- * wait on alsa_cond for the signal to continue.  When it has more data waiting,
- * however, it will be sitting in poll() waiting for ALSA's signal that more
- * data can be written.
+ * Audio is handed to the pump through a single-producer, single-consumer ring
+ * buffer which needs no lock: write_audio() only advances the write counter,
+ * and the pump only advances the read counter.  Likewise, get_delay() does not
+ * talk to ALSA; the pump publishes the hardware delay after each write, and
+ * the time elapsed since then is subtracted.
  *
- * * After adding more data to the buffer, and after resuming from pause,
- *   signal on alsa_cond to wake the pump.  (There is no need to signal when
- *   entering pause.)
+ * When paused, or before playback has started, the pump will wait on
+ * alsa_cond for the signal to continue.  When it runs out of data, it waits
+ * on the pipe alone, and write_audio() wakes it up.  When it has more data
+ * waiting, however, it will be sitting in poll() waiting for ALSA's signal
+ * that more data can be written.
+ *
+ * * After resuming from pause or starting playback, signal on alsa_cond to
+ *   wake the pump.  (There is no need to signal when entering pause.)
  * * After setting the pump_quit flag, signal on alsa_cond AND the poll_pipe
  *   before joining the thread.
  */
@@ -42,11 +48,11 @@
 #include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <alsa/asoundlib.h>
-#include <libaudcore/ringbuf.h>
 
 #include "alsa.h"
 
@@ -56,6 +62,8 @@ EXPORT ALSAPlugin aud_plugin_instance;
 do { \
     (value) = function (__VA_ARGS__); \
     if ((value) < 0) { \
+        if ((value) == -EPIPE) \
+            alsa_underruns ++; \
         CHECK (snd_pcm_recover, alsa_handle, (value), 0); \
         CHECK_VAL ((value), function, __VA_ARGS__); \
     } \
@@ -73,10 +81,12 @@ static pthread_cond_t alsa_cond = PTHREAD_COND_INITIALIZER;
 
 static snd_pcm_format_t alsa_format;
 static int alsa_channels, alsa_rate;
+static int alsa_frame_size; /* bytes */
+static bool alsa_mmap;
 
-static RingBuf<char> alsa_buffer;
 static int alsa_period; /* milliseconds */
 
+/* read from other threads without the mutex */
 static bool alsa_prebuffer, alsa_paused;
 static int alsa_paused_delay; /* milliseconds */
 
@@ -85,11 +95,158 @@ static int poll_count;
 static pollfd * poll_handles;
 
 static bool pump_quit;
+static bool pump_idle; /* waiting for write_audio() */
 static pthread_t pump_thread;
 
+/* statistics, reported when the device is closed */
+static int alsa_underruns;
+static int stat_wakeups;
+static int64_t stat_last_wakeup, stat_jitter_sum, stat_jitter_max; /* microseconds */
+
+/* hardware delay as of the last write, guarded by a sequence counter */
+static unsigned delay_seq;
+static int delay_frames;
+static int64_t delay_time; /* microseconds */
+
+/* The ring buffer.  The counters run freely (wrapping around at 2^32) and are
+ * reduced modulo the size only when indexing.  ring_written is advanced only
+ * by the producer, ring_read only by the consumer. */
+static char * ring_data;
+static unsigned ring_size;
+static unsigned ring_written, ring_read;
+
 static snd_mixer_t * alsa_mixer;
 static snd_mixer_elem_t * alsa_mixer_element;
 
+static int64_t now_us ()
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, & ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ring_alloc (int size)
+{
+    ring_data = new char[size];
+    ring_size = size;
+    ring_written = ring_read = 0;
+}
+
+static void ring_free ()
+{
+    delete[] ring_data;
+    ring_data = nullptr;
+    ring_size = 0;
+}
+
+static int ring_len ()
+{
+    return __atomic_load_n (& ring_written, __ATOMIC_ACQUIRE) -
+     __atomic_load_n (& ring_read, __ATOMIC_ACQUIRE);
+}
+
+/* producer side */
+static int ring_write (const char * data, int len)
+{
+    unsigned read = __atomic_load_n (& ring_read, __ATOMIC_ACQUIRE);
+    len = aud::min (len, (int) (ring_size - (ring_written - read)));
+
+    unsigned pos = ring_written % ring_size;
+    int part = aud::min (len, (int) (ring_size - pos));
+
+    memcpy (ring_data + pos, data, part);
+    memcpy (ring_data, data + part, len - part);
+
+    __atomic_store_n (& ring_written, ring_written + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+/* consumer side: contiguous data at the read position */
+static int ring_linear (const char * * data)
+{
+    unsigned written = __atomic_load_n (& ring_written, __ATOMIC_ACQUIRE);
+    unsigned pos = ring_read % ring_size;
+
+    * data = ring_data + pos;
+    return aud::min ((int) (written - ring_read), (int) (ring_size - pos));
+}
+
+static void ring_discard (int len)
+{
+    __atomic_store_n (& ring_read, ring_read + len, __ATOMIC_RELEASE);
+}
+
+static void ring_discard_all ()
+{
+    ring_discard (__atomic_load_n (& ring_written, __ATOMIC_ACQUIRE) - ring_read);
+}
+
+static void set_delay (int frames)
+{
+    __atomic_store_n (& delay_seq, delay_seq + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    __atomic_store_n (& delay_frames, frames, __ATOMIC_RELAXED);
+    __atomic_store_n (& delay_time, now_us (), __ATOMIC_RELAXED);
+
+    __atomic_store_n (& delay_seq, delay_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* hardware delay in milliseconds, estimated from the last published value */
+static int get_published_delay ()
+{
+    unsigned seq;
+    int frames;
+    int64_t time;
+
+    do
+    {
+        seq = __atomic_load_n (& delay_seq, __ATOMIC_ACQUIRE);
+        frames = __atomic_load_n (& delay_frames, __ATOMIC_RELAXED);
+        time = __atomic_load_n (& delay_time, __ATOMIC_RELAXED);
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+    while ((seq & 1) || seq != __atomic_load_n (& delay_seq, __ATOMIC_RELAXED));
+
+    int64_t elapsed = now_us () - time;
+    return aud::max (0, aud::rescale (frames, alsa_rate, 1000) - (int) (elapsed / 1000));
+}
+
+static void reset_stats ()
+{
+    alsa_underruns = 0;
+    stat_wakeups = 0;
+    stat_last_wakeup = 0;
+    stat_jitter_sum = stat_jitter_max = 0;
+}
+
+static void report_stats ()
+{
+    if (stat_wakeups)
+        AUDINFO ("%d underruns; wakeup jitter %.2f ms average, %.2f ms maximum.\n",
+         alsa_underruns, stat_jitter_sum / 1000.0 / stat_wakeups, stat_jitter_max / 1000.0);
+    else
+        AUDINFO ("%d underruns.\n", alsa_underruns);
+}
+
+/* Called when ALSA wakes the pump.  Ideally this happens once per period. */
+static void count_wakeup ()
+{
+    int64_t now = now_us ();
+
+    if (stat_last_wakeup)
+    {
+        int64_t jitter = now - stat_last_wakeup - (int64_t) alsa_period * 1000;
+        jitter = (jitter < 0) ? -jitter : jitter;
+
+        stat_wakeups ++;
+        stat_jitter_sum += jitter;
+        stat_jitter_max = aud::max (stat_jitter_max, jitter);
+    }
+
+    stat_last_wakeup = now;
+}
+
 static bool poll_setup ()
 {
     if (pipe (poll_pipe))
@@ -116,12 +273,13 @@ static bool poll_setup ()
     return true;
 }
 
-static void poll_sleep ()
+/* Waits for ALSA or for poll_wake().  Returns true if woken by ALSA. */
+static bool poll_sleep (bool pipe_only)
 {
-    if (poll (poll_handles, poll_count, -1) < 0)
+    if (poll (poll_handles, pipe_only ? 1 : poll_count, -1) < 0)
     {
         ERROR ("Failed to poll: %s.\n", strerror (errno));
-        return;
+        return false;
     }
 
     if (poll_handles[0].revents & POLLIN)
@@ -129,7 +287,11 @@ static void poll_sleep ()
         char c;
         while (read (poll_pipe[0], & c, 1) == 1)
             ;
+
+        return false;
     }
+
+    return true;
 }
 
 static void poll_wake ()
@@ -146,6 +308,33 @@ static void poll_cleanup ()
     delete[] poll_handles;
 }
 
+static int write_mmap (const char * data, int frames)
+{
+    const snd_pcm_channel_area_t * areas;
+    snd_pcm_uframes_t offset, count = frames;
+
+    int error = snd_pcm_mmap_begin (alsa_handle, & areas, & offset, & count);
+    if (error < 0)
+        return error;
+
+    /* interleaved: all channels share the first area */
+    char * dest = (char *) areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+    memcpy (dest, data, count * alsa_frame_size);
+
+    snd_pcm_sframes_t written = snd_pcm_mmap_commit (alsa_handle, offset, count);
+    if (written < 0)
+        return written;
+
+    if (snd_pcm_state (alsa_handle) == SND_PCM_STATE_PREPARED)
+    {
+        error = snd_pcm_start (alsa_handle);
+        if (error < 0)
+            return error;
+    }
+
+    return written;
+}
+
 static void * pump (void *)
 {
     pthread_mutex_lock (& alsa_mutex);
@@ -157,14 +346,30 @@ static void * pump (void *)
 
     while (! pump_quit)
     {
-        int writable = snd_pcm_bytes_to_frames (alsa_handle, alsa_buffer.linear ());
-
-        if (alsa_prebuffer || alsa_paused || ! writable)
+        if (alsa_prebuffer || alsa_paused)
         {
             pthread_cond_wait (& alsa_cond, & alsa_mutex);
             continue;
         }
 
+        const char * data;
+        int writable = ring_linear (& data) / alsa_frame_size;
+
+        if (! writable)
+        {
+            pthread_mutex_unlock (& alsa_mutex);
+
+            /* check again after raising the flag, so that a write in between
+             * is not missed */
+            __atomic_store_n (& pump_idle, true, __ATOMIC_SEQ_CST);
+            if (ring_len () < alsa_frame_size)
+                poll_sleep (true);
+            __atomic_store_n (& pump_idle, false, __ATOMIC_SEQ_CST);
+
+            pthread_mutex_lock (& alsa_mutex);
+            continue;
+        }
+
         int avail;
         CHECK_VAL_RECOVER (avail, snd_pcm_avail_update, alsa_handle);
 
@@ -173,16 +378,23 @@ static void * pump (void *)
             wakeups_since_write = 0;
 
             int written;
-            CHECK_VAL_RECOVER (written, snd_pcm_writei, alsa_handle,
-             & alsa_buffer[0], aud::min (writable, avail));
+            if (alsa_mmap)
+                CHECK_VAL_RECOVER (written, write_mmap, data, aud::min (writable, avail));
+            else
+                CHECK_VAL_RECOVER (written, snd_pcm_writei, alsa_handle, data,
+                 aud::min (writable, avail));
 
             failed_once = false;
 
-            alsa_buffer.discard (snd_pcm_frames_to_bytes (alsa_handle, written));
+            ring_discard (written * alsa_frame_size);
+
+            snd_pcm_sframes_t delay;
+            if (snd_pcm_delay (alsa_handle, & delay) == 0)
+                set_delay (delay);
 
             pthread_cond_broadcast (& alsa_cond); /* signal write complete */
 
-            if (writable < avail)
+            if (written < avail)
                 continue;
         }
 
@@ -201,7 +413,9 @@ static void * pump (void *)
         }
         else
         {
-            poll_sleep ();
+            if (poll_sleep (false))
+                count_wakeup ();
+
             wakeups_since_write ++;
         }
 
@@ -245,7 +459,8 @@ static void start_playback ()
     CHECK (snd_pcm_prepare, alsa_handle);
 
 FAILED:
-    alsa_prebuffer = false;
+    stat_last_wakeup = 0;
+    __atomic_store_n (& alsa_prebuffer, false, __ATOMIC_RELEASE);
     pthread_cond_broadcast (& alsa_cond);
 }
 
@@ -326,8 +541,18 @@ bool ALSAPlugin::open_audio (int aud_format, int rate, int channels)
     snd_pcm_hw_params_t * params;
     snd_pcm_hw_params_alloca (& params);
     CHECK_NOISY (snd_pcm_hw_params_any, alsa_handle, params);
-    CHECK_NOISY (snd_pcm_hw_params_set_access, alsa_handle, params,
-     SND_PCM_ACCESS_RW_INTERLEAVED);
+    alsa_mmap = aud_get_bool ("alsa", "mmap");
+
+    if (alsa_mmap && snd_pcm_hw_params_set_access (alsa_handle, params,
+     SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0)
+    {
+        AUDWARN ("Memory-mapped transfer not supported; using read/write.\n");
+        alsa_mmap = false;
+    }
+
+    if (! alsa_mmap)
+        CHECK_NOISY (snd_pcm_hw_params_set_access, alsa_handle, params,
+         SND_PCM_ACCESS_RW_INTERLEAVED);
 
     CHECK_NOISY (snd_pcm_hw_params_set_format, alsa_handle, params, format);
     CHECK_NOISY (snd_pcm_hw_params_set_channels, alsa_handle, params, channels);
@@ -356,13 +581,17 @@ bool ALSAPlugin::open_audio (int aud_format, int rate, int channels)
     AUDDBG ("Buffer: hardware %d ms, software %d ms, period %d ms.\n",
      hard_buffer, soft_buffer, alsa_period);
 
+    alsa_frame_size = snd_pcm_frames_to_bytes (alsa_handle, 1);
     buffer_frames = aud::rescale<int64_t> (soft_buffer, 1000, rate);
-    alsa_buffer.alloc (snd_pcm_frames_to_bytes (alsa_handle, buffer_frames));
+    ring_alloc (alsa_frame_size * buffer_frames);
 
     alsa_prebuffer = true;
     alsa_paused = false;
     alsa_paused_delay = 0;
 
+    reset_stats ();
+    set_delay (0);
+
     if (! poll_setup ())
         goto FAILED;
 
@@ -393,7 +622,9 @@ void ALSAPlugin::close_audio ()
     CHECK (snd_pcm_drop, alsa_handle);
 
 FAILED:
-    alsa_buffer.destroy ();
+    report_stats ();
+
+    ring_free ();
     poll_cleanup ();
     snd_pcm_close (alsa_handle);
     alsa_handle = nullptr;
@@ -403,15 +634,11 @@ FAILED:
 
 int ALSAPlugin::write_audio (const void * data, int length)
 {
-    pthread_mutex_lock (& alsa_mutex);
+    length = ring_write ((const char *) data, length);
 
-    length = aud::min (length, alsa_buffer.space ());
-    alsa_buffer.copy_in ((const char *) data, length);
+    if (__atomic_exchange_n (& pump_idle, false, __ATOMIC_SEQ_CST))
+        poll_wake ();
 
-    if (! alsa_paused)
-        pthread_cond_broadcast (& alsa_cond);
-
-    pthread_mutex_unlock (& alsa_mutex);
     return length;
 }
 
@@ -419,15 +646,10 @@ void ALSAPlugin::period_wait ()
 {
     pthread_mutex_lock (& alsa_mutex);
 
-    while (! alsa_buffer.space ())
+    while (ring_len () == (int) ring_size)
     {
-        if (! alsa_paused)
-        {
-            if (alsa_prebuffer)
-                start_playback ();
-            else
-                pthread_cond_broadcast (& alsa_cond);
-        }
+        if (! alsa_paused && alsa_prebuffer)
+            start_playback ();
 
         pthread_cond_wait (& alsa_cond, & alsa_mutex);
     }
@@ -445,7 +667,7 @@ void ALSAPlugin::drain ()
     if (alsa_prebuffer)
         start_playback ();
 
-    while (snd_pcm_bytes_to_frames (alsa_handle, alsa_buffer.len ()))
+    while (ring_len () >= alsa_frame_size)
         pthread_cond_wait (& alsa_cond, & alsa_mutex);
 
     pump_stop ();
@@ -464,17 +686,15 @@ void ALSAPlugin::drain ()
 
 int ALSAPlugin::get_delay ()
 {
-    pthread_mutex_lock (& alsa_mutex);
-
-    int buffered = snd_pcm_bytes_to_frames (alsa_handle, alsa_buffer.len ());
+    int buffered = ring_len () / alsa_frame_size;
     int delay = aud::rescale (buffered, alsa_rate, 1000);
 
-    if (alsa_prebuffer || alsa_paused)
-        delay += alsa_paused_delay;
+    if (__atomic_load_n (& alsa_prebuffer, __ATOMIC_ACQUIRE) ||
+     __atomic_load_n (& alsa_paused, __ATOMIC_ACQUIRE))
+        delay += __atomic_load_n (& alsa_paused_delay, __ATOMIC_ACQUIRE);
     else
-        delay += get_delay_locked ();
+        delay += get_published_delay ();
 
-    pthread_mutex_unlock (& alsa_mutex);
     return delay;
 }
 
@@ -487,10 +707,11 @@ void ALSAPlugin::flush ()
     CHECK (snd_pcm_drop, alsa_handle);
 
 FAILED:
-    alsa_buffer.discard ();
+    ring_discard_all ();
 
-    alsa_prebuffer = true;
-    alsa_paused_delay = 0;
+    __atomic_store_n (& alsa_prebuffer, true, __ATOMIC_RELEASE);
+    __atomic_store_n (& alsa_paused_delay, 0, __ATOMIC_RELEASE);
+    set_delay (0);
 
     pthread_cond_broadcast (& alsa_cond); /* interrupt period wait */
 
@@ -504,19 +725,21 @@ void ALSAPlugin::pause (bool pause)
     AUDDBG ("%sause.\n", pause ? "P" : "Unp");
     pthread_mutex_lock (& alsa_mutex);
 
-    alsa_paused = pause;
+    if (pause && ! alsa_prebuffer)
+        __atomic_store_n (& alsa_paused_delay, get_delay_locked (), __ATOMIC_RELEASE);
 
-    if (! alsa_prebuffer)
-    {
-        if (pause)
-            alsa_paused_delay = get_delay_locked ();
+    __atomic_store_n (& alsa_paused, pause, __ATOMIC_RELEASE);
 
+    if (! alsa_prebuffer)
         CHECK (snd_pcm_pause, alsa_handle, pause);
-    }
 
 DONE:
     if (! pause)
+    {
+        stat_last_wakeup = 0;
+        set_delay (aud::rescale (alsa_paused_delay, 1000, alsa_rate));
         pthread_cond_broadcast (& alsa_cond);
+    }
 
     pthread_mutex_unlock (& alsa_mutex);
     return;
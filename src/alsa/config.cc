@@ -241,6 +241,7 @@ static void guess_element ()
 const char * const ALSAPlugin::defaults[] = {
     "pcm", "default",
     "mixer", "default",
+    "mmap", "FALSE",
     nullptr
 };
 
@@ -301,7 +302,9 @@ const PreferencesWidget ALSAPlugin::widgets[] = {
         {nullptr, mixer_combo_fill}),
     WidgetCombo (N_("Mixer element:"),
         WidgetString ("alsa", "mixer-element", element_changed, "alsa mixer changed"),
-        {nullptr, element_combo_fill})
+        {nullptr, element_combo_fill}),
+    WidgetCheck (N_("Write directly to hardware buffer (mmap)"),
+        WidgetBool ("alsa", "mmap", pcm_changed))
 };
 
 static void alsa_prefs_init ()
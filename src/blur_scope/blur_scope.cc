@@ -24,7 +24,16 @@
  */
 
 #include <math.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include <gtk/gtk.h>
 
@@ -36,7 +45,12 @@
 #define D_WIDTH 64
 #define D_HEIGHT 32
 
+/* the blur is split into bands of rows for images larger than this */
+#define BLUR_SPLIT_PIXELS (256 * 256)
+#define BLUR_MAX_THREADS 4
+
 static void /* GtkWidget */ * bscope_get_color_chooser (void);
+static void pool_stop ();
 
 static const PreferencesWidget bscope_widgets[] = {
     WidgetLabel (N_("<b>Color</b>")),
@@ -73,7 +87,9 @@ public:
 
 private:
     void resize (int w, int h);
-    void draw ();
+    void destroy_image ();
+    void draw (cairo_t * cr);
+    void render ();
 
     void blur ();
     void draw_vert_line (int x, int y1, int y2);
@@ -83,7 +99,18 @@ private:
 
     GtkWidget * area = nullptr;
     int width = 0, height = 0, stride = 0, image_size = 0;
-    uint32_t * image = nullptr, * corner = nullptr;
+
+    /* The blur reads one image and writes the other, so that rows can be
+     * processed independently; each image has a cairo surface of its own,
+     * created once per size. */
+    uint32_t * images[2] = {nullptr, nullptr};
+    cairo_surface_t * surfaces[2] = {nullptr, nullptr};
+    int current = 0;
+
+    /* The latest audio data is only rendered when the widget is painted, so
+     * that at most one frame is rendered per screen update. */
+    float last_pcm[512] = {};
+    bool pcm_pending = false;
 };
 
 EXPORT BlurScope aud_plugin_instance;
@@ -100,33 +127,49 @@ void BlurScope::cleanup ()
 {
     aud_set_int ("BlurScope", "color", bscope_color);
 
-    g_free (image);
-    image = nullptr;
+    destroy_image ();
+    pool_stop ();
+}
+
+void BlurScope::destroy_image ()
+{
+    for (int i = 0; i < 2; i ++)
+    {
+        if (surfaces[i])
+            cairo_surface_destroy (surfaces[i]);
+
+        g_free (images[i]);
+        images[i] = nullptr;
+        surfaces[i] = nullptr;
+    }
 }
 
 void BlurScope::resize (int w, int h)
 {
+    destroy_image ();
+
     width = w;
     height = h;
     stride = width + 2;
     image_size = (stride << 2) * (height + 2);
-    image = (uint32_t *) g_realloc (image, image_size);
-    memset (image, 0, image_size);
-    corner = image + stride + 1;
+
+    /* the one-pixel border around each image stays black */
+    for (int i = 0; i < 2; i ++)
+    {
+        images[i] = (uint32_t *) g_malloc0 (image_size);
+        surfaces[i] = cairo_image_surface_create_for_data
+         ((unsigned char *) (images[i] + stride + 1), CAIRO_FORMAT_RGB24,
+         width, height, stride << 2);
+    }
+
+    current = 0;
 }
 
-void BlurScope::draw ()
+void BlurScope::draw (cairo_t * cr)
 {
-    if (! area || ! gtk_widget_get_window (area))
-        return;
-
-    cairo_t * cr = gdk_cairo_create (gtk_widget_get_window (area));
-    cairo_surface_t * surf = cairo_image_surface_create_for_data
-     ((unsigned char *) image, CAIRO_FORMAT_RGB24, width, height, stride << 2);
-    cairo_set_source_surface (cr, surf, 0, 0);
+    cairo_surface_mark_dirty (surfaces[current]);
+    cairo_set_source_surface (cr, surfaces[current], 0, 0);
     cairo_paint (cr);
-    cairo_surface_destroy (surf);
-    cairo_destroy (cr);
 }
 
 gboolean BlurScope::configure_event (GtkWidget * widget, GdkEventConfigure * event, void * user)
@@ -137,7 +180,17 @@ gboolean BlurScope::configure_event (GtkWidget * widget, GdkEventConfigure * eve
 
 gboolean BlurScope::expose_event (GtkWidget * widget, GdkEventExpose * event, void * user)
 {
-    ((BlurScope *) user)->draw ();
+    BlurScope * scope = (BlurScope *) user;
+
+    if (scope->pcm_pending)
+        scope->render ();
+
+    cairo_t * cr = gdk_cairo_create (gtk_widget_get_window (widget));
+    gdk_cairo_region (cr, event->region);
+    cairo_clip (cr);
+    scope->draw (cr);
+    cairo_destroy (cr);
+
     return TRUE;
 }
 
@@ -159,27 +212,208 @@ void * BlurScope::get_gtk_widget ()
 
 void BlurScope::clear ()
 {
-    memset (image, 0, image_size);
-    draw ();
+    for (uint32_t * image : images)
+    {
+        if (image)
+            memset (image, 0, image_size);
+    }
+
+    pcm_pending = false;
+
+    if (area)
+        gtk_widget_queue_draw (area);
+}
+
+struct BlurRows {
+    const uint32_t * src;
+    uint32_t * dest;
+    int width, stride;
+    int first, last;
+};
+
+/* We do a quick and dirty average of four color values, first masking off the
+ * lowest two bits.  Over a large area, this masking has the net effect of
+ * subtracting 1.5 from each value, which by a happy chance is just right for a
+ * gradual fade effect.  Since the lowest two bits of each channel are zero,
+ * the sum never carries from one channel into the next after the shift. */
+static void blur_rows (const BlurRows & rows)
+{
+    for (int y = rows.first; y < rows.last; y ++)
+    {
+        const uint32_t * p = rows.src + rows.stride * y;
+        const uint32_t * plast = p - rows.stride;
+        const uint32_t * pnext = p + rows.stride;
+        uint32_t * set = rows.dest + rows.stride * y;
+        int x = 0;
+
+#if defined (__SSE2__)
+        __m128i mask = _mm_set1_epi32 (0xFCFCFC);
+        for (; x + 4 <= rows.width; x += 4)
+        {
+            __m128i sum = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *) (plast + x)), mask);
+            sum = _mm_add_epi32 (sum, _mm_and_si128 (_mm_loadu_si128 ((const __m128i *) (p + x - 1)), mask));
+            sum = _mm_add_epi32 (sum, _mm_and_si128 (_mm_loadu_si128 ((const __m128i *) (p + x + 1)), mask));
+            sum = _mm_add_epi32 (sum, _mm_and_si128 (_mm_loadu_si128 ((const __m128i *) (pnext + x)), mask));
+            _mm_storeu_si128 ((__m128i *) (set + x), _mm_srli_epi32 (sum, 2));
+        }
+#elif defined (__ARM_NEON)
+        uint32x4_t mask = vdupq_n_u32 (0xFCFCFC);
+        for (; x + 4 <= rows.width; x += 4)
+        {
+            uint32x4_t sum = vandq_u32 (vld1q_u32 (plast + x), mask);
+            sum = vaddq_u32 (sum, vandq_u32 (vld1q_u32 (p + x - 1), mask));
+            sum = vaddq_u32 (sum, vandq_u32 (vld1q_u32 (p + x + 1), mask));
+            sum = vaddq_u32 (sum, vandq_u32 (vld1q_u32 (pnext + x), mask));
+            vst1q_u32 (set + x, vshrq_n_u32 (sum, 2));
+        }
+#endif
+
+        for (; x < rows.width; x ++)
+            set[x] = ((plast[x] & 0xFCFCFC) + (p[x - 1] & 0xFCFCFC) +
+             (p[x + 1] & 0xFCFCFC) + (pnext[x] & 0xFCFCFC)) >> 2;
+    }
+}
+
+/* Threads for the other bands, started with the first large image and kept
+ * until the plugin is unloaded.  For each frame, blur() sets out the bands in
+ * pool_rows, bumps pool_frame and waits until pool_pending drops to zero. */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_threads[BLUR_MAX_THREADS - 1];
+static BlurRows pool_rows[BLUR_MAX_THREADS - 1];
+static int pool_size;   /* threads started */
+static int pool_active; /* threads with a band in this frame */
+static unsigned pool_frame, pool_start_frame[BLUR_MAX_THREADS - 1];
+static int pool_pending;
+static bool pool_quit;
+
+static void * blur_worker (void * data)
+{
+    int index = (int) (intptr_t) data;
+    unsigned frame = pool_start_frame[index];
+
+    pthread_mutex_lock (& pool_mutex);
+
+    while (1)
+    {
+        while (! pool_quit && pool_frame == frame)
+            pthread_cond_wait (& pool_cond, & pool_mutex);
+
+        if (pool_quit)
+            break;
+
+        frame = pool_frame;
+        if (index >= pool_active)
+            continue;
+
+        BlurRows rows = pool_rows[index];
+        pthread_mutex_unlock (& pool_mutex);
+
+        blur_rows (rows);
+
+        pthread_mutex_lock (& pool_mutex);
+        if (! -- pool_pending)
+            pthread_cond_broadcast (& pool_cond);
+    }
+
+    pthread_mutex_unlock (& pool_mutex);
+    return nullptr;
+}
+
+/* starts threads up to <count>, returning how many are running */
+static int pool_start (int count)
+{
+    while (pool_size < count)
+    {
+        /* pool_frame is only changed by this thread */
+        pool_start_frame[pool_size] = pool_frame;
+
+        if (pthread_create (& pool_threads[pool_size], nullptr, blur_worker,
+         (void *) (intptr_t) pool_size))
+            break;
+
+        pool_size ++;
+    }
+
+    return pool_size;
+}
+
+static void pool_stop ()
+{
+    pthread_mutex_lock (& pool_mutex);
+    pool_quit = true;
+    pthread_cond_broadcast (& pool_cond);
+    pthread_mutex_unlock (& pool_mutex);
+
+    for (int i = 0; i < pool_size; i ++)
+        pthread_join (pool_threads[i], nullptr);
+
+    pool_size = 0;
+    pool_frame = 0;
+    pool_quit = false;
+}
+
+static int blur_threads (int pixels)
+{
+    if (pixels < BLUR_SPLIT_PIXELS)
+        return 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    return aud::clamp ((int) sysconf (_SC_NPROCESSORS_ONLN), 1, BLUR_MAX_THREADS);
+#else
+    return 1;
+#endif
 }
 
 void BlurScope::blur ()
 {
-    for (int y = 0; y < height; y ++)
+    int next = current ^ 1;
+    int threads = aud::min (blur_threads (width * height), height);
+
+    /* if threads cannot be started, there are fewer bands */
+    if (threads > 1)
+        threads = pool_start (threads - 1) + 1;
+
+    BlurRows rows[BLUR_MAX_THREADS];
+
+    for (int i = 0; i < threads; i ++)
     {
-        uint32_t * p = corner + stride * y;
-        uint32_t * end = p + width;
-        uint32_t * plast = p - stride;
-        uint32_t * pnext = p + stride;
-
-        /* We do a quick and dirty average of four color values, first masking
-         * off the lowest two bits.  Over a large area, this masking has the net
-         * effect of subtracting 1.5 from each value, which by a happy chance
-         * is just right for a gradual fade effect. */
-        for (; p < end; p ++)
-            * p = ((* plast ++ & 0xFCFCFC) + (p[-1] & 0xFCFCFC) + (p[1] &
-             0xFCFCFC) + (* pnext ++ & 0xFCFCFC)) >> 2;
+        rows[i].src = images[current] + stride + 1;
+        rows[i].dest = images[next] + stride + 1;
+        rows[i].width = width;
+        rows[i].stride = stride;
+        rows[i].first = height * i / threads;
+        rows[i].last = height * (i + 1) / threads;
     }
+
+    if (threads > 1)
+    {
+        pthread_mutex_lock (& pool_mutex);
+
+        for (int i = 1; i < threads; i ++)
+            pool_rows[i - 1] = rows[i];
+
+        pool_active = pool_pending = threads - 1;
+        pool_frame ++;
+
+        pthread_cond_broadcast (& pool_cond);
+        pthread_mutex_unlock (& pool_mutex);
+    }
+
+    /* the first band is done in this thread */
+    blur_rows (rows[0]);
+
+    if (threads > 1)
+    {
+        pthread_mutex_lock (& pool_mutex);
+
+        while (pool_pending)
+            pthread_cond_wait (& pool_cond, & pool_mutex);
+
+        pthread_mutex_unlock (& pool_mutex);
+    }
+
+    current = next;
 }
 
 void BlurScope::draw_vert_line (int x, int y1, int y2)
@@ -190,28 +424,40 @@ void BlurScope::draw_vert_line (int x, int y1, int y2)
     else if (y2 < y1) {y = y2; h = y1 - y2;}
     else {y = y1; h = 1;}
 
-    uint32_t * p = corner + y * stride + x;
+    uint32_t * p = images[current] + (y + 1) * stride + x + 1;
 
     for (; h --; p += stride)
         * p = bscope_color;
 }
 
-void BlurScope::render_mono_pcm (const float * pcm)
+void BlurScope::render ()
 {
     blur ();
 
-    int prev_y = (0.5 + pcm[0]) * height;
+    int prev_y = (0.5 + last_pcm[0]) * height;
     prev_y = aud::clamp (prev_y, 0, height - 1);
 
     for (int i = 0; i < width; i ++)
     {
-        int y = (0.5 + pcm[i * 512 / width]) * height;
+        int y = (0.5 + last_pcm[i * 512 / width]) * height;
         y = aud::clamp (y, 0, height - 1);
         draw_vert_line (i, prev_y, y);
         prev_y = y;
     }
 
-    draw ();
+    pcm_pending = false;
+}
+
+void BlurScope::render_mono_pcm (const float * pcm)
+{
+    memcpy (last_pcm, pcm, sizeof last_pcm);
+
+    /* GDK merges repeated requests until the next repaint */
+    if (! pcm_pending && area)
+    {
+        pcm_pending = true;
+        gtk_widget_queue_draw (area);
+    }
 }
 
 static void color_set_cb (GtkWidget * chooser)
@@ -30,6 +30,8 @@
 #include <libaudgui/libaudgui.h>
 #include <libaudgui/libaudgui-gtk.h>
 
+#include "spectrum-analysis.h"
+
 #define MAX_BANDS   (256)
 #define VIS_DELAY 2 /* delay before falloff in frames */
 #define VIS_FALLOFF 2 /* falloff in pixels per frame */
@@ -37,62 +39,73 @@
 class CairoSpectrum : public VisPlugin
 {
 public:
+    static const PluginPreferences prefs;
     static constexpr PluginInfo info = {
         N_("Spectrum Analyzer"),
-        PACKAGE
+        PACKAGE,
+        nullptr,
+        & prefs
     };
 
-    constexpr CairoSpectrum () : VisPlugin (info, Visualizer::Freq) {}
+    constexpr CairoSpectrum () : VisPlugin (info, Visualizer::MonoPCM) {}
+
+    bool init ();
+    void cleanup ();
 
     void * get_gtk_widget ();
 
     void clear ();
-    void render_freq (const float * freq);
+    void render_mono_pcm (const float * pcm);
 };
 
 EXPORT CairoSpectrum aud_plugin_instance;
 
+const PluginPreferences CairoSpectrum::prefs = {{spectrum_widgets}};
+
 static GtkWidget * spect_widget = nullptr;
-static float xscale[MAX_BANDS + 1];
+static SpectrumAnalyzer analyzer;
+static SpectrumBands spectrum_bands;
 static int width, height, bands;
 static int bars[MAX_BANDS + 1];
 static int delay[MAX_BANDS + 1];
 
-static void calculate_xscale ()
+bool CairoSpectrum::init ()
 {
-    for (int i = 0; i <= bands; i ++)
-        xscale[i] = powf (256, (float) i / bands) - 0.5f;
+    analyzer.init ();
+    return true;
 }
 
-void CairoSpectrum::render_freq (const float * freq)
+void CairoSpectrum::cleanup ()
 {
-    if (! bands)
-        return;
+    analyzer.cleanup ();
+}
 
-    for (int i = 0; i < bands; i ++)
+void CairoSpectrum::render_mono_pcm (const float * pcm)
+{
+    const float * power = analyzer.analyze (pcm);
+
+    int requested = width / 10;
+    spectrum_bands.update (analyzer, aud::clamp (requested, 12, MAX_BANDS));
+
+    int new_bands = aud::min (spectrum_bands.bands (), MAX_BANDS);
+    if (new_bands != bands)
     {
-        int a = ceilf (xscale[i]);
-        int b = floorf (xscale[i + 1]);
-        float n = 0;
+        bands = new_bands;
+        memset (bars, 0, sizeof bars);
+        memset (delay, 0, sizeof delay);
+    }
 
-        if (b < a)
-            n += freq[b] * (xscale[i + 1] - xscale[i]);
-        else
-        {
-            if (a > 0)
-                n += freq[a - 1] * (a - xscale[i]);
-            for (; a < b; a ++)
-                n += freq[a];
-            if (b < 256)
-                n += freq[b] * (xscale[i + 1] - b);
-        }
+    float levels[MAX_BANDS];
+    spectrum_bands.compute (power, levels);
 
-        /* fudge factor to make the graph have the same overall height as a
-           12-band one no matter how many bands there are */
-        n *= (float) bands / 12;
+    /* fudge factor to make the graph have the same overall height as a
+       12-band one no matter how many bands there are */
+    float fudge = 10 * log10f ((float) bands / 12);
 
+    for (int i = 0; i < bands; i ++)
+    {
         /* 40 dB range */
-        int x = 40 + 20 * log10f (n);
+        int x = 40 + levels[i] + fudge;
         x = aud::clamp (x, 0, 40);
 
         bars[i] -= aud::max (0, VIS_FALLOFF - delay[i]);
@@ -113,6 +126,8 @@ void CairoSpectrum::render_freq (const float * freq)
 
 void CairoSpectrum::clear ()
 {
+    analyzer.reset ();
+
     memset (bars, 0, sizeof bars);
     memset (delay, 0, sizeof delay);
 
@@ -232,10 +247,6 @@ static gboolean configure_event (GtkWidget * widget, GdkEventConfigure * event)
     height = event->height;
     gtk_widget_queue_draw(widget);
 
-    bands = width / 10;
-    bands = aud::clamp(bands, 12, MAX_BANDS);
-    calculate_xscale ();
-
     return TRUE;
 }
 
@@ -22,33 +22,81 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include <libaudcore/i18n.h>
 #include <libaudcore/plugin.h>
 #include <libaudcore/preferences.h>
 #include <libaudcore/ringbuf.h>
 #include <libaudcore/runtime.h>
 
-/* Response time adjustments.  Maybe this should be adjustable? */
-#define CHUNK_TIME 0.2f /* seconds */
-#define CHUNKS 5
-#define DECAY 0.3f
+/* This is a feed-forward compressor with a look-ahead delay.  The detector
+ * (the "sidechain") looks at the undelayed input, while the gain it computes
+ * is applied to the delayed signal, so that with an attack time shorter than
+ * the look-ahead, the gain is already down by the time a transient reaches
+ * the output.  All channels share one detector so that the stereo image does
+ * not shift. */
+
+enum {
+    DETECT_PEAK,
+    DETECT_RMS
+};
+
+#define MAX_LOOKAHEAD 100 /* milliseconds */
 
-/* What is a "normal" volume?  Replay Gain stuff claims to use 89 dB, but what
- * does that translate to in our PCM range? */
 static const char * const compressor_defaults[] = {
-    "center", "0.5",
-    "range", "0.5",
+    "threshold", "-20",
+    "ratio", "4",
+    "knee", "6",
+    "attack", "10",
+    "release", "200",
+    "lookahead", "5",
+    "makeup", "0",
+    "detector", aud::numeric_string<DETECT_RMS>::str,
      nullptr
 };
 
+static void params_changed ();
+
+static const ComboItem detector_list[] = {
+    ComboItem (N_("Peak"), DETECT_PEAK),
+    ComboItem (N_("RMS"), DETECT_RMS)
+};
+
 static const PreferencesWidget compressor_widgets[] = {
     WidgetLabel (N_("<b>Compression</b>")),
-    WidgetSpin (N_("Center volume:"),
-        WidgetFloat ("compressor", "center"),
-        {0.1, 1, 0.1}),
-    WidgetSpin (N_("Dynamic range:"),
-        WidgetFloat ("compressor", "range"),
-        {0.0, 3.0, 0.1})
+    WidgetSpin (N_("Threshold:"),
+        WidgetFloat ("compressor", "threshold", params_changed),
+        {-60, 0, 1, N_("dB")}),
+    WidgetSpin (N_("Ratio:"),
+        WidgetFloat ("compressor", "ratio", params_changed),
+        {1, 30, 0.5, N_(": 1")}),
+    WidgetSpin (N_("Knee:"),
+        WidgetFloat ("compressor", "knee", params_changed),
+        {0, 24, 1, N_("dB")}),
+    WidgetSpin (N_("Makeup gain:"),
+        WidgetFloat ("compressor", "makeup", params_changed),
+        {0, 24, 0.5, N_("dB")}),
+    WidgetLabel (N_("<b>Timing</b>")),
+    WidgetSpin (N_("Attack:"),
+        WidgetFloat ("compressor", "attack", params_changed),
+        {0.1, 200, 0.5, N_("ms")}),
+    WidgetSpin (N_("Release:"),
+        WidgetFloat ("compressor", "release", params_changed),
+        {10, 2000, 10, N_("ms")}),
+    WidgetSpin (N_("Look-ahead:"),
+        WidgetFloat ("compressor", "lookahead"),
+        {0, MAX_LOOKAHEAD, 1, N_("ms")}),
+    WidgetCombo (N_("Detector:"),
+        WidgetInt ("compressor", "detector", params_changed),
+        {{detector_list}})
 };
 
 static const PluginPreferences compressor_prefs = {{compressor_widgets}};
@@ -81,45 +129,212 @@ public:
 
 EXPORT Compressor aud_plugin_instance;
 
-/* The read pointer of the ring buffer is kept aligned to the chunk size at all
- * times.  To preserve the alignment, each read from the buffer must either (a)
- * read a multiple of the chunk size or (b) empty the buffer completely.  Writes
- * to the buffer need not be aligned to the chunk size. */
+/* The look-ahead buffer holds the delayed audio.  Once it is full, every new
+ * frame coming in pushes the oldest frame out, and the gain computed from the
+ * new frame is applied to the one pushed out. */
 
-static RingBuf<float> buffer, peaks;
-static Index<float> output;
-static int chunk_size;
-static float current_peak;
+static RingBuf<float> buffer;
+static Index<float> output, detect, gains;
 static int current_channels, current_rate;
+static int lookahead; /* frames */
+
+/* Settings are read from the config at the start of a block, and only when
+ * the preferences window says they have changed. */
+static std::atomic<bool> params_dirty;
 
-/* I used to find the maximum sample and take that as the peak, but that doesn't
- * work well on badly clipped tracks.  Now, I use the highly sophisticated
- * method of averaging the absolute value of the samples and multiplying by 6, a
- * number proved by experiment (on exactly three files) to best approximate the
- * actual peak. */
+static float threshold, ratio_inv, knee, makeup;
+static float attack_coef, release_coef;
+static int detector;
 
-static float calc_peak (float * data, int length)
+/* detector envelope (linear amplitude for peak, mean square for RMS) */
+static float envelope;
+
+static void params_changed ()
 {
-    float sum = 0;
+    params_dirty.store (true);
+}
 
-    float * end = data + length;
-    while (data < end)
-        sum += fabsf (* data ++);
+static void load_params ()
+{
+    threshold = aud_get_double ("compressor", "threshold");
+    ratio_inv = 1.0f / aud::max (aud_get_double ("compressor", "ratio"), 1.0);
+    knee = aud::max (aud_get_double ("compressor", "knee"), 0.0);
+    makeup = aud_get_double ("compressor", "makeup");
+    detector = aud_get_int ("compressor", "detector");
+
+    float attack = aud::max (aud_get_double ("compressor", "attack"), 0.01) / 1000;
+    float release = aud::max (aud_get_double ("compressor", "release"), 0.01) / 1000;
+    attack_coef = expf (-1.0f / (attack * current_rate));
+    release_coef = expf (-1.0f / (release * current_rate));
+}
 
-    return aud::max (0.01f, sum / length * 6);
+#if defined (__SSE__)
+#define HAVE_VEC4
+typedef __m128 vec4;
+static inline vec4 vec4_set1 (float f) { return _mm_set1_ps (f); }
+static inline vec4 vec4_load (const float * p) { return _mm_loadu_ps (p); }
+static inline void vec4_store (float * p, vec4 v) { _mm_storeu_ps (p, v); }
+static inline vec4 vec4_mul (vec4 a, vec4 b) { return _mm_mul_ps (a, b); }
+static inline vec4 vec4_add (vec4 a, vec4 b) { return _mm_add_ps (a, b); }
+static inline vec4 vec4_max (vec4 a, vec4 b) { return _mm_max_ps (a, b); }
+static inline vec4 vec4_abs (vec4 v) { return _mm_andnot_ps (_mm_set1_ps (-0.0f), v); }
+static inline vec4 vec4_dup_lo (vec4 v) { return _mm_unpacklo_ps (v, v); }
+static inline vec4 vec4_dup_hi (vec4 v) { return _mm_unpackhi_ps (v, v); }
+/* splits (L0 R0 L1 R1) (L2 R2 L3 R3) into (L0 L1 L2 L3) and (R0 R1 R2 R3) */
+static inline void vec4_deinterleave (vec4 a, vec4 b, vec4 & l, vec4 & r)
+{
+    l = _mm_shuffle_ps (a, b, _MM_SHUFFLE (2, 0, 2, 0));
+    r = _mm_shuffle_ps (a, b, _MM_SHUFFLE (3, 1, 3, 1));
 }
+#elif defined (__ARM_NEON)
+#define HAVE_VEC4
+typedef float32x4_t vec4;
+static inline vec4 vec4_set1 (float f) { return vdupq_n_f32 (f); }
+static inline vec4 vec4_load (const float * p) { return vld1q_f32 (p); }
+static inline void vec4_store (float * p, vec4 v) { vst1q_f32 (p, v); }
+static inline vec4 vec4_mul (vec4 a, vec4 b) { return vmulq_f32 (a, b); }
+static inline vec4 vec4_add (vec4 a, vec4 b) { return vaddq_f32 (a, b); }
+static inline vec4 vec4_max (vec4 a, vec4 b) { return vmaxq_f32 (a, b); }
+static inline vec4 vec4_abs (vec4 v) { return vabsq_f32 (v); }
+static inline vec4 vec4_dup_lo (vec4 v) { return vzipq_f32 (v, v).val[0]; }
+static inline vec4 vec4_dup_hi (vec4 v) { return vzipq_f32 (v, v).val[1]; }
+static inline void vec4_deinterleave (vec4 a, vec4 b, vec4 & l, vec4 & r)
+{
+    float32x4x2_t u = vuzpq_f32 (a, b);
+    l = u.val[0];
+    r = u.val[1];
+}
+#endif
 
-static void do_ramp (float * data, int length, float peak_a, float peak_b)
+/* Fills <det> with the detector input for each frame of <data>: the largest
+ * absolute value across channels (peak) or the mean square (RMS). */
+static void run_detector (const float * data, float * det, int frames)
 {
-    float center = aud_get_double ("compressor", "center");
-    float range = aud_get_double ("compressor", "range");
-    float a = powf (peak_a / center, range - 1);
-    float b = powf (peak_b / center, range - 1);
+    int ch = current_channels;
+    int f = 0;
 
-    for (int count = 0; count < length; count ++)
+#ifdef HAVE_VEC4
+    if (ch == 2)
     {
-        * data = (* data) * (a * (length - count) + b * count) / length;
-        data ++;
+        for (; f + 4 <= frames; f += 4, data += 8)
+        {
+            vec4 l, r;
+            vec4_deinterleave (vec4_load (data), vec4_load (data + 4), l, r);
+
+            if (detector == DETECT_PEAK)
+                vec4_store (det + f, vec4_max (vec4_abs (l), vec4_abs (r)));
+            else
+                vec4_store (det + f, vec4_mul (vec4_add (vec4_mul (l, l),
+                 vec4_mul (r, r)), vec4_set1 (0.5f)));
+        }
+    }
+    else if (ch == 1)
+    {
+        for (; f + 4 <= frames; f += 4, data += 4)
+        {
+            vec4 v = vec4_load (data);
+            vec4_store (det + f, (detector == DETECT_PEAK) ? vec4_abs (v) : vec4_mul (v, v));
+        }
+    }
+#endif
+
+    for (; f < frames; f ++)
+    {
+        float level = 0;
+
+        if (detector == DETECT_PEAK)
+        {
+            for (int c = 0; c < ch; c ++)
+                level = aud::max (level, fabsf (* data ++));
+        }
+        else
+        {
+            for (int c = 0; c < ch; c ++, data ++)
+                level += (* data) * (* data);
+
+            level /= ch;
+        }
+
+        det[f] = level;
+    }
+}
+
+/* Static gain curve with a soft knee, in decibels.  Returns the (negative)
+ * gain change for an input level of <x> dB. */
+static float gain_curve (float x)
+{
+    float over = x - threshold;
+
+    if (2 * over < -knee)
+        return 0;
+
+    /* strict, so that a zero-width knee never divides by zero */
+    if (2 * over < knee)
+    {
+        float t = over + knee / 2;
+        return (ratio_inv - 1) * t * t / (2 * knee);
+    }
+
+    return (ratio_inv - 1) * over;
+}
+
+/* Runs the envelope follower over <det> and replaces each entry with the
+ * linear gain to apply (including makeup gain).  The envelope is inherently
+ * sequential; below the knee, where most material sits, no logarithms are
+ * needed at all. */
+static void run_envelope (float * det, int frames)
+{
+    float makeup_lin = powf (10, makeup / 20);
+    float knee_start = threshold - knee / 2;
+
+    /* compare envelope to the knee in its own domain to skip the log */
+    float knee_lin = (detector == DETECT_PEAK) ? powf (10, knee_start / 20) :
+     powf (10, knee_start / 10);
+    float db_scale = (detector == DETECT_PEAK) ? 20 : 10;
+
+    float env = envelope;
+
+    for (int f = 0; f < frames; f ++)
+    {
+        float level = det[f];
+        float coef = (level > env) ? attack_coef : release_coef;
+        env = level + coef * (env - level);
+
+        if (env <= knee_lin)
+            det[f] = makeup_lin;
+        else
+            det[f] = makeup_lin * powf (10, gain_curve (db_scale * log10f (env)) / 20);
+    }
+
+    envelope = env;
+}
+
+/* multiplies each frame of <data> by the matching entry of <gain> */
+static void apply_gain (float * data, const float * gain, int frames)
+{
+    int f = 0;
+
+#ifdef HAVE_VEC4
+    if (current_channels == 1)
+    {
+        for (; f + 4 <= frames; f += 4, data += 4)
+            vec4_store (data, vec4_mul (vec4_load (data), vec4_load (gain + f)));
+    }
+    else if (current_channels == 2)
+    {
+        for (; f + 4 <= frames; f += 4, data += 8)
+        {
+            vec4 g = vec4_load (gain + f);
+            vec4_store (data, vec4_mul (vec4_load (data), vec4_dup_lo (g)));
+            vec4_store (data + 4, vec4_mul (vec4_load (data + 4), vec4_dup_hi (g)));
+        }
+    }
+#endif
+
+    for (; f < frames; f ++)
+    {
+        for (int c = 0; c < current_channels; c ++)
+            (* data ++) *= gain[f];
     }
 }
 
@@ -132,8 +347,9 @@ bool Compressor::init ()
 void Compressor::cleanup ()
 {
     buffer.destroy ();
-    peaks.destroy ();
     output.clear ();
+    detect.clear ();
+    gains.clear ();
 }
 
 void Compressor::start (int & channels, int & rate)
@@ -141,64 +357,71 @@ void Compressor::start (int & channels, int & rate)
     current_channels = channels;
     current_rate = rate;
 
-    chunk_size = channels * (int) (rate * CHUNK_TIME);
+    double ms = aud::clamp (aud_get_double ("compressor", "lookahead"), 0.0, (double) MAX_LOOKAHEAD);
+    lookahead = (int) (rate * ms / 1000);
+
+    /* room for the look-ahead plus a generous block; grows if needed */
+    buffer.destroy ();
+    buffer.alloc (channels * (lookahead + rate / 2));
 
-    buffer.alloc (chunk_size * CHUNKS);
-    peaks.alloc (CHUNKS);
+    load_params ();
+    params_dirty.store (false);
 
     flush (true);
 }
 
-Index<float> & Compressor::process (Index<float> & data)
+/* Takes <frames> new frames, which may be silence at the end of a song, and
+ * moves as many delayed frames as possible to the output with their gain. */
+static void run (const float * data, int frames)
 {
-    output.resize (0);
-
-    int offset = 0;
-    int remain = data.len ();
+    if (params_dirty.exchange (false))
+        load_params ();
 
-    while (1)
-    {
-        int writable = aud::min (remain, buffer.space ());
-
-        buffer.copy_in (& data[offset], writable);
+    int ch = current_channels;
+    int buffered = buffer.len () / ch;
 
-        offset += writable;
-        remain -= writable;
+    detect.resize (frames);
 
-        if (buffer.space ())
-            break;
+    if (data)
+        run_detector (data, detect.begin (), frames);
+    else
+        memset (detect.begin (), 0, sizeof (float) * frames);
 
-        while (peaks.len () < CHUNKS)
-            peaks.push (calc_peak (& buffer[chunk_size * peaks.len ()], chunk_size));
+    run_envelope (detect.begin (), frames);
 
-        if (current_peak == 0.0f)
-        {
-            for (int i = 0; i < CHUNKS; i ++)
-                current_peak = aud::max (current_peak, peaks[i]);
-        }
-
-        float new_peak = aud::max (peaks[0], current_peak * (1.0f - DECAY));
+    if (data)
+    {
+        if (buffer.space () < ch * frames)
+            buffer.alloc (buffer.len () + ch * (frames + current_rate / 2));
 
-        for (int count = 1; count < CHUNKS; count ++)
-            new_peak = aud::max (new_peak, current_peak + (peaks[count] - current_peak) / count);
+        buffer.copy_in (data, ch * frames);
+    }
 
-        do_ramp (& buffer[0], chunk_size, current_peak, new_peak);
+    /* the gain computed from new frame i belongs to delayed frame
+     * i - (lookahead - buffered); when flushing out with silence, <frames>
+     * equals the look-ahead and the new frames are not buffered */
+    int skip = aud::max (lookahead - buffered, 0);
+    int ready = frames - skip;
 
-        buffer.move_out (output, -1, chunk_size);
+    if (ready <= 0)
+        return;
 
-        current_peak = new_peak;
-        peaks.pop ();
-    }
+    int pos = output.len ();
+    buffer.move_out (output, -1, ch * ready);
+    apply_gain (& output[pos], & detect[skip], ready);
+}
 
+Index<float> & Compressor::process (Index<float> & data)
+{
+    output.resize (0);
+    run (data.begin (), data.len () / current_channels);
     return output;
 }
 
 bool Compressor::flush (bool force)
 {
     buffer.discard ();
-    peaks.discard ();
-
-    current_peak = 0.0f;
+    envelope = 0;
     return true;
 }
 
@@ -206,22 +429,14 @@ Index<float> & Compressor::finish (Index<float> & data, bool end_of_playlist)
 {
     output.resize (0);
 
-    peaks.discard ();
-
-    while (buffer.len ())
-    {
-        int writable = buffer.linear ();
-
-        if (current_peak != 0.0f)
-            do_ramp (& buffer[0], writable, current_peak, current_peak);
-
-        buffer.move_out (output, -1, writable);
-    }
+    run (data.begin (), data.len () / current_channels);
 
-    if (current_peak != 0.0f)
-        do_ramp (data.begin (), data.len (), current_peak, current_peak);
+    /* push the delayed audio out by feeding the detector silence */
+    run (nullptr, lookahead);
 
-    output.insert (data.begin (), -1, data.len ());
+    /* anything left (look-ahead changed mid-song) goes out as is */
+    if (buffer.len ())
+        buffer.move_out (output, -1, -1);
 
     return output;
 }
@@ -17,9 +17,11 @@
 #include "plugin.h"
 #include "Music_Emu.h"
 #include "Gzip_Reader.h"
+#include "file-view.h"
 
 static const int fade_threshold = 10 * 1000;
 static const int fade_length    = 8 * 1000;
+static const int checkpoint_interval = 5 * 1000;
 
 static bool log_err(blargg_err_t err)
 {
@@ -57,12 +59,15 @@ public:
     ~ConsoleFileHandler();
 
 private:
+    VFSFile &m_file;
+    FileView m_view;          // file data, referred to by m_emu if loaded from it
     char m_header[4];
     Vfs_File_Reader vfs_in;
     Gzip_Reader gzip_in;
 };
 
-ConsoleFileHandler::ConsoleFileHandler(const char *path, VFSFile &fd)
+ConsoleFileHandler::ConsoleFileHandler(const char *path, VFSFile &fd) :
+    m_file(fd)
 {
     m_emu   = nullptr;
     m_type  = 0;
@@ -111,10 +116,22 @@ int ConsoleFileHandler::load(int sample_rate)
         return 1;
     }
 
-    // combine header with remaining file data
-    Remaining_Reader reader(m_header, sizeof(m_header), &gzip_in);
-    if (log_err(m_emu->load(reader)))
-        return 1;
+    // uncompressed files are loaded in place from a view of the whole file;
+    // otherwise combine header with remaining inflated data
+    int64_t size = m_file.fsize();
+    if (!gzip_in.deflated() && size >= 0 && size <= FILE_VIEW_MAX &&
+     m_file.fseek(0, VFS_SEEK_SET) == 0)
+    {
+        m_view.open(m_file);
+        if (log_err(m_emu->load_mem(m_view.begin(), m_view.len())))
+            return 1;
+    }
+    else
+    {
+        Remaining_Reader reader(m_header, sizeof(m_header), &gzip_in);
+        if (log_err(m_emu->load(reader)))
+            return 1;
+    }
 
     // files can be closed now
     gzip_in.close();
@@ -255,6 +272,9 @@ bool ConsolePlugin::play(const char *filename, VFSFile &file)
     }
 
     // start track
+    fh.m_emu->set_checkpoints(audcfg.seek_memory ? checkpoint_interval : 0,
+     audcfg.seek_memory * 1024L * 1024);
+
     if (log_err(fh.m_emu->start_track(fh.m_track)))
         return false;
 
@@ -1,6 +1,7 @@
 // Blip_Buffer 0.4.1. http://www.slack.net/~ant/
 
 #include "Blip_Buffer.h"
+#include "blargg_common.h"
 
 #include <assert.h>
 #include <limits.h>
@@ -187,6 +188,18 @@ void Blip_Buffer::remove_samples( long count )
 	}
 }
 
+void Blip_Buffer::snapshot( Gme_State& s )
+{
+	if ( s.loading() )
+		clear();
+
+	// only the ends of band-limited steps extending past the current time remain
+	s.copy( buffer_, blip_buffer_extra_ * sizeof *buffer_ );
+	s.copy( offset_ );
+	s.copy( reader_accum_ );
+	s.copy( modified_ );
+}
+
 // Blip_Synth_
 
 Blip_Synth_Fast_::Blip_Synth_Fast_()
@@ -18,6 +18,8 @@ typedef blip_long blip_time_t;
 
 // Output samples are 16-bit signed, with a range of -32768 to 32767
 typedef short blip_sample_t;
+
+class Gme_State;
 enum { blip_sample_max = 32767 };
 
 class Blip_Buffer {
@@ -70,6 +72,10 @@ public:
 	// Remove 'count' samples from those waiting to be read
 	void remove_samples( long count );
 
+	// Copy state, for restoring into this same object (see Gme_State). There must be
+	// no samples waiting to be read.
+	void snapshot( Gme_State& );
+
 // Experimental features
 
 	// Count number of clocks needed until 'count' samples will be available.
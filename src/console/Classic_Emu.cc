@@ -103,6 +103,9 @@ blargg_err_t Classic_Emu::play_( long count, sample_t* out )
 		remain -= buf->read_samples( &out [count - remain], remain );
 		if ( remain )
 		{
+			// buffer is empty, so a checkpoint can be saved
+			save_checkpoint( remain );
+
 			if ( buf_changed_count != buf->channels_changed_count() )
 			{
 				buf_changed_count = buf->channels_changed_count();
@@ -118,6 +121,16 @@ blargg_err_t Classic_Emu::play_( long count, sample_t* out )
 	return 0;
 }
 
+bool Classic_Emu::can_snapshot_() const
+{
+	return !buf->samples_avail();
+}
+
+void Classic_Emu::snapshot_buffer( Gme_State& s )
+{
+	buf->snapshot( s );
+}
+
 // Rom_Data
 
 blargg_err_t Rom_Data_::load_rom_data_( Data_Reader& in,
@@ -32,6 +32,9 @@ protected:
 	void mute_voices_( int );
 	void set_equalizer_( equalizer_t const& );
 	blargg_err_t play_( long, sample_t* );
+	bool can_snapshot_() const;
+	// Copies output buffer state; for use by snapshot_()
+	void snapshot_buffer( Gme_State& );
 private:
 	Multi_Buffer* buf;
 	Multi_Buffer* stereo_buffer; // nullptr if using custom buffer
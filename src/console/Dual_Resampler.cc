@@ -47,6 +47,13 @@ void Dual_Resampler::resize( int pairs )
 	}
 }
 
+void Dual_Resampler::snapshot( Gme_State& s )
+{
+	s.copy( sample_buf.begin(), sample_buf.size() * sizeof sample_buf [0] );
+	s.copy( buf_pos );
+	resampler.snapshot( s );
+}
+
 void Dual_Resampler::play_frame_( Blip_Buffer& blip_buf, dsample_t* out )
 {
 	long pair_count = sample_buf_size >> 1;
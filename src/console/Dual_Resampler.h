@@ -21,6 +21,9 @@ public:
 
 	void dual_play( long count, dsample_t* out, Blip_Buffer& );
 
+	// Copy state, for restoring into this same object (see Gme_State)
+	void snapshot( Gme_State& );
+
 protected:
 	virtual int play_frame( blip_time_t, int pcm_count, dsample_t* pcm_out ) = 0;
 private:
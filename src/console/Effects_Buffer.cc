@@ -222,6 +222,19 @@ Effects_Buffer::channel_t Effects_Buffer::channel( int i, int type )
 	return chan_types [out];
 }
 
+void Effects_Buffer::snapshot( Gme_State& s )
+{
+	for ( int i = 0; i < buf_count; i++ )
+		bufs [i].snapshot( s );
+	s.copy( stereo_remain );
+	s.copy( effect_remain );
+	s.copy( effects_enabled );
+	s.copy( echo_buf.begin(), echo_buf.size() * sizeof echo_buf [0] );
+	s.copy( reverb_buf.begin(), reverb_buf.size() * sizeof reverb_buf [0] );
+	s.copy( echo_pos );
+	s.copy( reverb_pos );
+}
+
 void Effects_Buffer::end_frame( blip_time_t clock_count )
 {
 	int bufs_used = 0;
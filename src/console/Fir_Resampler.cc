@@ -184,6 +184,15 @@ int Fir_Resampler_::avail_( blargg_long input_count ) const
 	return output_count;
 }
 
+void Fir_Resampler_::snapshot( Gme_State& s )
+{
+	long pos = write_pos - buf.begin();
+	s.copy( buf.begin(), buf.size() * sizeof buf [0] );
+	s.copy( pos );
+	s.copy( imp_phase );
+	write_pos = buf.begin() + pos;
+}
+
 int Fir_Resampler_::skip_input( long count )
 {
 	int remain = write_pos - buf.begin();
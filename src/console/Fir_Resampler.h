@@ -45,6 +45,9 @@ public:
 	// Skip 'count' input samples. Returns number of samples actually skipped.
 	int skip_input( long count );
 
+	// Copy state, for restoring into this same object (see Gme_State)
+	void snapshot( Gme_State& );
+
 // Output
 
 	// Number of extra input samples needed until 'count' output samples are available
@@ -12,6 +12,9 @@ public:
 	error_t open( File_Reader* );
 	void close();
 
+	// True if file is gzipped and is being inflated
+	bool deflated() const { return inflater.deflated(); }
+
 public:
 	Gzip_Reader();
 	~Gzip_Reader();
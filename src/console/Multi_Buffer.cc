@@ -93,6 +93,20 @@ void Stereo_Buffer::clear()
 		bufs [i].clear();
 }
 
+void Multi_Buffer::snapshot( Gme_State& s )
+{
+	if ( s.loading() )
+		clear();
+}
+
+void Stereo_Buffer::snapshot( Gme_State& s )
+{
+	for ( int i = 0; i < buf_count; i++ )
+		bufs [i].snapshot( s );
+	s.copy( stereo_added );
+	s.copy( was_stereo );
+}
+
 void Stereo_Buffer::end_frame( blip_time_t clock_count )
 {
 	stereo_added = 0;
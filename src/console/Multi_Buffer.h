@@ -51,6 +51,10 @@ public:
 	virtual long read_samples( blip_sample_t*, long ) = 0;
 	virtual long samples_avail() const = 0;
 
+	// Copy state, for restoring into this same object (see Gme_State). There must be
+	// no samples waiting to be read. By default, loading just clears the buffer.
+	virtual void snapshot( Gme_State& );
+
 protected:
 	void channels_changed() { channels_changed_count_++; }
 private:
@@ -83,6 +87,7 @@ public:
 	long read_samples( blip_sample_t* p, long s ) { return buf.read_samples( p, s ); }
 	channel_t channel( int, int ) { return chan; }
 	void end_frame( blip_time_t t ) { buf.end_frame( t ); }
+	void snapshot( Gme_State& s ) { buf.snapshot( s ); }
 };
 
 // Uses three buffers (one for center) and outputs stereo sample pairs.
@@ -106,6 +111,7 @@ public:
 
 	long samples_avail() const { return bufs [0].samples_avail() * 2; }
 	long read_samples( blip_sample_t*, long );
+	void snapshot( Gme_State& );
 
 private:
 	enum { buf_count = 3 };
@@ -38,6 +38,7 @@ void Music_Emu::clear_track_vars()
 	silence_time     = 0;
 	silence_count    = 0;
 	buf_remain       = 0;
+	saving_checkpoints = false;
 	warning(); // clear warning
 }
 
@@ -45,6 +46,9 @@ void Music_Emu::unload()
 {
 	voice_count_ = 0;
 	clear_track_vars();
+	clear_checkpoints();
+	checkpoint_data.clear();
+	checkpoint_times.clear();
 	Gme_File::unload();
 }
 
@@ -64,6 +68,10 @@ Music_Emu::Music_Emu()
 	equalizer_.treble   = -1.0;
 	equalizer_.bass     = 60;
 
+	checkpoint_interval_msec = 0;
+	checkpoint_budget        = 0;
+	clear_checkpoints();
+
 	static const char* const names [] = {
 		"Voice 1", "Voice 2", "Voice 3", "Voice 4",
 		"Voice 5", "Voice 6", "Voice 7", "Voice 8"
@@ -131,6 +139,7 @@ void Music_Emu::post_load_()
 
 blargg_err_t Music_Emu::start_track( int track )
 {
+	int prev_track = current_track_;
 	clear_track_vars();
 
 	int remapped = track;
@@ -156,6 +165,27 @@ blargg_err_t Music_Emu::start_track( int track )
 		silence_time  = 0;
 		silence_count = 0;
 	}
+
+	// emulation is deterministic, so checkpoints remain valid when restarting the same track
+	if ( track != prev_track || !state_size )
+	{
+		clear_checkpoints();
+		if ( checkpoint_interval_msec > 0 )
+		{
+			Gme_State counter( 0, false );
+			if ( snapshot_( counter ) && counter.size() )
+			{
+				max_checkpoints = checkpoint_budget / counter.size();
+				if ( max_checkpoints >= 2 && !checkpoint_times.resize( max_checkpoints ) )
+				{
+					state_size = counter.size();
+					checkpoint_interval = msec_to_samples( checkpoint_interval_msec );
+				}
+			}
+		}
+	}
+	saving_checkpoints = (state_size != 0);
+
 	return track_ended() ? warning() : 0;
 }
 
@@ -187,8 +217,14 @@ long Music_Emu::tell() const
 blargg_err_t Music_Emu::seek( long msec )
 {
 	blargg_long time = msec_to_samples( msec );
-	if ( time < out_time )
+
+	// resume from the nearest checkpoint if that saves going back or emulating forward
+	int index = find_checkpoint( time );
+	if ( index >= 0 && (time < out_time || checkpoint_times [index] > out_time) )
+		restore_checkpoint( index );
+	else if ( time < out_time )
 		RETURN_ERR( start_track( current_track_ ) );
+
 	return skip( time - out_time );
 }
 
@@ -208,11 +244,22 @@ blargg_err_t Music_Emu::skip( long count )
 		count -= n;
 	}
 
-	if ( count && !emu_track_ended_ )
+	// skip in steps so that checkpoints are saved along the way
+	while ( count && !emu_track_ended_ )
 	{
-		emu_time += count;
-		end_track_if_error( skip_( count ) );
+		long n = count;
+		if ( saving_checkpoints )
+		{
+			blargg_long due = checkpoint_due( emu_time ) & ~1;
+			if ( due > 0 && n > due )
+				n = due;
+		}
+		count -= n;
+		emu_time += n;
+		end_track_if_error( skip_( n ) );
+		save_checkpoint();
 	}
+	emu_time += count;
 
 	if ( !(silence_count | buf_remain) ) // caught up to emulator, so update track ended
 		track_ended_ |= emu_track_ended_;
@@ -222,6 +269,10 @@ blargg_err_t Music_Emu::skip( long count )
 
 blargg_err_t Music_Emu::skip_( long count )
 {
+	// emu_time is kept current while playing, so play_() can save checkpoints
+	blargg_long const end_time = emu_time;
+	blargg_err_t err = 0;
+
 	// for long skip, mute sound
 	const long threshold = 30000;
 	if ( count > threshold )
@@ -229,24 +280,115 @@ blargg_err_t Music_Emu::skip_( long count )
 		int saved_mute = mute_mask_;
 		mute_voices( ~0 );
 
-		while ( count > threshold / 2 && !emu_track_ended_ )
+		while ( count > threshold / 2 && !emu_track_ended_ && !err )
 		{
-			RETURN_ERR( play_( buf_size, buf.begin() ) );
+			emu_time = end_time - count + buf_size;
+			err = play_( buf_size, buf.begin() );
 			count -= buf_size;
 		}
 
 		mute_voices( saved_mute );
 	}
 
-	while ( count && !emu_track_ended_ )
+	while ( count && !emu_track_ended_ && !err )
 	{
 		long n = buf_size;
 		if ( n > count )
 			n = count;
 		count -= n;
-		RETURN_ERR( play_( n, buf.begin() ) );
+		emu_time = end_time - count;
+		err = play_( n, buf.begin() );
 	}
-	return 0;
+
+	emu_time = end_time;
+	return err;
+}
+
+// Checkpoints
+
+void Music_Emu::set_checkpoints( long interval_msec, long budget )
+{
+	checkpoint_interval_msec = interval_msec;
+	checkpoint_budget        = budget;
+	clear_checkpoints();
+}
+
+void Music_Emu::clear_checkpoints()
+{
+	state_size          = 0;
+	max_checkpoints     = 0;
+	checkpoint_count    = 0;
+	checkpoint_interval = 0;
+	saving_checkpoints  = false;
+}
+
+// number of samples from time until the next checkpoint should be saved
+blargg_long Music_Emu::checkpoint_due( blargg_long time ) const
+{
+	blargg_long last = checkpoint_count ? checkpoint_times [checkpoint_count - 1] : 0;
+	return last + checkpoint_interval - time;
+}
+
+void Music_Emu::save_checkpoint( long unplayed )
+{
+	blargg_long time = emu_time - unplayed;
+	if ( !saving_checkpoints || emu_track_ended_ || checkpoint_due( time ) > 0 || !can_snapshot_() )
+		return;
+
+	if ( checkpoint_count >= max_checkpoints )
+	{
+		// out of space, so keep every other checkpoint and double the interval
+		int n = 0;
+		for ( int i = 1; i < checkpoint_count; i += 2, n++ )
+		{
+			checkpoint_times [n] = checkpoint_times [i];
+			memcpy( &checkpoint_data [n * state_size], &checkpoint_data [i * state_size], state_size );
+		}
+		checkpoint_count = n;
+		checkpoint_interval *= 2;
+
+		if ( checkpoint_due( time ) > 0 )
+			return;
+	}
+
+	if ( checkpoint_data.size() < (size_t) (checkpoint_count + 1) * state_size )
+	{
+		// grow gradually, since most tracks never need the whole budget
+		int capacity = min( max( checkpoint_count * 2, 4 ), max_checkpoints );
+		if ( checkpoint_data.resize( capacity * state_size ) )
+		{
+			saving_checkpoints = false;
+			return;
+		}
+	}
+
+	Gme_State out( &checkpoint_data [checkpoint_count * state_size], false );
+	snapshot_( out );
+	checkpoint_times [checkpoint_count++] = time;
+}
+
+// index of last checkpoint at or before time, or -1 if there is none
+int Music_Emu::find_checkpoint( blargg_long time ) const
+{
+	int index = checkpoint_count - 1;
+	while ( index >= 0 && checkpoint_times [index] > time )
+		index--;
+	return index;
+}
+
+void Music_Emu::restore_checkpoint( int index )
+{
+	Gme_State in( &checkpoint_data [index * state_size], true );
+	snapshot_( in );
+	remute_voices();
+
+	out_time         = checkpoint_times [index];
+	emu_time         = out_time;
+	emu_track_ended_ = false;
+	track_ended_     = false;
+	silence_time     = emu_time;
+	silence_count    = 0;
+	buf_remain       = 0;
 }
 
 // Fading
@@ -292,9 +434,14 @@ void Music_Emu::emu_play( long count, sample_t* out )
 	check( current_track_ >= 0 );
 	emu_time += count;
 	if ( current_track_ >= 0 && !emu_track_ended_ )
+	{
 		end_track_if_error( play_( count, out ) );
+		save_checkpoint();
+	}
 	else
+	{
 		memset( out, 0, count * sizeof *out );
+	}
 }
 
 // number of consecutive silent samples at end
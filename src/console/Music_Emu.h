@@ -57,6 +57,14 @@ public:
 	// Disable automatic end-of-track detection and skipping of silence at beginning
 	void ignore_silence( bool disable = true );
 
+	// While playing and seeking, save emulator state about every 'interval_msec', using
+	// at most 'budget' bytes, so that seek() can resume from the nearest saved state rather
+	// than emulating from the beginning of the track. When the budget is used up, every
+	// other checkpoint is dropped and the interval doubled. An interval of 0 disables
+	// checkpoints. Has no effect if the emulator can't save its state. Takes effect at the
+	// next start_track().
+	void set_checkpoints( long interval_msec, long budget );
+
 	// Info for current track
 	using Gme_File::track_info;
 	blargg_err_t track_info( track_info_t* out ) const;
@@ -122,6 +130,15 @@ protected:
 	virtual blargg_err_t start_track_( int ) = 0; // tempo is set before this
 	virtual blargg_err_t play_( long count, sample_t* out ) = 0;
 	virtual blargg_err_t skip_( long count );
+
+	// Copies the emulator's state through 's', for checkpoints. Returns false if this
+	// isn't supported.
+	virtual bool snapshot_( Gme_State& s ) { return false; }
+	// False while output is buffered that snapshot_() doesn't copy
+	virtual bool can_snapshot_() const { return true; }
+	// Saves a checkpoint if one is due. Done after each play_() and skip_(); play_()
+	// can also call it part way through, with the count of samples it has yet to generate.
+	void save_checkpoint( long unplayed = 0 );
 protected:
 	virtual void unload();
 	virtual void pre_load();
@@ -164,6 +181,21 @@ private:
 	void fill_buf();
 	void emu_play( long count, sample_t* out );
 
+	// checkpoints
+	blargg_vector<unsigned char> checkpoint_data;
+	blargg_vector<blargg_long> checkpoint_times; // emu_time of each checkpoint
+	long checkpoint_interval_msec;
+	long checkpoint_budget;
+	long state_size;          // 0 if checkpoints are disabled
+	int max_checkpoints;
+	int checkpoint_count;
+	blargg_long checkpoint_interval; // in samples
+	bool saving_checkpoints;  // false while skipping initial silence
+	void clear_checkpoints();
+	blargg_long checkpoint_due( blargg_long time ) const;
+	int find_checkpoint( blargg_long time ) const;
+	void restore_checkpoint( int index );
+
 	Multi_Buffer* effects_buffer;
 	friend Music_Emu* gme_new_emu( gme_type_t, int );
 	friend void gme_set_stereo_depth( Music_Emu*, double );
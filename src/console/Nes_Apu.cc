@@ -115,6 +115,25 @@ void Nes_Apu::reset( bool pal_mode, int initial_dmc_dac )
 		dmc.last_amp = initial_dmc_dac; // prevent output transition
 }
 
+void Nes_Apu::snapshot( Gme_State& s )
+{
+	s.copy( square1 );
+	s.copy( square2 );
+	s.copy( noise );
+	s.copy( triangle );
+	s.copy( dmc );
+	s.copy( last_time );
+	s.copy( last_dmc_time );
+	s.copy( earliest_irq_ );
+	s.copy( next_irq );
+	s.copy( frame_period );
+	s.copy( frame_delay );
+	s.copy( frame );
+	s.copy( osc_enables );
+	s.copy( frame_mode );
+	s.copy( irq_flag );
+}
+
 void Nes_Apu::irq_changed()
 {
 	nes_time_t new_irq = dmc.next_irq;
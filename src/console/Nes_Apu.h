@@ -57,6 +57,9 @@ public:
 	void save_state( apu_state_t* out ) const;
 	void load_state( apu_state_t const& );
 
+	// Copy emulation state, for restoring into this same object (see Gme_State)
+	void snapshot( Gme_State& );
+
 	// Set overall volume (default is 1.0)
 	void volume( double );
 
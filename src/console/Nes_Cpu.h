@@ -61,6 +61,9 @@ public:
 	// CPU invokes bad opcode handler if it encounters this
 	enum { bad_opcode = 0xF2 };
 
+	// Copy emulation state, including low_mem (see Gme_State). Only valid outside run().
+	void snapshot( Gme_State& );
+
 public:
 	Nes_Cpu() { state = &state_; }
 	enum { page_bits = 11 };
@@ -104,6 +107,16 @@ inline void Nes_Cpu::set_irq_time( nes_time_t t )
 	state->time += update_end_time( end_time_, (irq_time_ = t) );
 }
 
+inline void Nes_Cpu::snapshot( Gme_State& s )
+{
+	s.copy( low_mem );
+	s.copy( r );
+	s.copy( state_ );
+	s.copy( irq_time_ );
+	s.copy( end_time_ );
+	s.copy( error_count_ );
+}
+
 inline void Nes_Cpu::set_end_time( nes_time_t t )
 {
 	state->time += update_end_time( (end_time_ = t), irq_time_ );
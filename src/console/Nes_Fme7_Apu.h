@@ -29,6 +29,15 @@ public:
 	void save_state( fme7_apu_state_t* ) const;
 	void load_state( fme7_apu_state_t const& );
 
+	// Copy emulation state, for restoring into this same object (see Gme_State)
+	void snapshot( Gme_State& s )
+	{
+		fme7_apu_state_t* state = this;
+		s.copy( *state );
+		s.copy( oscs );
+		s.copy( last_time );
+	}
+
 	// Mask and addresses of registers
 	enum { addr_mask = 0xE000 };
 	enum { data_addr = 0xE000 };
@@ -33,6 +33,15 @@ public:
 	void save_state( namco_state_t* out ) const;
 	void load_state( namco_state_t const& );
 
+	// Copy emulation state, for restoring into this same object (see Gme_State)
+	void snapshot( Gme_State& s )
+	{
+		s.copy( oscs );
+		s.copy( last_time );
+		s.copy( addr_reg );
+		s.copy( reg );
+	}
+
 	Nes_Namco_Apu();
 
 private:
@@ -22,6 +22,13 @@ public:
 	void save_state( vrc6_apu_state_t* ) const;
 	void load_state( vrc6_apu_state_t const& );
 
+	// Copy emulation state, for restoring into this same object (see Gme_State)
+	void snapshot( Gme_State& s )
+	{
+		s.copy( oscs );
+		s.copy( last_time );
+	}
+
 	// Oscillator 0 write-only registers are at $9000-$9002
 	// Oscillator 1 write-only registers are at $A000-$A002
 	// Oscillator 2 write-only registers are at $B000-$B002
@@ -485,6 +485,28 @@ blargg_err_t Nsf_Emu::start_track_( int track )
 	return 0;
 }
 
+bool Nsf_Emu::snapshot_( Gme_State& s )
+{
+	cpu::snapshot( s );
+	s.copy( saved_state );
+	s.copy( next_play );
+	s.copy( play_extra );
+	s.copy( play_ready );
+	s.copy( sram );
+	apu.snapshot( s );
+
+	#if !NSF_EMU_APU_ONLY
+	{
+		if ( namco ) namco->snapshot( s );
+		if ( vrc6  ) vrc6 ->snapshot( s );
+		if ( fme7  ) fme7 ->snapshot( s );
+	}
+	#endif
+
+	snapshot_buffer( s );
+	return true;
+}
+
 blargg_err_t Nsf_Emu::run_clocks( blip_time_t& duration, int )
 {
 	set_time( 0 );
@@ -255,6 +255,16 @@ void Sms_Apu::run_until( blip_time_t end_time )
 	}
 }
 
+void Sms_Apu::snapshot( Gme_State& s )
+{
+	s.copy( squares );
+	s.copy( last_time );
+	s.copy( latch );
+	s.copy( noise );
+	s.copy( noise_feedback );
+	s.copy( looped_feedback );
+}
+
 void Sms_Apu::end_frame( blip_time_t end_time )
 {
 	if ( end_time > last_time )
@@ -42,6 +42,9 @@ public:
 	// start a new frame at time 0.
 	void end_frame( blip_time_t );
 
+	// Copy emulation state, for restoring into this same object (see Gme_State)
+	void snapshot( Gme_State& );
+
 public:
 	Sms_Apu();
 	~Sms_Apu();
@@ -348,6 +348,12 @@ blargg_err_t Snes_Spc::play( int count, sample_t* out )
 	return err;
 }
 
+void Snes_Spc::snapshot( Gme_State& s )
+{
+	dsp.snapshot( s );
+	s.copy( m );
+}
+
 blargg_err_t Snes_Spc::skip( int count )
 {
 	#if SPC_LESS_ACCURATE
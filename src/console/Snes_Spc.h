@@ -82,6 +82,9 @@ public:
 	// Skips count samples. Several times faster than play() when using fast DSP.
 	blargg_err_t skip( int count );
 
+	// Copies emulation state (see Gme_State)
+	void snapshot( Gme_State& );
+
 // State save/load (only available with accurate DSP)
 
 #if !SPC_NO_COPY_STATE_FUNCS
@@ -50,6 +50,9 @@ public:
 	// If true, prevents channels and global volumes from being phase-negated
 	void disable_surround( bool disable = true );
 
+	// Copies emulation state (see Gme_State)
+	void snapshot( Gme_State& s ) { s.copy( m ); }
+
 // State
 
 	// Resets DSP and uses supplied values to initialize registers
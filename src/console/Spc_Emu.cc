@@ -311,24 +311,33 @@ blargg_err_t Spc_Emu::play_and_filter( long count, sample_t out [] )
 
 blargg_err_t Spc_Emu::skip_( long count )
 {
+	// eliminate pop due to resampler by playing the last few samples
+	const int resampler_latency = 64;
+	long play_count = min( count, (long) resampler_latency );
+	count -= play_count;
+
 	if ( sample_rate() != native_sample_rate )
 	{
 		count = long (count * resampler.ratio()) & ~1;
 		count -= resampler.skip_input( count );
 	}
 
-	// TODO: shouldn't skip be adjusted for the 64 samples read afterwards?
-
 	if ( count > 0 )
 	{
 		RETURN_ERR( apu.skip( count ) );
 		filter.clear();
 	}
 
-	// eliminate pop due to resampler
-	const int resampler_latency = 64;
 	sample_t buf [resampler_latency];
-	return play_( resampler_latency, buf );
+	return play_( play_count, buf );
+}
+
+bool Spc_Emu::snapshot_( Gme_State& s )
+{
+	apu.snapshot( s );
+	s.copy( filter );
+	resampler.snapshot( s );
+	return true;
 }
 
 blargg_err_t Spc_Emu::play_( long count, sample_t* out )
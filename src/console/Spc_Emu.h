@@ -67,6 +67,7 @@ protected:
 	void mute_voices_( int );
 	void set_tempo_( double );
 	void enable_accuracy_( bool );
+	bool snapshot_( Gme_State& );
 private:
 	byte const* file_data;
 	long        file_size;
@@ -399,6 +399,36 @@ blargg_err_t Vgm_Emu::start_track_( int track )
 	return 0;
 }
 
+bool Vgm_Emu::snapshot_( Gme_State& s )
+{
+	s.copy( vgm_time );
+	s.copy( pos );
+	s.copy( pcm_data );
+	s.copy( pcm_pos );
+	s.copy( dac_amp );
+	s.copy( dac_disabled );
+	s.copy( fm_time_offset );
+	psg.snapshot( s );
+
+	if ( uses_fm )
+	{
+		ym2612.snapshot( s );
+		ym2413.snapshot( s );
+		blip_buf.snapshot( s );
+		Dual_Resampler::snapshot( s );
+	}
+	else
+	{
+		snapshot_buffer( s );
+	}
+	return true;
+}
+
+bool Vgm_Emu::can_snapshot_() const
+{
+	return uses_fm || Classic_Emu::can_snapshot_();
+}
+
 blargg_err_t Vgm_Emu::run_clocks( blip_time_t& time_io, int msec )
 {
 	time_io = run_commands( msec * vgm_rate / 1000 );
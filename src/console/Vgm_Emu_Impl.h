@@ -22,6 +22,14 @@ public:
 	bool enabled() const            { return last_time != disabled_time; }
 	void begin_frame( short* p );
 	int run_until( int time );
+	void snapshot( Gme_State& s )
+	{
+		if ( enabled() )
+		{
+			s.copy( last_time );
+			Emu::snapshot( s );
+		}
+	}
 };
 
 class Vgm_Emu_Impl : public Classic_Emu, private Dual_Resampler {
@@ -2145,6 +2145,7 @@ OPLL_calc_stereo (OPLL * opll, e_int32 out[2])
 
 // Ym2413_Emu
 #include "Ym2413_Emu.h"
+#include "blargg_common.h"
 
 #include <assert.h>
 
@@ -2203,6 +2204,11 @@ void Ym2413_Emu::mute_voices( int mask )
 	OPLL_setMask( opll, mask );
 }
 
+void Ym2413_Emu::snapshot( Gme_State& s )
+{
+	s.copy( opll, sizeof *opll );
+}
+
 void Ym2413_Emu::run( int pair_count, sample_t* out )
 {
 	while ( pair_count-- )
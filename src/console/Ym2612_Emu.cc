@@ -3,6 +3,7 @@
 // Based on Gens 2.10 ym2612.c
 
 #include "Ym2612_Emu.h"
+#include "blargg_common.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -961,6 +962,12 @@ void Ym2612_Emu::write1( int addr, int data )
 
 void Ym2612_Emu::mute_voices( int mask ) { impl->mute_mask = mask; }
 
+void Ym2612_Emu::snapshot( Gme_State& s )
+{
+	s.copy( impl->YM2612 );
+	s.copy( impl->g.LFOcnt );
+}
+
 static void update_envelope_( slot_t* sl )
 {
 	switch ( sl->Ecurp )
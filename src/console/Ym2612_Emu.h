@@ -5,6 +5,7 @@
 #define YM2612_EMU_H
 
 struct Ym2612_Impl;
+class Gme_State;
 
 class Ym2612_Emu  {
 	Ym2612_Impl* impl;
@@ -33,6 +34,9 @@ public:
 	typedef short sample_t;
 	enum { out_chan_count = 2 }; // stereo
 	void run( int pair_count, sample_t* out );
+
+	// Copy emulation state, for restoring into this same object (see Gme_State)
+	void snapshot( Gme_State& );
 };
 
 #endif
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <limits.h>
+#include <string.h>
 
 #include <new>
 
@@ -55,6 +56,35 @@ public:
 	}
 };
 
+// Gme_State - copies emulator state to or from a snapshot. Snapshots are only ever
+// restored into the object they were taken from, so members can be copied byte for
+// byte, including pointers to data owned by the emulator. With a null buffer, just
+// adds up the size needed.
+class Gme_State {
+	unsigned char* pos;
+	long size_;
+	bool loading_;
+public:
+	Gme_State( void* buf, bool loading ) :
+			pos( (unsigned char*) buf ), size_( 0 ), loading_( loading ) { }
+	long size() const { return size_; }
+	bool loading() const { return loading_; }
+	void copy( void* p, long n )
+	{
+		if ( pos )
+		{
+			if ( loading_ )
+				memcpy( p, pos, n );
+			else
+				memcpy( pos, p, n );
+			pos += n;
+		}
+		size_ += n;
+	}
+	template<class T>
+	void copy( T& t ) { copy( &t, sizeof t ); }
+};
+
 // BLARGG_4CHAR('a','b','c','d') = 'abcd' (four character integer constant)
 #define BLARGG_4CHAR( a, b, c, d ) \
 	((a&0xFF)*0x1000000L + (b&0xFF)*0x10000L + (c&0xFF)*0x100L + (d&0xFF))
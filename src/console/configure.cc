@@ -26,6 +26,7 @@ const char * const ConsolePlugin::defaults[] = {
  "ignore_spc_length", "FALSE",
  "echo", "0",
  "inc_spc_reverb", "FALSE",
+ "seek_memory", "16",
  nullptr};
 
 bool ConsolePlugin::init ()
@@ -40,6 +41,7 @@ bool ConsolePlugin::init ()
     audcfg.ignore_spc_length = aud_get_bool (CON_CFGID, "ignore_spc_length");
     audcfg.echo = aud_get_int (CON_CFGID, "echo");
     audcfg.inc_spc_reverb = aud_get_bool (CON_CFGID, "inc_spc_reverb");
+    audcfg.seek_memory = aud_get_int (CON_CFGID, "seek_memory");
 
     return true;
 }
@@ -54,4 +56,5 @@ void ConsolePlugin::cleanup ()
     aud_set_bool (CON_CFGID, "ignore_spc_length", audcfg.ignore_spc_length);
     aud_set_int (CON_CFGID, "echo", audcfg.echo);
     aud_set_bool (CON_CFGID, "inc_spc_reverb", audcfg.inc_spc_reverb);
+    aud_set_int (CON_CFGID, "seek_memory", audcfg.seek_memory);
 }
@@ -18,6 +18,7 @@ typedef struct {
 	bool ignore_spc_length; /* if true, ignore length from SPC tags */
 	int echo;                  /* 0 to +100 */
 	bool inc_spc_reverb;    /* if true, increases the default reverb */
+	int seek_memory;           /* MB of checkpoints kept for seeking, 0 to disable */
 } AudaciousConsoleConfig;
 
 extern AudaciousConsoleConfig audcfg;
@@ -46,6 +46,10 @@ const PreferencesWidget ConsolePlugin::widgets[] = {
         WidgetInt (audcfg.resample_rate),
         {11025, 96000, 100, N_("Hz")},
         WIDGET_CHILD),
+    WidgetLabel (N_("<b>Seeking</b>")),
+    WidgetSpin (N_("Memory for seek checkpoints:"),
+        WidgetInt (audcfg.seek_memory),
+        {0, 256, 1, N_("MB")}),
     WidgetLabel (N_("<b>SPC</b>")),
     WidgetCheck (N_("Ignore length from SPC tags"),
         WidgetBool (audcfg.ignore_spc_length)),
@@ -17,12 +17,25 @@
  * the use of this software.
  */
 
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include <libaudcore/i18n.h>
-#include <libaudcore/interface.h>
 #include <libaudcore/plugin.h>
 #include <libaudcore/preferences.h>
+#include <libaudcore/ringbuf.h>
 #include <libaudcore/runtime.h>
 
+#include "channel-matrix.h"
+#include "polyphase.h"
+
 enum
 {
     STATE_OFF,
@@ -32,11 +45,19 @@ enum
     STATE_FLUSHED
 };
 
+enum
+{
+    CURVE_LINEAR,
+    CURVE_EQUAL_POWER,
+    CURVE_S_CURVE
+};
+
 static const char * const crossfade_defaults[] = {
     "automatic", "TRUE",
     "length", "5",
     "manual", "TRUE",
     "manual_length", "0.2",
+    "curve", "0",
     nullptr
 };
 
@@ -44,6 +65,12 @@ static const char crossfade_about[] =
  N_("Crossfade Plugin for Audacious\n"
     "Copyright 2010-2014 John Lindgren");
 
+static const ComboItem curve_list[] = {
+    ComboItem (N_("Linear"), CURVE_LINEAR),
+    ComboItem (N_("Equal power"), CURVE_EQUAL_POWER),
+    ComboItem (N_("S-curve"), CURVE_S_CURVE)
+};
+
 static const PreferencesWidget crossfade_widgets[] = {
     WidgetLabel (N_("<b>Crossfade</b>")),
     WidgetCheck (N_("On automatic song change"),
@@ -58,6 +85,9 @@ static const PreferencesWidget crossfade_widgets[] = {
         WidgetFloat ("crossfade", "manual_length"),
         {0.1, 3.0, 0.1, N_("seconds")},
         WIDGET_CHILD),
+    WidgetCombo (N_("Fade curve:"),
+        WidgetInt ("crossfade", "curve"),
+        {{curve_list}}),
     WidgetLabel (N_("<b>Tip</b>")),
     WidgetLabel (N_("For better crossfading, enable\n"
                     "the Silence Removal effect."))
@@ -76,7 +106,8 @@ public:
     };
 
     /* order #5: must be after resample and mixer */
-    constexpr Crossfade () : EffectPlugin (info, 5, true) {}
+    /* does not preserve format: may convert a song to match the previous one */
+    constexpr Crossfade () : EffectPlugin (info, 5, false) {}
 
     bool init ();
     void cleanup ();
@@ -92,16 +123,105 @@ EXPORT Crossfade aud_plugin_instance;
 
 static char state = STATE_OFF;
 static int current_channels = 0, current_rate = 0;
-static Index<float> buffer, output;
+static RingBuf<float> buffer;
+static Index<float> output;
 static int fadein_point;
 
+/* Gain tables for the current transition, one entry per frame.  They are baked
+ * once when the fade begins so that the ramps need no per-sample math. */
+static Index<float> fadeout_gain, fadein_gain;
+static int baked_curve = -1;
+
+/* When a song differs in channel count or sample rate from the one before it,
+ * it is converted on the fly to the format already established downstream, so
+ * that the overlap can still happen without reopening the output.  Downmixing
+ * is done before resampling and upmixing after, so that the resampler always
+ * runs on the smaller number of channels. */
+static bool bridging;
+static int input_channels, input_rate;
+static bool mix_first;
+static Index<float> bridge_matrix;
+static PolyphaseResampler bridge_resampler;
+static Index<float> bridge_buf, bridge_temp;
+
+static void stop_bridge ()
+{
+    bridging = false;
+    bridge_matrix.clear ();
+    bridge_resampler.destroy ();
+    bridge_buf.clear ();
+    bridge_temp.clear ();
+}
+
+static void start_bridge (int channels, int rate)
+{
+    stop_bridge ();
+
+    AUDINFO ("Converting %d channels at %d Hz to %d channels at %d Hz.\n",
+     channels, rate, current_channels, current_rate);
+
+    bridging = true;
+    input_channels = channels;
+    input_rate = rate;
+    mix_first = (current_channels < channels);
+
+    if (channels != current_channels &&
+     ! channel_matrix_get (channels, current_channels, bridge_matrix))
+        channel_matrix_get_passthrough (channels, current_channels, bridge_matrix);
+
+    bridge_resampler.init (mix_first ? current_channels : channels, rate, current_rate);
+}
+
+static void bridge_mix (const Index<float> & in, Index<float> & out)
+{
+    int frames = in.len () / input_channels;
+    out.resize (current_channels * frames);
+
+    channel_matrix_apply (bridge_matrix.begin (), input_channels,
+     current_channels, in.begin (), out.begin (), frames);
+}
+
+static Index<float> & bridge_process (Index<float> & data, bool drain)
+{
+    if (! bridge_matrix.len ())
+    {
+        bridge_buf.resize (0);
+        bridge_resampler.process (data.begin (), data.len (), bridge_buf);
+        if (drain)
+            bridge_resampler.drain (bridge_buf);
+    }
+    else if (mix_first)
+    {
+        bridge_mix (data, bridge_temp);
+        bridge_buf.resize (0);
+        bridge_resampler.process (bridge_temp.begin (), bridge_temp.len (), bridge_buf);
+        if (drain)
+            bridge_resampler.drain (bridge_buf);
+    }
+    else
+    {
+        bridge_temp.resize (0);
+        bridge_resampler.process (data.begin (), data.len (), bridge_temp);
+        if (drain)
+            bridge_resampler.drain (bridge_temp);
+        bridge_mix (bridge_temp, bridge_buf);
+    }
+
+    return bridge_buf;
+}
+
 static void reset ()
 {
+    stop_bridge ();
+
     state = STATE_OFF;
     current_channels = 0;
     current_rate = 0;
-    buffer.clear ();
+    buffer.destroy ();
     output.clear ();
+    fadeout_gain.clear ();
+    fadein_gain.clear ();
+    baked_curve = -1;
 }
 
 bool Crossfade::init ()
@@ -115,19 +235,143 @@ void Crossfade::cleanup ()
     reset ();
 }
 
-static void do_ramp (float * data, int length, float a, float b)
+#if defined (__SSE__)
+#define HAVE_VEC4
+typedef __m128 vec4;
+static inline vec4 vec4_load (const float * p) { return _mm_loadu_ps (p); }
+static inline void vec4_store (float * p, vec4 v) { _mm_storeu_ps (p, v); }
+static inline vec4 vec4_mul (vec4 a, vec4 b) { return _mm_mul_ps (a, b); }
+static inline vec4 vec4_add (vec4 a, vec4 b) { return _mm_add_ps (a, b); }
+static inline vec4 vec4_dup_lo (vec4 v) { return _mm_unpacklo_ps (v, v); }
+static inline vec4 vec4_dup_hi (vec4 v) { return _mm_unpackhi_ps (v, v); }
+#elif defined (__ARM_NEON)
+#define HAVE_VEC4
+typedef float32x4_t vec4;
+static inline vec4 vec4_load (const float * p) { return vld1q_f32 (p); }
+static inline void vec4_store (float * p, vec4 v) { vst1q_f32 (p, v); }
+static inline vec4 vec4_mul (vec4 a, vec4 b) { return vmulq_f32 (a, b); }
+static inline vec4 vec4_add (vec4 a, vec4 b) { return vaddq_f32 (a, b); }
+static inline vec4 vec4_dup_lo (vec4 v) { return vzipq_f32 (v, v).val[0]; }
+static inline vec4 vec4_dup_hi (vec4 v) { return vzipq_f32 (v, v).val[1]; }
+#endif
+
+/* multiplies each frame of <data> by the matching entry of <gain> */
+static void apply_gain (float * data, const float * gain, int frames)
+{
+    int f = 0;
+
+#ifdef HAVE_VEC4
+    if (current_channels == 1)
+    {
+        for (; f + 4 <= frames; f += 4, data += 4)
+            vec4_store (data, vec4_mul (vec4_load (data), vec4_load (gain + f)));
+    }
+    else if (current_channels == 2)
+    {
+        for (; f + 4 <= frames; f += 4, data += 8)
+        {
+            vec4 g = vec4_load (gain + f);
+            vec4_store (data, vec4_mul (vec4_load (data), vec4_dup_lo (g)));
+            vec4_store (data + 4, vec4_mul (vec4_load (data + 4), vec4_dup_hi (g)));
+        }
+    }
+#endif
+
+    for (; f < frames; f ++)
+    {
+        for (int c = 0; c < current_channels; c ++)
+            (* data ++) *= gain[f];
+    }
+}
+
+/* adds each frame of <add>, scaled by the matching entry of <gain>, to <data> */
+static void mix_gain (float * data, const float * add, const float * gain, int frames)
+{
+    int f = 0;
+
+#ifdef HAVE_VEC4
+    if (current_channels == 1)
+    {
+        for (; f + 4 <= frames; f += 4, data += 4, add += 4)
+            vec4_store (data, vec4_add (vec4_load (data),
+             vec4_mul (vec4_load (add), vec4_load (gain + f))));
+    }
+    else if (current_channels == 2)
+    {
+        for (; f + 4 <= frames; f += 4, data += 8, add += 8)
+        {
+            vec4 g = vec4_load (gain + f);
+            vec4_store (data, vec4_add (vec4_load (data),
+             vec4_mul (vec4_load (add), vec4_dup_lo (g))));
+            vec4_store (data + 4, vec4_add (vec4_load (data + 4),
+             vec4_mul (vec4_load (add + 4), vec4_dup_hi (g))));
+        }
+    }
+#endif
+
+    for (; f < frames; f ++)
+    {
+        for (int c = 0; c < current_channels; c ++)
+            (* data ++) += (* add ++) * gain[f];
+    }
+}
+
+static void bake_gains (int frames)
 {
-    for (int i = 0; i < length; i ++)
+    int curve = aud_get_int ("crossfade", "curve");
+
+    if (frames == fadeout_gain.len () && curve == baked_curve)
+        return;
+
+    fadeout_gain.resize (frames);
+    fadein_gain.resize (frames);
+
+    for (int i = 0; i < frames; i ++)
     {
-        * data = (* data) * (a * (length - i) + b * i) / length;
-        data ++;
+        float t = (float) i / frames;
+
+        switch (curve)
+        {
+        case CURVE_EQUAL_POWER:
+            fadeout_gain[i] = cosf (t * (float) M_PI_2);
+            fadein_gain[i] = sinf (t * (float) M_PI_2);
+            break;
+
+        case CURVE_S_CURVE:
+            fadein_gain[i] = 0.5f - 0.5f * cosf (t * (float) M_PI);
+            fadeout_gain[i] = 1.0f - fadein_gain[i];
+            break;
+
+        default:
+            fadein_gain[i] = t;
+            fadeout_gain[i] = 1.0f - t;
+            break;
+        }
     }
+
+    baked_curve = curve;
 }
 
-static void mix (float * data, float * add, int length)
+/* A range of the ring buffer may wrap around the end of its storage, so it is
+ * visited as (at most) two contiguous spans.  <func> is called with a pointer
+ * to each span, the span's offset from <pos>, and its length in samples.  The
+ * buffer size is always a multiple of the channel count, so spans never split
+ * a frame. */
+template<class F>
+static void for_each_span (int pos, int len, F func)
 {
-    while (length --)
-        (* data ++) += (* add ++);
+    int split = buffer.linear ();
+    int offset = 0;
+
+    if (pos < split && len > 0)
+    {
+        int span = aud::min (len, split - pos);
+        func (& buffer[pos], offset, span);
+        offset += span;
+    }
+
+    if (offset < len)
+        func (& buffer[pos + offset], offset, len - offset);
 }
 
 static int buffer_needed_for_state ()
@@ -143,36 +387,58 @@ static int buffer_needed_for_state ()
     return current_channels * (int) (current_rate * overlap);
 }
 
+/* The buffer is allocated up front for the overlap plus one second of slack;
+ * it only needs to grow if the overlap setting is raised during playback or a
+ * single block is unusually large. */
+static void buffer_reserve (int len)
+{
+    if (buffer.space () >= len)
+        return;
+
+    buffer.alloc (buffer.len () + len + current_channels * current_rate);
+}
+
+static void buffer_append (const float * data, int len)
+{
+    buffer_reserve (len);
+    buffer.copy_in (data, len);
+}
+
+static void buffer_append_silence (int len)
+{
+    buffer_reserve (len);
+
+    int pos = buffer.len ();
+    buffer.add (len);
+
+    for_each_span (pos, len, [] (float * data, int, int span)
+        { memset (data, 0, sizeof (float) * span); });
+}
+
 static void output_data_as_ready (int buffer_needed, bool exact)
 {
     int copy = buffer.len () - buffer_needed;
 
     /* if allowed, wait until we have at least 1/2 second ready to output */
     if (exact ? (copy > 0) : (copy >= current_channels * (current_rate / 2)))
-        output.move_from (buffer, 0, -1, copy, true, true);
+        buffer.move_out (output, -1, copy);
 }
 
 void Crossfade::start (int & channels, int & rate)
 {
     if (state != STATE_OFF)
     {
-        if (channels != current_channels)
+        if (channels != current_channels || rate != current_rate)
         {
-            aud_ui_show_error (_("Crossfading failed because the songs had "
-             "a different number of channels.  You can use the Channel Mixer to "
-             "convert the songs to the same number of channels."));
-            state = STATE_OFF;
-        }
-        else if (rate != current_rate)
-        {
-            aud_ui_show_error (_("Crossfading failed because the songs had "
-             "different sample rates.  You can use the Sample Rate Converter to "
-             "convert the songs to the same sample rate."));
-            state = STATE_OFF;
+            start_bridge (channels, rate);
+
+            channels = current_channels;
+            rate = current_rate;
         }
+        else
+            stop_bridge ();
     }
-
-    if (state == STATE_OFF)
+    else
     {
         reset ();
 
@@ -182,16 +448,27 @@ void Crossfade::start (int & channels, int & rate)
         if (aud_get_bool ("crossfade", "manual"))
         {
             state = STATE_FLUSHED;
-            buffer.insert (0, buffer_needed_for_state ());
+            buffer_append_silence (buffer_needed_for_state ());
         }
         else
+        {
             state = STATE_RUNNING;
+            buffer_reserve (buffer_needed_for_state ());
+        }
     }
 }
 
+static void fade_out_buffer ()
+{
+    bake_gains (buffer.len () / current_channels);
+
+    for_each_span (0, buffer.len (), [] (float * data, int offset, int len)
+        { apply_gain (data, & fadeout_gain[offset / current_channels], len / current_channels); });
+}
+
 static void run_fadeout ()
 {
-    do_ramp (buffer.begin (), buffer.len (), 1.0, 0.0);
+    fade_out_buffer ();
 
     state = STATE_FADEIN;
     fadein_point = 0;
@@ -204,11 +481,12 @@ static void run_fadein (Index<float> & data)
     if (fadein_point < length)
     {
         int copy = aud::min (data.len (), length - fadein_point);
-        float a = (float) fadein_point / length;
-        float b = (float) (fadein_point + copy) / length;
+        const float * add = data.begin ();
+
+        for_each_span (fadein_point, copy, [add] (float * span, int offset, int len)
+            { mix_gain (span, add + offset, & fadein_gain[(fadein_point + offset) /
+             current_channels], len / current_channels); });
 
-        do_ramp (data.begin (), copy, a, b);
-        mix (& buffer[fadein_point], data.begin (), copy);
         data.remove (0, copy);
 
         fadein_point += copy;
@@ -218,8 +496,10 @@ static void run_fadein (Index<float> & data)
         state = STATE_RUNNING;
 }
 
-Index<float> & Crossfade::process (Index<float> & data)
+Index<float> & Crossfade::process (Index<float> & data_in)
 {
+    Index<float> & data = bridging ? bridge_process (data_in, false) : data_in;
+
     if (state == STATE_OFF)
         return data;
 
@@ -233,7 +513,7 @@ Index<float> & Crossfade::process (Index<float> & data)
 
     if (state == STATE_RUNNING)
     {
-        buffer.insert (data.begin (), -1, data.len ());
+        buffer_append (data.begin (), data.len ());
         output_data_as_ready (buffer_needed_for_state (), false);
     }
 
@@ -242,6 +522,9 @@ Index<float> & Crossfade::process (Index<float> & data)
 
 bool Crossfade::flush (bool force)
 {
+    if (bridging)
+        bridge_resampler.reset ();
+
     if (state == STATE_OFF)
         return true;
 
@@ -250,19 +533,28 @@ bool Crossfade::flush (bool force)
         state = STATE_FLUSHED;
         int buffer_needed = buffer_needed_for_state ();
         if (buffer.len () > buffer_needed)
-            buffer.remove (buffer_needed, -1);
+        {
+            /* keep the oldest audio, which is due to be played next; RingBuf
+             * can only drop from the head, so take it out and put it back */
+            Index<float> keep;
+            buffer.move_out (keep, -1, buffer_needed);
+            buffer.discard ();
+            buffer.copy_in (keep.begin (), keep.len ());
+        }
 
         return false;
     }
 
     state = STATE_RUNNING;
-    buffer.resize (0);
+    buffer.discard ();
 
     return true;
 }
 
-Index<float> & Crossfade::finish (Index<float> & data, bool end_of_playlist)
+Index<float> & Crossfade::finish (Index<float> & data_in, bool end_of_playlist)
 {
+    Index<float> & data = bridging ? bridge_process (data_in, true) : data_in;
+
     if (state == STATE_OFF)
         return data;
 
@@ -273,7 +565,7 @@ Index<float> & Crossfade::finish (Index<float> & data, bool end_of_playlist)
 
     if (state == STATE_RUNNING || state == STATE_FINISHED || state == STATE_FLUSHED)
     {
-        buffer.insert (data.begin (), -1, data.len ());
+        buffer_append (data.begin (), data.len ());
         output_data_as_ready (buffer_needed_for_state (), state != STATE_RUNNING);
     }
 
@@ -293,7 +585,7 @@ Index<float> & Crossfade::finish (Index<float> & data, bool end_of_playlist)
 
     if (end_of_playlist && (state == STATE_FINISHED || state == STATE_FLUSHED))
     {
-        do_ramp (buffer.begin (), buffer.len (), 1.0, 0.0);
+        fade_out_buffer ();
 
         state = STATE_OFF;
         output_data_as_ready (0, true);
@@ -304,5 +596,8 @@ Index<float> & Crossfade::finish (Index<float> & data, bool end_of_playlist)
 
 int Crossfade::adjust_delay (int delay)
 {
+    if (bridging)
+        delay += aud::rescale (bridge_resampler.delay (), input_rate, 1000);
+
     return delay + aud::rescale<int64_t> (buffer.len () / current_channels, current_rate, 1000);
 }
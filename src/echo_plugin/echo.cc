@@ -1,9 +1,26 @@
+#include <string.h>
+
+#include <atomic>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include <libaudcore/i18n.h>
 #include <libaudcore/runtime.h>
 #include <libaudcore/plugin.h>
 #include <libaudcore/preferences.h>
 
 #define MAX_DELAY 1000
+#define MAX_TAPS 4
+
+/* a change of delay is crossfaded over this time, in steps of FADE_STEP
+ * frames, to avoid clicks */
+#define FADE_TIME 50 /* milliseconds */
+#define FADE_STEP 32
 
 static const char echo_about[] =
  N_("Echo Plugin\n"
@@ -15,19 +32,28 @@ static const char * const echo_defaults[] = {
  "delay", "500",
  "feedback", "50",
  "volume", "50",
+ "taps", "1",
+ "ping_pong", "FALSE",
  nullptr};
 
+static void params_changed ();
+
 static const PreferencesWidget echo_widgets[] = {
     WidgetLabel (N_("<b>Echo</b>")),
     WidgetSpin (N_("Delay:"),
-        WidgetInt ("echo_plugin", "delay"),
+        WidgetInt ("echo_plugin", "delay", params_changed),
         {0, MAX_DELAY, 10, N_("ms")}),
     WidgetSpin (N_("Feedback:"),
-        WidgetInt ("echo_plugin", "feedback"),
+        WidgetInt ("echo_plugin", "feedback", params_changed),
         {0, 100, 1, "%"}),
     WidgetSpin (N_("Volume:"),
-        WidgetInt ("echo_plugin", "volume"),
-        {0, 100, 1, "%"})
+        WidgetInt ("echo_plugin", "volume", params_changed),
+        {0, 100, 1, "%"}),
+    WidgetSpin (N_("Taps:"),
+        WidgetInt ("echo_plugin", "taps", params_changed),
+        {1, MAX_TAPS, 1}),
+    WidgetCheck (N_("Ping-pong (stereo only)"),
+        WidgetBool ("echo_plugin", "ping_pong", params_changed))
 };
 
 static const PluginPreferences echo_prefs = {{echo_widgets}};
@@ -53,8 +79,40 @@ public:
 
 EXPORT EchoPlugin aud_plugin_instance;
 
+/* The delay line is a power of two frames long, so positions wrap with a
+ * mask.  Processing goes in chunks that are contiguous in the delay line for
+ * the write position and every read position, and no longer than the
+ * shortest delay (so that nothing is read that the same chunk writes); the
+ * per-sample loops are then plain vector operations. */
+
 static Index<float> buffer;
-static int w_ofs;
+static int buffer_mask; /* in frames */
+static int w_pos; /* in frames */
+
+static Index<float> wet, fed_back;
+
+struct TapSet {
+    int count;
+    int delay[MAX_TAPS]; /* frames, >= 1 */
+    float gain[MAX_TAPS];
+};
+
+/* while fading, <old_taps> fade out as <taps> fade in */
+static TapSet taps, old_taps;
+static int fade_frames, fade_left;
+
+static float feedback, volume;
+static bool ping_pong;
+
+static std::atomic<bool> params_dirty;
+
+static int echo_channels = 0;
+static int echo_rate = 0;
+
+static void params_changed ()
+{
+    params_dirty.store (true);
+}
 
 bool EchoPlugin::init ()
 {
@@ -65,10 +123,58 @@ bool EchoPlugin::init ()
 void EchoPlugin::cleanup ()
 {
     buffer.clear ();
+    wet.clear ();
+    fed_back.clear ();
 }
 
-static int echo_channels = 0;
-static int echo_rate = 0;
+/* The taps are spread evenly up to the full delay, growing louder toward the
+ * last one, which is the only one fed back. */
+static void get_taps (TapSet & set)
+{
+    int delay = aud::clamp (aud_get_int ("echo_plugin", "delay"), 0, MAX_DELAY);
+    int frames = aud::rescale (delay, 1000, echo_rate);
+
+    set.count = aud::clamp (aud_get_int ("echo_plugin", "taps"), 1, MAX_TAPS);
+
+    for (int i = 0; i < set.count; i ++)
+    {
+        set.delay[i] = aud::max (frames * (i + 1) / set.count, 1);
+        set.gain[i] = (float) (i + 1) / set.count;
+    }
+}
+
+static bool same_taps (const TapSet & a, const TapSet & b)
+{
+    if (a.count != b.count)
+        return false;
+
+    for (int i = 0; i < a.count; i ++)
+    {
+        if (a.delay[i] != b.delay[i])
+            return false;
+    }
+
+    return true;
+}
+
+static void load_params (bool fade)
+{
+    feedback = aud_get_int ("echo_plugin", "feedback") / 100.0f;
+    volume = aud_get_int ("echo_plugin", "volume") / 100.0f;
+    ping_pong = aud_get_bool ("echo_plugin", "ping_pong") && echo_channels == 2;
+
+    TapSet set;
+    get_taps (set);
+
+    if (fade && ! same_taps (set, taps))
+    {
+        /* a change in the middle of a fade starts over from where we are */
+        old_taps = (fade_left > fade_frames / 2) ? old_taps : taps;
+        fade_left = fade_frames;
+    }
+
+    taps = set;
+}
 
 void EchoPlugin::start (int & channels, int & rate)
 {
@@ -77,38 +183,149 @@ void EchoPlugin::start (int & channels, int & rate)
         echo_channels = channels;
         echo_rate = rate;
 
-        buffer.resize (aud::rescale (MAX_DELAY, 1000, rate) * channels);
+        int frames = 1;
+        while (frames <= aud::rescale (MAX_DELAY, 1000, rate))
+            frames <<= 1;
+
+        buffer_mask = frames - 1;
+        buffer.resize (frames * channels);
         buffer.erase (0, -1);
 
-        w_ofs = 0;
+        w_pos = 0;
     }
+
+    fade_frames = aud::rescale (FADE_TIME, 1000, rate);
+    fade_left = 0;
+
+    load_params (false);
+    params_dirty.store (false);
 }
 
-Index<float> & EchoPlugin::process (Index<float> & data)
+#ifdef __SSE__
+static inline __m128 vec4_mul_add (__m128 a, __m128 b, __m128 g)
+    { return _mm_add_ps (a, _mm_mul_ps (b, g)); }
+#endif
+
+/* dest[i] += src[i] * gain */
+static void mul_add (float * dest, const float * src, float gain, int len)
+{
+    int i = 0;
+
+#if defined (__SSE__)
+    __m128 g = _mm_set1_ps (gain);
+    for (; i + 4 <= len; i += 4)
+        _mm_storeu_ps (dest + i, vec4_mul_add (_mm_loadu_ps (dest + i), _mm_loadu_ps (src + i), g));
+#elif defined (__ARM_NEON)
+    float32x4_t g = vdupq_n_f32 (gain);
+    for (; i + 4 <= len; i += 4)
+        vst1q_f32 (dest + i, vmlaq_f32 (vld1q_f32 (dest + i), vld1q_f32 (src + i), g));
+#endif
+
+    for (; i < len; i ++)
+        dest[i] += src[i] * gain;
+}
+
+static int read_pos (int delay)
+{
+    return (w_pos - delay) & buffer_mask;
+}
+
+/* limits <len> so that the chunk does not wrap around for any tap in <set> */
+static int limit_chunk (const TapSet & set, int len)
+{
+    int size = buffer_mask + 1;
+
+    for (int i = 0; i < set.count; i ++)
+    {
+        len = aud::min (len, set.delay[i]);
+        len = aud::min (len, size - read_pos (set.delay[i]));
+    }
+
+    return len;
+}
+
+/* accumulates the taps of <set>, scaled by <scale>, into <wet> and
+ * <fed_back> */
+static void add_taps (const TapSet & set, float scale, int len)
+{
+    int ch = echo_channels;
+
+    for (int i = 0; i < set.count; i ++)
+    {
+        const float * src = & buffer[read_pos (set.delay[i]) * ch];
+        mul_add (wet.begin (), src, set.gain[i] * scale, len * ch);
+    }
+
+    const float * last = & buffer[read_pos (set.delay[set.count - 1]) * ch];
+    mul_add (fed_back.begin (), last, scale, len * ch);
+}
+
+static void run_chunk (float * data, int len)
 {
-    int delay = aud_get_int ("echo_plugin", "delay");
-    float feedback = aud_get_int ("echo_plugin", "feedback") / 100.0f;
-    float volume = aud_get_int ("echo_plugin", "volume") / 100.0f;
+    int ch = echo_channels;
 
-    int interval = aud::rescale (delay, 1000, echo_rate) * echo_channels;
-    interval = aud::clamp (interval, 0, buffer.len ());  // sanity check
+    wet.resize (len * ch);
+    fed_back.resize (len * ch);
+    wet.erase (0, -1);
+    fed_back.erase (0, -1);
 
-    int r_ofs = w_ofs - interval;
-    if (r_ofs < 0)
-        r_ofs += buffer.len ();
+    if (fade_left)
+    {
+        float t = (float) fade_left / fade_frames;
+        add_taps (old_taps, t, len);
+        add_taps (taps, 1 - t, len);
+        fade_left = aud::max (fade_left - len, 0);
+    }
+    else
+        add_taps (taps, 1, len);
 
-    float * end = data.end ();
+    float * dest = & buffer[w_pos * ch];
 
-    for (float * f = data.begin (); f < end; f++)
+    if (ping_pong)
     {
-        float in = * f;
-        float buf = buffer[r_ofs];
+        /* the input goes in on the left; the echo bounces between sides */
+        for (int f = 0; f < len; f ++)
+        {
+            float l = data[2 * f], r = data[2 * f + 1];
+            dest[2 * f] = (l + r) * 0.5f + fed_back[2 * f + 1] * feedback;
+            dest[2 * f + 1] = fed_back[2 * f] * feedback;
+        }
+    }
+    else
+    {
+        memcpy (dest, data, sizeof (float) * len * ch);
+        mul_add (dest, fed_back.begin (), feedback, len * ch);
+    }
+
+    mul_add (data, wet.begin (), volume, len * ch);
+
+    w_pos = (w_pos + len) & buffer_mask;
+}
+
+Index<float> & EchoPlugin::process (Index<float> & data)
+{
+    if (params_dirty.exchange (false))
+        load_params (true);
+
+    int size = buffer_mask + 1;
+    float * f = data.begin ();
+    int frames = data.len () / echo_channels;
+
+    while (frames > 0)
+    {
+        int len = aud::min (frames, size - w_pos);
+        len = limit_chunk (taps, len);
+
+        if (fade_left)
+        {
+            len = limit_chunk (old_taps, len);
+            len = aud::min (len, FADE_STEP);
+        }
 
-        * f = in + buf * volume;
-        buffer[w_ofs] = in + buf * feedback;
+        run_chunk (f, len);
 
-        r_ofs = (r_ofs + 1) % buffer.len ();
-        w_ofs = (w_ofs + 1) % buffer.len ();
+        f += len * echo_channels;
+        frames -= len;
     }
 
     return data;
@@ -0,0 +1,82 @@
+/* Micro-benchmark for the sample format conversions in convert.cc, comparing
+ * the direct integer kernels against the float path through libaudcore that
+ * they replace.  Not built by default; run "make convert-bench" in this
+ * directory, then ./convert-bench. */
+
+#include "convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+
+#define SAMPLES 65536
+#define ROUNDS 2000
+
+struct Pair {
+    int in, out;
+    const char * name;
+};
+
+static const Pair pairs[] = {
+    {FMT_S32_LE, FMT_S16_LE, "S32_LE -> S16_LE"},
+    {FMT_S16_LE, FMT_S32_LE, "S16_LE -> S32_LE"},
+    {FMT_S24_LE, FMT_S16_LE, "S24_LE -> S16_LE"},
+    {FMT_S16_LE, FMT_S16_BE, "S16_LE -> S16_BE"},
+    {FMT_S16_LE, FMT_U8, "S16_LE -> U8"}
+};
+
+static Index<char> in_buf, out_buf;
+static Index<float> float_buf;
+
+/* nanoseconds per sample */
+static double time_direct (int in_fmt, int out_fmt, bool dither)
+{
+    convert_init (in_fmt, out_fmt, dither);
+
+    int64_t start = g_get_monotonic_time ();
+    for (int r = 0; r < ROUNDS; r ++)
+        convert_process (in_buf.begin (), FMT_SIZEOF (in_fmt) * SAMPLES);
+    int64_t time = g_get_monotonic_time () - start;
+
+    convert_free ();
+    return time * 1000.0 / ROUNDS / SAMPLES;
+}
+
+static double time_float (int in_fmt, int out_fmt)
+{
+    int64_t start = g_get_monotonic_time ();
+    for (int r = 0; r < ROUNDS; r ++)
+    {
+        audio_from_int (in_buf.begin (), in_fmt, float_buf.begin (), SAMPLES);
+        audio_to_int (float_buf.begin (), out_buf.begin (), out_fmt, SAMPLES);
+    }
+    int64_t time = g_get_monotonic_time () - start;
+
+    return time * 1000.0 / ROUNDS / SAMPLES;
+}
+
+int main ()
+{
+    in_buf.resize (4 * SAMPLES);
+    out_buf.resize (4 * SAMPLES);
+    float_buf.resize (SAMPLES);
+
+    for (char & c : in_buf)
+        c = rand ();
+
+    printf ("%-18s %12s %12s %12s\n", "ns per sample", "float path", "direct", "dithered");
+
+    for (const Pair & pair : pairs)
+    {
+        double via_float = time_float (pair.in, pair.out);
+        double direct = time_direct (pair.in, pair.out, false);
+
+        if (FMT_SIZEOF (pair.out) < FMT_SIZEOF (pair.in))
+            printf ("%-18s %12.2f %12.2f %12.2f\n", pair.name, via_float, direct,
+             time_direct (pair.in, pair.out, true));
+        else
+            printf ("%-18s %12.2f %12.2f %12s\n", pair.name, via_float, direct, "-");
+    }
+
+    return 0;
+}
@@ -1,17 +1,219 @@
 #include "convert.h"
 
+#include <math.h>
+#include <stdint.h>
 #include <string.h>
 
+/* Conversions between integer formats are done directly, one sample at a time,
+ * by kernels generated from the templates below; the loops are simple enough
+ * for the compiler to vectorize.  Each sample is read into a signed 32-bit
+ * value with the significant bits at the top, then shifted down to the output
+ * width, rounding to nearest when bits are dropped.  Conversions to and from
+ * floating point are left to libaudcore, except for float to integer with
+ * dither.
+ *
+ * When the output has fewer bits than the input, triangular (TPDF) dither
+ * can be added before rounding, to turn truncation distortion into a low,
+ * constant noise floor.  The dithered kernels are not vectorized. */
+
+typedef void (* ConvertFunc) (const void * in, void * out, int samples);
+
+static constexpr bool host_le = (FMT_S16_NE == FMT_S16_LE);
+
+static inline uint8_t byte_swap (uint8_t x) { return x; }
+static inline uint16_t byte_swap (uint16_t x) { return __builtin_bswap16 (x); }
+static inline uint32_t byte_swap (uint32_t x) { return __builtin_bswap32 (x); }
+
+/* T is the unsigned type the sample is stored in; Bits the number of
+ * significant bits, which are at the bottom of T */
+template<class T, int Bits, bool Signed, bool LE>
+struct IntFormat
+{
+    typedef T Type;
+    static constexpr int bits = Bits;
+
+    /* to signed, with the significant bits at the top */
+    static inline int32_t read (T x)
+    {
+        if (LE != host_le)
+            x = byte_swap (x);
+
+        uint32_t u = (uint32_t) x << (32 - Bits);
+        return Signed ? (int32_t) u : (int32_t) (u ^ 0x80000000u);
+    }
+
+    /* from a signed value in the range of Bits; signed 24-bit samples are
+     * stored sign-extended, unsigned ones with the top byte clear */
+    static inline T write (int32_t x)
+    {
+        uint32_t u = (uint32_t) x;
+
+        if (! Signed)
+            u = (u ^ (1u << (Bits - 1))) & (0xffffffffu >> (32 - Bits));
+
+        T y = (T) u;
+        return (LE != host_le) ? byte_swap (y) : y;
+    }
+};
+
+typedef IntFormat<uint8_t, 8, true, true> S8;
+typedef IntFormat<uint8_t, 8, false, true> U8;
+typedef IntFormat<uint16_t, 16, true, true> S16_LE;
+typedef IntFormat<uint16_t, 16, true, false> S16_BE;
+typedef IntFormat<uint16_t, 16, false, true> U16_LE;
+typedef IntFormat<uint16_t, 16, false, false> U16_BE;
+typedef IntFormat<uint32_t, 24, true, true> S24_LE;
+typedef IntFormat<uint32_t, 24, true, false> S24_BE;
+typedef IntFormat<uint32_t, 24, false, true> U24_LE;
+typedef IntFormat<uint32_t, 24, false, false> U24_BE;
+typedef IntFormat<uint32_t, 32, true, true> S32_LE;
+typedef IntFormat<uint32_t, 32, true, false> S32_BE;
+typedef IntFormat<uint32_t, 32, false, true> U32_LE;
+typedef IntFormat<uint32_t, 32, false, false> U32_BE;
+
+#define FOR_EACH_INT_FORMAT(F) \
+    F (S8) F (U8) \
+    F (S16_LE) F (S16_BE) F (U16_LE) F (U16_BE) \
+    F (S24_LE) F (S24_BE) F (U24_LE) F (U24_BE) \
+    F (S32_LE) F (S32_BE) F (U32_LE) F (U32_BE)
+
+/* xorshift; the dither need not be of high quality, only cheap */
+static uint32_t dither_state = 1;
+
+static inline uint32_t dither_random ()
+{
+    dither_state ^= dither_state << 13;
+    dither_state ^= dither_state >> 17;
+    dither_state ^= dither_state << 5;
+    return dither_state;
+}
+
+template<class In, class Out>
+static void convert_int (const void * in, void * out, int samples)
+{
+    auto i = (const typename In::Type *) in;
+    auto o = (typename Out::Type *) out;
+
+    for (int n = 0; n < samples; n ++)
+        o[n] = Out::write (In::read (i[n]) >> (32 - Out::bits));
+}
+
+/* to fewer bits, rounding to nearest as libaudcore does */
+template<class In, class Out>
+static void convert_int_round (const void * in, void * out, int samples)
+{
+    auto i = (const typename In::Type *) in;
+    auto o = (typename Out::Type *) out;
+
+    constexpr int shift = 32 - Out::bits;
+    constexpr int64_t half = ((int64_t) 1 << shift) >> 1;
+    constexpr int64_t max = ((int64_t) 1 << (Out::bits - 1)) - 1;
+
+    for (int n = 0; n < samples; n ++)
+    {
+        int64_t x = ((int64_t) In::read (i[n]) + half) >> shift;
+        o[n] = Out::write ((int32_t) aud::min (x, max));
+    }
+}
+
+template<class In, class Out>
+static void convert_int_dither (const void * in, void * out, int samples)
+{
+    auto i = (const typename In::Type *) in;
+    auto o = (typename Out::Type *) out;
+
+    constexpr int shift = 32 - Out::bits;
+    constexpr int32_t lsb = (int32_t) 1 << shift;
+
+    for (int n = 0; n < samples; n ++)
+    {
+        /* sum of two uniform values of one output step each, centred on
+         * half a step so that the shift below rounds */
+        int32_t r1 = ((uint64_t) dither_random () << shift) >> 32;
+        int32_t r2 = ((uint64_t) dither_random () << shift) >> 32;
+        int64_t x = (int64_t) In::read (i[n]) + r1 + r2 - lsb / 2;
+
+        x = aud::clamp (x, (int64_t) INT32_MIN, (int64_t) INT32_MAX);
+        o[n] = Out::write ((int32_t) x >> shift);
+    }
+}
+
+template<class Out>
+static void convert_float_dither (const void * in, void * out, int samples)
+{
+    auto i = (const float *) in;
+    auto o = (typename Out::Type *) out;
+
+    constexpr double range = (double) ((int64_t) 1 << (Out::bits - 1));
+
+    for (int n = 0; n < samples; n ++)
+    {
+        double r = ((double) dither_random () + dither_random ()) / 4294967296.0 - 1.0;
+        double x = nearbyint ((double) i[n] * range + r);
+
+        x = aud::clamp (x, -range, range - 1);
+        o[n] = Out::write ((int32_t) x);
+    }
+}
+
+template<class In, class Out>
+static ConvertFunc int_kernel (bool dither)
+{
+    if (Out::bits >= In::bits)
+        return convert_int<In, Out>;
+
+    return dither ? convert_int_dither<In, Out> : convert_int_round<In, Out>;
+}
+
+template<class In>
+static ConvertFunc int_kernel_to (int out_fmt, bool dither)
+{
+#define CASE(F) case FMT_##F: return int_kernel<In, F> (dither);
+    switch (out_fmt)
+    {
+        FOR_EACH_INT_FORMAT (CASE)
+        default: return nullptr;
+    }
+#undef CASE
+}
+
+static ConvertFunc find_kernel (int in_fmt, int out_fmt, bool dither)
+{
+    if (in_fmt == FMT_FLOAT)
+    {
+        if (! dither)
+            return nullptr;
+
+#define CASE(F) case FMT_##F: return convert_float_dither<F>;
+        switch (out_fmt)
+        {
+            FOR_EACH_INT_FORMAT (CASE)
+            default: return nullptr;
+        }
+#undef CASE
+    }
+
+#define CASE(F) case FMT_##F: return int_kernel_to<F> (out_fmt, dither);
+    switch (in_fmt)
+    {
+        FOR_EACH_INT_FORMAT (CASE)
+        default: return nullptr;
+    }
+#undef CASE
+}
+
 static int in_fmt;
 static int out_fmt;
+static ConvertFunc kernel;
 
 static Index<char> convert_output;
 static Index<float> convert_temp;
 
-void convert_init (int input_fmt, int output_fmt)
+void convert_init (int input_fmt, int output_fmt, bool dither)
 {
     in_fmt = input_fmt;
     out_fmt = output_fmt;
+    kernel = (in_fmt == out_fmt) ? nullptr : find_kernel (in_fmt, out_fmt, dither);
 }
 
 const Index<char> & convert_process (const void * ptr, int length)
@@ -22,12 +224,15 @@ const Index<char> & convert_process (const void * ptr, int length)
 
     if (in_fmt == out_fmt)
         memcpy (convert_output.begin (), ptr, FMT_SIZEOF (in_fmt) * samples);
+    else if (kernel)
+        kernel (ptr, convert_output.begin (), samples);
     else if (in_fmt == FMT_FLOAT)
         audio_to_int ((const float *) ptr, convert_output.begin (), out_fmt, samples);
     else if (out_fmt == FMT_FLOAT)
         audio_from_int (ptr, in_fmt, (float *) convert_output.begin (), samples);
     else
     {
+        /* formats without a direct kernel */
         convert_temp.resize (samples);
         audio_from_int (ptr, in_fmt, convert_temp.begin (), samples);
         audio_to_int (convert_temp.begin (), convert_output.begin (), out_fmt, samples);
@@ -3,7 +3,7 @@
 
 #include "filewriter.h"
 
-void convert_init (int input_fmt, int output_fmt);
+void convert_init (int input_fmt, int output_fmt, bool dither);
 const Index<char> & convert_process (const void * ptr, int length);
 void convert_free ();
 
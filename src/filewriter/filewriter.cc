@@ -20,6 +20,8 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 #include <gtk/gtk.h>
 
@@ -60,9 +62,9 @@ public:
     bool open_audio (int fmt, int rate, int nch);
     void close_audio ();
 
-    void period_wait () {}
+    void period_wait ();
     int write_audio (const void * ptr, int length);
-    void drain () {}
+    void drain ();
 
     int get_delay ()
         { return 0; }
@@ -124,10 +126,47 @@ static gboolean use_suffix;
 static GtkWidget *prependnumber_toggle;
 static gboolean prependnumber;
 
+static GtkWidget *dither_toggle;
+static gboolean dither;
+
 static String file_path;
 
 static VFSFile output_file;
 
+/* Encoding is done in a separate thread, so that a slow encoder or slow
+ * storage does not hold up the output thread.  write_audio() only copies the
+ * audio into one of a fixed number of blocks, allocated when the file is
+ * opened.  It fills the block just past the end of the queue and queues it
+ * once it is full (or on drain and close); when all of the blocks are waiting
+ * to be encoded, period_wait() blocks until the encoder has finished one.
+ * The queue is guarded by queue_mutex; the block being encoded stays in the
+ * queue until it is done.  If the thread cannot be started, write_audio()
+ * encodes the audio directly instead. */
+
+#define QUEUE_BLOCKS 16
+#define QUEUE_BLOCK_SIZE 65536 /* bytes */
+
+struct QueueBlock {
+    char * data;
+    int len;
+};
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static QueueBlock queue[QUEUE_BLOCKS];
+static int queue_block_size; /* bytes, rounded down to whole frames */
+static int queue_head, queue_count; /* oldest block, number of blocks queued */
+
+static bool encoder_quit;
+static bool encoder_running; /* false if the thread could not be started */
+static pthread_t encoder_thread;
+
+/* statistics, reported when the file is closed */
+static int stat_stalls, stat_max_depth;
+static int64_t stat_bytes;
+static int64_t stat_stall_time, stat_encode_time; /* microseconds */
+
 FileWriterImpl *plugins[FILEEXT_MAX] = {
     &wav_plugin,
 #ifdef FILEWRITER_MP3
@@ -155,6 +194,7 @@ const char * const FileWriter::defaults[] = {
  "prependnumber", "FALSE",
  "save_original", "TRUE",
  "use_suffix", "FALSE",
+ "dither", "FALSE",
  nullptr};
 
 bool FileWriter::init ()
@@ -167,6 +207,7 @@ bool FileWriter::init ()
     prependnumber = aud_get_bool ("filewriter", "prependnumber");
     save_original = aud_get_bool ("filewriter", "save_original");
     use_suffix = aud_get_bool ("filewriter", "use_suffix");
+    dither = aud_get_bool ("filewriter", "dither");
 
     if (! file_path[0])
     {
@@ -212,6 +253,114 @@ void FileWriter::set_info (const char * filename, const Tuple & tuple)
     in_tuple = tuple.ref ();
 }
 
+/* returns the time taken, in microseconds */
+static int64_t encode (const void * data, int len)
+{
+    int64_t start = g_get_monotonic_time ();
+
+    auto & buf = convert_process (data, len);
+    plugin->write (output_file, buf.begin (), buf.len ());
+
+    return g_get_monotonic_time () - start;
+}
+
+/* queues the block being filled, if it holds any audio; call with
+ * queue_mutex held */
+static void queue_fill_block ()
+{
+    if (queue_count == QUEUE_BLOCKS || ! queue[(queue_head + queue_count) % QUEUE_BLOCKS].len)
+        return;
+
+    queue_count ++;
+    stat_max_depth = aud::max (stat_max_depth, queue_count);
+
+    pthread_cond_broadcast (& queue_cond);
+}
+
+static void * encoder_worker (void *)
+{
+    pthread_mutex_lock (& queue_mutex);
+
+    while (queue_count || ! encoder_quit)
+    {
+        if (! queue_count)
+        {
+            pthread_cond_wait (& queue_cond, & queue_mutex);
+            continue;
+        }
+
+        QueueBlock & block = queue[queue_head];
+        pthread_mutex_unlock (& queue_mutex);
+
+        int64_t time = encode (block.data, block.len);
+
+        pthread_mutex_lock (& queue_mutex);
+
+        queue_head = (queue_head + 1) % QUEUE_BLOCKS;
+        queue_count --;
+
+        stat_bytes += block.len;
+        stat_encode_time += time;
+
+        block.len = 0;
+
+        pthread_cond_broadcast (& queue_cond);
+    }
+
+    pthread_mutex_unlock (& queue_mutex);
+    return nullptr;
+}
+
+static void encoder_start (int frame_size)
+{
+    queue_block_size = QUEUE_BLOCK_SIZE / frame_size * frame_size;
+
+    for (QueueBlock & block : queue)
+    {
+        block.data = new char[queue_block_size];
+        block.len = 0;
+    }
+
+    queue_head = queue_count = 0;
+    encoder_quit = false;
+
+    stat_stalls = stat_max_depth = 0;
+    stat_bytes = 0;
+    stat_stall_time = stat_encode_time = 0;
+
+    encoder_running = ! pthread_create (& encoder_thread, nullptr, encoder_worker, nullptr);
+
+    if (! encoder_running)
+        AUDERR ("Failed to start encoder thread, encoding synchronously.\n");
+}
+
+/* encodes any audio still queued before stopping */
+static void encoder_stop ()
+{
+    if (encoder_running)
+    {
+        pthread_mutex_lock (& queue_mutex);
+        queue_fill_block ();
+        encoder_quit = true;
+        pthread_cond_broadcast (& queue_cond);
+        pthread_mutex_unlock (& queue_mutex);
+
+        pthread_join (encoder_thread, nullptr);
+        encoder_running = false;
+    }
+
+    for (QueueBlock & block : queue)
+    {
+        delete[] block.data;
+        block.data = nullptr;
+    }
+
+    AUDINFO ("Encoded %.1f MB at %.1f MB/s; queue depth up to %d of %d blocks; "
+     "output stalled %d times, %.2f s in total.\n", stat_bytes / 1048576.0,
+     stat_encode_time ? stat_bytes / 1.048576 / stat_encode_time : 0.0,
+     stat_max_depth, QUEUE_BLOCKS, stat_stalls, stat_stall_time / 1000000.0);
+}
+
 bool FileWriter::open_audio (int fmt, int rate, int nch)
 {
     String filename, directory;
@@ -270,10 +419,13 @@ bool FileWriter::open_audio (int fmt, int rate, int nch)
     if (! output_file)
         goto err;
 
-    convert_init (fmt, plugin->format_required (fmt));
+    convert_init (fmt, plugin->format_required (fmt), dither);
 
     if (plugin->open (output_file, input, in_tuple))
+    {
+        encoder_start (FMT_SIZEOF (fmt) * nch);
         return true;
+    }
 
 err:
     in_filename = String ();
@@ -283,14 +435,73 @@ err:
 
 int FileWriter::write_audio (const void * ptr, int length)
 {
-    auto & buf = convert_process (ptr, length);
-    plugin->write (output_file, buf.begin (), buf.len ());
+    if (! encoder_running)
+    {
+        stat_encode_time += encode (ptr, length);
+        stat_bytes += length;
+        return length;
+    }
 
-    return length;
+    pthread_mutex_lock (& queue_mutex);
+
+    if (queue_count == QUEUE_BLOCKS)
+    {
+        pthread_mutex_unlock (& queue_mutex);
+        return 0;
+    }
+
+    /* the encoder does not touch blocks beyond the end of the queue */
+    QueueBlock & block = queue[(queue_head + queue_count) % QUEUE_BLOCKS];
+    pthread_mutex_unlock (& queue_mutex);
+
+    int len = aud::min (length, queue_block_size - block.len);
+    memcpy (block.data + block.len, ptr, len);
+    block.len += len;
+
+    if (block.len == queue_block_size)
+    {
+        pthread_mutex_lock (& queue_mutex);
+        queue_fill_block ();
+        pthread_mutex_unlock (& queue_mutex);
+    }
+
+    return len;
+}
+
+void FileWriter::period_wait ()
+{
+    pthread_mutex_lock (& queue_mutex);
+
+    if (queue_count == QUEUE_BLOCKS)
+    {
+        int64_t start = g_get_monotonic_time ();
+
+        while (queue_count == QUEUE_BLOCKS)
+            pthread_cond_wait (& queue_cond, & queue_mutex);
+
+        stat_stalls ++;
+        stat_stall_time += g_get_monotonic_time () - start;
+    }
+
+    pthread_mutex_unlock (& queue_mutex);
+}
+
+void FileWriter::drain ()
+{
+    pthread_mutex_lock (& queue_mutex);
+
+    queue_fill_block ();
+
+    while (queue_count)
+        pthread_cond_wait (& queue_cond, & queue_mutex);
+
+    pthread_mutex_unlock (& queue_mutex);
 }
 
 void FileWriter::close_audio ()
 {
+    encoder_stop ();
+
     plugin->close (output_file);
     convert_free ();
 
@@ -313,12 +524,16 @@ static void configure_response_cb (void)
     prependnumber =
         gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(prependnumber_toggle));
 
+    dither =
+        gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(dither_toggle));
+
     aud_set_int ("filewriter", "fileext", fileext);
     aud_set_bool ("filewriter", "filenamefromtags", filenamefromtags);
     aud_set_str ("filewriter", "file_path", file_path);
     aud_set_bool ("filewriter", "prependnumber", prependnumber);
     aud_set_bool ("filewriter", "save_original", save_original);
     aud_set_bool ("filewriter", "use_suffix", use_suffix);
+    aud_set_bool ("filewriter", "dither", dither);
 }
 
 static void fileext_cb(GtkWidget *combo, void * data)
@@ -469,6 +684,12 @@ static void * file_configure (void)
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(prependnumber_toggle), prependnumber);
         gtk_box_pack_start(GTK_BOX(configure_vbox), prependnumber_toggle, FALSE, FALSE, 0);
 
+        gtk_box_pack_start(GTK_BOX(configure_vbox), gtk_hseparator_new(), FALSE, FALSE, 0);
+
+        dither_toggle = gtk_check_button_new_with_label(_("Dither when reducing bit depth"));
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(dither_toggle), dither);
+        gtk_box_pack_start(GTK_BOX(configure_vbox), dither_toggle, FALSE, FALSE, 0);
+
         g_signal_connect (fileext_combo, "changed", (GCallback) fileext_cb, nullptr);
         g_signal_connect (plugin_button, "clicked", (GCallback) plugin_configure_cb, nullptr);
         g_signal_connect (saveplace1, "toggled", (GCallback) saveplace_original_cb, nullptr);
@@ -17,6 +17,7 @@
  * the use of this software.
  */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,7 @@
 #include <libaudcore/i18n.h>
 #include <libaudcore/interface.h>
 #include <libaudcore/plugin.h>
+#include <libaudcore/preferences.h>
 #include <libaudcore/runtime.h>
 
 
@@ -39,15 +41,67 @@ static const char * const gio_schemes[] = {"ftp", "sftp", "smb"};
 class GIOTransport : public TransportPlugin
 {
 public:
-    static constexpr PluginInfo info = {N_("GIO Plugin"), PACKAGE, gio_about};
+    static const char * const defaults[];
+    static const PreferencesWidget widgets[];
+    static const PluginPreferences prefs;
+
+    static constexpr PluginInfo info = {
+        N_("GIO Plugin"),
+        PACKAGE,
+        gio_about,
+        & prefs
+    };
 
     constexpr GIOTransport () : TransportPlugin (info, gio_schemes) {}
 
+    bool init ();
+
     VFSImpl * fopen (const char * path, const char * mode, String & error);
 };
 
 EXPORT GIOTransport aud_plugin_instance;
 
+const char * const GIOTransport::defaults[] = {
+    "readahead", "1024",
+    nullptr
+};
+
+const PreferencesWidget GIOTransport::widgets[] = {
+    WidgetSpin (N_("Read-ahead buffer:"),
+        WidgetInt ("gio", "readahead"),
+        {0, 16384, 256, N_("KiB")})
+};
+
+const PluginPreferences GIOTransport::prefs = {{widgets}};
+
+bool GIOTransport::init ()
+{
+    aud_config_set_defaults ("gio", defaults);
+    return true;
+}
+
+/*
+ * Network transports take a round trip for every read, so files opened for
+ * reading only are read through a buffer.  Reads are served from a window of
+ * the file held in the buffer; when a read runs past the end of the window,
+ * a whole block is read at once.
+ *
+ * Once a few reads in a row have followed on from each other, the access is
+ * taken to be sequential and a prefetch thread keeps the buffer filled ahead
+ * of the read position, so that a decoder rarely has to wait for the
+ * network.  A seek within the window only moves the read position.  Any other
+ * seek cancels a read in progress, empties the buffer and ends prefetching
+ * until reads are sequential again.
+ *
+ * The GIO stream is used by only one thread at a time: by the prefetch thread
+ * while prefetching, and otherwise by the thread calling fread() or fseek()
+ * with m_mutex locked.
+ */
+
+#define BLOCK_SIZE 65536
+#define KEEP_BEHIND 4096 /* bytes kept before the read position, for ungetc() */
+#define SEQUENTIAL_READS 3
+
 class GIOFile : public VFSImpl
 {
 public:
@@ -83,6 +137,32 @@ private:
     GInputStream * m_istream = nullptr;
     GOutputStream * m_ostream = nullptr;
     GSeekable * m_seekable = nullptr;
+
+    /* read-ahead; the buffer holds the file from m_buf_start to m_buf_end */
+    char * m_buf = nullptr;
+    int64_t m_buf_size = 0;
+    int64_t m_buf_start = 0, m_buf_end = 0;
+    int64_t m_pos = 0; /* read position */
+    int64_t m_last_read = 0; /* where the last read ended */
+    int m_sequential = 0; /* reads in a row that followed on */
+    bool m_eof = false, m_error = false;
+
+    pthread_mutex_t m_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t m_cond = PTHREAD_COND_INITIALIZER;
+    pthread_t m_thread;
+    bool m_thread_running = false, m_thread_failed = false;
+    bool m_prefetch = false, m_reading = false, m_quit = false;
+    GCancellable * m_cancellable = nullptr;
+
+    int64_t fill_block (char * block, int64_t size, GCancellable * cancellable);
+    int64_t buf_space ();
+    void make_room (int64_t len);
+    void append (const char * data, int64_t len);
+    bool stop_prefetch ();
+    int64_t buffered_read (char * buf, int64_t size);
+    int buffered_seek (int64_t offset, VFSSeekType whence);
+
+    static void * prefetch_worker (void * data);
 };
 
 #define CHECK_ERROR(op, name) do { \
@@ -126,6 +206,13 @@ GIOFile::GIOFile (const char * filename, const char * mode) :
             m_istream = (GInputStream *) g_file_read (m_file, 0, & error);
             CHECK_AND_SAVE_ERROR ("open", filename);
             m_seekable = (GSeekable *) m_istream;
+
+            m_buf_size = (int64_t) aud_get_int ("gio", "readahead") * 1024;
+            if (m_buf_size > 0)
+            {
+                m_buf_size = aud::max (m_buf_size, (int64_t) 2 * BLOCK_SIZE);
+                m_buf = new char[m_buf_size];
+            }
         }
         break;
     case 'w':
@@ -178,6 +265,20 @@ GIOFile::~GIOFile ()
 {
     GError * error = 0;
 
+    if (m_thread_running)
+    {
+        pthread_mutex_lock (& m_mutex);
+        stop_prefetch ();
+        m_quit = true;
+        pthread_cond_broadcast (& m_cond);
+        pthread_mutex_unlock (& m_mutex);
+
+        pthread_join (m_thread, nullptr);
+        g_object_unref (m_cancellable);
+    }
+
+    delete[] m_buf;
+
     if (m_iostream)
     {
         g_io_stream_close (m_iostream, 0, & error);
@@ -215,6 +316,270 @@ VFSImpl * GIOTransport::fopen (const char * filename, const char * mode, String
     }
 }
 
+/* reads into <block>, stopping short only at the end of the file or on error;
+ * returns -1 on error */
+int64_t GIOFile::fill_block (char * block, int64_t size, GCancellable * cancellable)
+{
+    GError * error = 0;
+    int64_t total = 0;
+
+    while (total < size)
+    {
+        int64_t part = g_input_stream_read (m_istream, block + total,
+         size - total, cancellable, & error);
+
+        if (error)
+        {
+            if (! g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                AUDERR ("Cannot read from %s: %s.\n", (const char *) m_filename, error->message);
+
+            g_error_free (error);
+            return -1;
+        }
+
+        if (part <= 0)
+            break;
+
+        total += part;
+    }
+
+    return total;
+}
+
+/* free space at the end of the buffer, counting what can be reclaimed from
+ * before the read position */
+int64_t GIOFile::buf_space ()
+{
+    int64_t behind = aud::max (m_pos - m_buf_start - KEEP_BEHIND, (int64_t) 0);
+    return m_buf_size - (m_buf_end - m_buf_start) + behind;
+}
+
+/* makes room for <len> bytes at the end of the window by dropping data from
+ * the start; the caller has checked buf_space(), so that nothing later than
+ * KEEP_BEHIND bytes before the read position is dropped */
+void GIOFile::make_room (int64_t len)
+{
+    int64_t used = m_buf_end - m_buf_start;
+
+    if (used + len > m_buf_size)
+    {
+        int64_t drop = used + len - m_buf_size;
+        memmove (m_buf, m_buf + drop, used - drop);
+        m_buf_start += drop;
+    }
+}
+
+void GIOFile::append (const char * data, int64_t len)
+{
+    make_room (len);
+    memcpy (m_buf + (m_buf_end - m_buf_start), data, len);
+    m_buf_end += len;
+}
+
+/* called with m_mutex locked; waits for a read in progress to be cancelled
+ * and returns true if there was one */
+bool GIOFile::stop_prefetch ()
+{
+    m_prefetch = false;
+
+    if (! m_reading)
+        return false;
+
+    g_cancellable_cancel (m_cancellable);
+    pthread_cond_broadcast (& m_cond); /* in case it is waiting for space */
+
+    while (m_reading)
+        pthread_cond_wait (& m_cond, & m_mutex);
+
+    g_cancellable_reset (m_cancellable);
+    return true;
+}
+
+void * GIOFile::prefetch_worker (void * data)
+{
+    GIOFile * file = (GIOFile *) data;
+    char * block = new char[BLOCK_SIZE];
+
+    pthread_mutex_lock (& file->m_mutex);
+
+    while (! file->m_quit)
+    {
+        if (! file->m_prefetch || file->m_eof || file->m_error ||
+         file->buf_space () < BLOCK_SIZE)
+        {
+            pthread_cond_wait (& file->m_cond, & file->m_mutex);
+            continue;
+        }
+
+        file->m_reading = true;
+        pthread_mutex_unlock (& file->m_mutex);
+
+        int64_t len = file->fill_block (block, BLOCK_SIZE, file->m_cancellable);
+
+        pthread_mutex_lock (& file->m_mutex);
+
+        /* a seek back within the window may have taken up the space that was
+         * free before the read; wait until the reader has caught up */
+        while (file->m_prefetch && len > 0 && file->buf_space () < len)
+            pthread_cond_wait (& file->m_cond, & file->m_mutex);
+
+        file->m_reading = false;
+
+        /* if cancelled, the window is about to be thrown away */
+        if (file->m_prefetch)
+        {
+            if (len < 0)
+                file->m_error = true;
+            else
+            {
+                file->append (block, len);
+                if (len < BLOCK_SIZE)
+                    file->m_eof = true;
+            }
+        }
+
+        pthread_cond_broadcast (& file->m_cond);
+    }
+
+    pthread_mutex_unlock (& file->m_mutex);
+
+    delete[] block;
+    return nullptr;
+}
+
+int64_t GIOFile::buffered_read (char * buf, int64_t size)
+{
+    int64_t total = 0;
+
+    pthread_mutex_lock (& m_mutex);
+
+    if (m_pos == m_last_read)
+    {
+        if (! m_prefetch && ! m_thread_failed && ++ m_sequential >= SEQUENTIAL_READS)
+        {
+            if (! m_thread_running)
+            {
+                m_cancellable = g_cancellable_new ();
+
+                if (pthread_create (& m_thread, nullptr, prefetch_worker, this))
+                {
+                    /* go on reading without prefetching */
+                    AUDERR ("Cannot start read-ahead thread for %s.\n", (const char *) m_filename);
+                    g_object_unref (m_cancellable);
+                    m_cancellable = nullptr;
+                    m_thread_failed = true;
+                }
+                else
+                    m_thread_running = true;
+            }
+
+            if (m_thread_running)
+            {
+                m_prefetch = true;
+                pthread_cond_broadcast (& m_cond);
+            }
+        }
+    }
+    else
+        m_sequential = 0;
+
+    while (total < size)
+    {
+        if (m_pos < m_buf_end)
+        {
+            int64_t part = aud::min (size - total, m_buf_end - m_pos);
+            memcpy (buf + total, m_buf + (m_pos - m_buf_start), part);
+
+            m_pos += part;
+            total += part;
+
+            if (m_prefetch)
+                pthread_cond_broadcast (& m_cond); /* space may have been freed */
+
+            continue;
+        }
+
+        if (m_eof || m_error)
+            break;
+
+        if (m_prefetch)
+        {
+            pthread_cond_wait (& m_cond, & m_mutex);
+            continue;
+        }
+
+        /* not prefetching, so read a block (or more) here; everything in the
+         * window is behind the read position now */
+        int64_t want = aud::min (aud::max (size - total, (int64_t) BLOCK_SIZE),
+         m_buf_size - KEEP_BEHIND);
+
+        make_room (want);
+
+        int64_t len = fill_block (m_buf + (m_buf_end - m_buf_start), want, nullptr);
+
+        if (len < 0)
+            m_error = true;
+        else
+        {
+            m_buf_end += len;
+            if (len < want)
+                m_eof = true;
+        }
+    }
+
+    m_last_read = m_pos;
+
+    pthread_mutex_unlock (& m_mutex);
+    return total;
+}
+
+int GIOFile::buffered_seek (int64_t offset, VFSSeekType whence)
+{
+    GError * error = 0;
+    int result = 0;
+
+    pthread_mutex_lock (& m_mutex);
+
+    bool from_end = (whence == VFS_SEEK_END);
+    int64_t target = (whence == VFS_SEEK_CUR) ? m_pos + offset : offset;
+
+    /* within the window, including just past the end of the file */
+    if (! from_end && target >= m_buf_start &&
+     (target < m_buf_end || (target == m_buf_end && m_eof)))
+    {
+        m_pos = target;
+        goto DONE;
+    }
+
+    {
+        bool cancelled = stop_prefetch ();
+
+        g_seekable_seek (m_seekable, target, from_end ? G_SEEK_END : G_SEEK_SET,
+         nullptr, & error);
+
+        if (error)
+        {
+            AUDERR ("Cannot seek within %s: %s.\n", (const char *) m_filename, error->message);
+            g_error_free (error);
+            result = -1;
+
+            /* a cancelled read leaves the stream position unknown */
+            if (cancelled)
+                m_error = true;
+
+            goto DONE;
+        }
+    }
+
+    m_pos = m_buf_start = m_buf_end = g_seekable_tell (m_seekable);
+    m_eof = m_error = false;
+    m_sequential = 0;
+
+DONE:
+    pthread_mutex_unlock (& m_mutex);
+    return result;
+}
+
 int64_t GIOFile::fread (void * buf, int64_t size, int64_t nitems)
 {
     GError * error = 0;
@@ -225,6 +590,9 @@ int64_t GIOFile::fread (void * buf, int64_t size, int64_t nitems)
         return 0;
     }
 
+    if (m_buf)
+        return (size > 0) ? buffered_read ((char *) buf, size * nitems) / size : 0;
+
     int64_t total = 0;
     int64_t remain = size * nitems;
 
@@ -296,6 +664,9 @@ int GIOFile::fseek (int64_t offset, VFSSeekType whence)
         return -1;
     }
 
+    if (m_buf)
+        return buffered_seek (offset, whence);
+
     g_seekable_seek (m_seekable, offset, gwhence, nullptr, & error);
     CHECK_ERROR ("seek within", m_filename);
 
@@ -307,6 +678,14 @@ FAILED:
 
 int64_t GIOFile::ftell ()
 {
+    if (m_buf)
+    {
+        pthread_mutex_lock (& m_mutex);
+        int64_t pos = m_pos;
+        pthread_mutex_unlock (& m_mutex);
+        return pos;
+    }
+
     return g_seekable_tell (m_seekable);
 }
 
@@ -26,6 +26,7 @@
 
 #include <libaudcore/i18n.h>
 #include <libaudcore/plugin.h>
+#include <libaudcore/preferences.h>
 
 #include <gdk/gdk.h>
 #include <gtk/gtk.h>
@@ -41,6 +42,8 @@
 #include <gdk/gdkwin32.h>
 #endif
 
+#include "spectrum-analysis.h"
+
 #define NUM_BANDS 32
 #define DB_RANGE 40
 
@@ -58,25 +61,31 @@ static const char gl_about[] =
 class GLSpectrum : public VisPlugin
 {
 public:
+    static const PluginPreferences prefs;
     static constexpr PluginInfo info = {
         N_("OpenGL Spectrum Analyzer"),
         PACKAGE,
-        gl_about
+        gl_about,
+        & prefs
     };
 
-    constexpr GLSpectrum () : VisPlugin (info, Visualizer::Freq) {}
+    constexpr GLSpectrum () : VisPlugin (info, Visualizer::MonoPCM) {}
 
     bool init ();
+    void cleanup ();
 
     void * get_gtk_widget ();
 
     void clear ();
-    void render_freq (const float * freq);
+    void render_mono_pcm (const float * pcm);
 };
 
 EXPORT GLSpectrum aud_plugin_instance;
 
-static float logscale[NUM_BANDS + 1];
+const PluginPreferences GLSpectrum::prefs = {{spectrum_widgets}};
+
+static SpectrumAnalyzer analyzer;
+static SpectrumBands spectrum_bands;
 static float colors[NUM_BANDS][NUM_BANDS][3];
 
 #ifdef GDK_WINDOWING_X11
@@ -99,8 +108,7 @@ static float s_bars[NUM_BANDS][NUM_BANDS];
 
 bool GLSpectrum::init ()
 {
-    for (int i = 0; i <= NUM_BANDS; i ++)
-        logscale[i] = powf (256, (float) i / NUM_BANDS) - 0.5f;
+    analyzer.init ();
 
     for (int y = 0; y < NUM_BANDS; y ++)
     {
@@ -119,36 +127,29 @@ bool GLSpectrum::init ()
     return true;
 }
 
-/* stolen from the skins plugin */
-/* convert linear frequency graph to logarithmic one */
-static void make_log_graph (const float * freq, float * graph)
+void GLSpectrum::cleanup ()
+{
+    analyzer.cleanup ();
+}
+
+/* the third-octave scale has a fixed number of bands, which are stretched or
+   squeezed to fit */
+static void make_graph (const float * power, float * graph)
 {
+    spectrum_bands.update (analyzer, NUM_BANDS);
+
+    int bands = spectrum_bands.bands ();
+    if (! bands)
+        return;
+
+    float levels[NUM_BANDS * 2]; /* at most 31 third-octave bands */
+    spectrum_bands.compute (power, levels);
+
     for (int i = 0; i < NUM_BANDS; i ++)
     {
-        /* sum up values in freq array between logscale[i] and logscale[i + 1],
-           including fractional parts */
-        int a = ceilf (logscale[i]);
-        int b = floorf (logscale[i + 1]);
-        float sum = 0;
-
-        if (b < a)
-            sum += freq[b] * (logscale[i + 1] - logscale[i]);
-        else
-        {
-            if (a > 0)
-                sum += freq[a - 1] * (a - logscale[i]);
-            for (; a < b; a ++)
-                sum += freq[a];
-            if (b < 256)
-                sum += freq[b] * (logscale[i + 1] - b);
-        }
-
         /* fudge factor to make the graph have the same overall height as a
-           12-band one no matter how many bands there are */
-        sum *= (float) NUM_BANDS / 12;
-
-        /* convert to dB */
-        float val = 20 * log10f (sum);
+           12-band one */
+        float val = levels[i * bands / NUM_BANDS] + 10 * log10f ((float) NUM_BANDS / 12);
 
         /* scale (-DB_RANGE, 0.0) to (0.0, 1.0) */
         val = 1 + val / DB_RANGE;
@@ -157,9 +158,9 @@ static void make_log_graph (const float * freq, float * graph)
     }
 }
 
-void GLSpectrum::render_freq (const float * freq)
+void GLSpectrum::render_mono_pcm (const float * pcm)
 {
-    make_log_graph (freq, s_bars[s_pos]);
+    make_graph (analyzer.analyze (pcm), s_bars[s_pos]);
     s_pos = (s_pos + 1) % NUM_BANDS;
 
     s_angle += s_anglespeed;
@@ -172,6 +173,7 @@ void GLSpectrum::render_freq (const float * freq)
 
 void GLSpectrum::clear ()
 {
+    analyzer.reset ();
     memset (s_bars, 0, sizeof s_bars);
 
     if (s_widget)
@@ -0,0 +1,376 @@
+/*
+ * Channel Mixing Matrices for Audacious
+ * Copyright 2011-2015 John Lindgren, Michał Lipski, and Audacious developers
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* Mixing matrices are stored row-major, one row per output channel, so that
+ * output channel o of a frame is the sum over i of matrix[o * in + i] times
+ * input channel i.  Channel order follows the usual WAVE/FFmpeg layouts:
+ *
+ *   3 channels: FL FR FC
+ *   4 channels: FL FR BL BR
+ *   5 channels: FL FR FC BL BR
+ *   6 channels: FL FR FC LFE BL BR
+ *   8 channels: FL FR FC LFE BL BR SL SR
+ *
+ * Shared by mixer and crossfade through src/include. */
+
+#ifndef AUD_CHANNEL_MATRIX_H
+#define AUD_CHANNEL_MATRIX_H
+
+#include <stdlib.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include <libaudcore/index.h>
+
+struct ChannelMatrix
+{
+    int in, out;
+    const float * coefs;
+};
+
+static const float channel_matrix_1_to_2[] = {
+    1,
+    1
+};
+
+static const float channel_matrix_2_to_1[] = {
+    0.5, 0.5
+};
+
+static const float channel_matrix_3_to_2[] = {
+    1, 0, 0.7,
+    0, 1, 0.7
+};
+
+static const float channel_matrix_4_to_2[] = {
+    1, 0, 0.7, 0,
+    0, 1, 0, 0.7
+};
+
+static const float channel_matrix_5_to_2[] = {
+    1, 0, 0.7, 0.7, 0,
+    0, 1, 0.7, 0, 0.7
+};
+
+static const float channel_matrix_6_to_2[] = {
+    1, 0, 0.5, 0.5, 0.5, 0,
+    0, 1, 0.5, 0.5, 0, 0.5
+};
+
+static const float channel_matrix_8_to_2[] = {
+    1, 0, 0.5, 0.5, 0.5, 0, 0.5, 0,
+    0, 1, 0.5, 0.5, 0, 0.5, 0, 0.5
+};
+
+/* the side channels are folded into the back */
+static const float channel_matrix_8_to_6[] = {
+    1, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0,
+    0, 0, 1, 0, 0, 0, 0, 0,
+    0, 0, 0, 1, 0, 0, 0, 0,
+    0, 0, 0, 0, 0.7, 0, 0.7, 0,
+    0, 0, 0, 0, 0, 0.7, 0, 0.7
+};
+
+/* A simple passive upmix: the front channels are passed through, the center
+ * gets the common part of both, and the surrounds get a quieter copy. */
+static const float channel_matrix_2_to_6[] = {
+    1, 0,
+    0, 1,
+    0.5, 0.5,
+    0, 0,
+    0.5, 0,
+    0, 0.5
+};
+
+static const float channel_matrix_2_to_8[] = {
+    1, 0,
+    0, 1,
+    0.5, 0.5,
+    0, 0,
+    0.5, 0,
+    0, 0.5,
+    0.5, 0,
+    0, 0.5
+};
+
+static const ChannelMatrix channel_matrices[] = {
+    {1, 2, channel_matrix_1_to_2},
+    {2, 1, channel_matrix_2_to_1},
+    {3, 2, channel_matrix_3_to_2},
+    {4, 2, channel_matrix_4_to_2},
+    {5, 2, channel_matrix_5_to_2},
+    {6, 2, channel_matrix_6_to_2},
+    {8, 2, channel_matrix_8_to_2},
+    {8, 6, channel_matrix_8_to_6},
+    {2, 6, channel_matrix_2_to_6},
+    {2, 8, channel_matrix_2_to_8}
+};
+
+static inline const ChannelMatrix * channel_matrix_find (int in, int out)
+{
+    for (const ChannelMatrix & m : channel_matrices)
+    {
+        if (m.in == in && m.out == out)
+            return & m;
+    }
+
+    return nullptr;
+}
+
+/* Fills <matrix> with the standard coefficients for converting <in> channels
+ * to <out>.  Conversions without a table of their own are made by going
+ * through stereo (e.g. 8 to 1 channels as 8 to 2 and then 2 to 1).  Returns
+ * false if there is no standard conversion. */
+static inline bool channel_matrix_get (int in, int out, Index<float> & matrix)
+{
+    const ChannelMatrix * direct = channel_matrix_find (in, out);
+
+    if (direct)
+    {
+        matrix.resize (0);
+        matrix.insert (direct->coefs, 0, in * out);
+        return true;
+    }
+
+    const ChannelMatrix * down = (in == 2) ? nullptr : channel_matrix_find (in, 2);
+    const ChannelMatrix * up = (out == 2) ? nullptr : channel_matrix_find (2, out);
+
+    if (! down || ! up)
+        return false;
+
+    /* up (out x 2) times down (2 x in) */
+    matrix.resize (0);
+    matrix.insert (0, in * out);
+
+    for (int o = 0; o < out; o ++)
+    {
+        for (int i = 0; i < in; i ++)
+            matrix[o * in + i] = up->coefs[o * 2] * down->coefs[i] +
+             up->coefs[o * 2 + 1] * down->coefs[in + i];
+    }
+
+    return true;
+}
+
+/* Fills <matrix> with a conversion that is always available: mono is sent to
+ * the first two (front) output channels, and otherwise channels present in
+ * both layouts are passed through while the rest are dropped or silent. */
+static inline void channel_matrix_get_passthrough (int in, int out, Index<float> & matrix)
+{
+    matrix.resize (0);
+    matrix.insert (0, in * out);
+
+    if (in == 1)
+    {
+        for (int o = 0; o < aud::min (out, 2); o ++)
+            matrix[o] = 1;
+    }
+    else
+    {
+        for (int c = 0; c < aud::min (in, out); c ++)
+            matrix[c * in + c] = 1;
+    }
+}
+
+/* Parses a user-defined matrix: one row per output channel, separated by
+ * semicolons, each row holding one coefficient per input channel, separated
+ * by commas or spaces.  Returns false unless the string describes exactly an
+ * <in> to <out> channel matrix. */
+static inline bool channel_matrix_parse (const char * str, int in, int out, Index<float> & matrix)
+{
+    matrix.resize (0);
+
+    for (int o = 0; o < out; o ++)
+    {
+        for (int i = 0; i < in; i ++)
+        {
+            while (* str == ' ' || * str == ',')
+                str ++;
+
+            char * end;
+            float coef = strtof (str, & end);
+            if (end == str)
+                return false;
+
+            matrix.append (coef);
+            str = end;
+        }
+
+        while (* str == ' ')
+            str ++;
+
+        if (* str != (o + 1 < out ? ';' : 0))
+            return false;
+
+        if (* str)
+            str ++;
+    }
+
+    return true;
+}
+
+/* Kernels for particular shapes.  With the channel counts known at compile
+ * time, the inner loops are fully unrolled and the coefficients stay in
+ * registers; mono/stereo conversions get hand-vectorized versions. */
+
+template<int in, int out>
+static void channel_matrix_fixed (const float * matrix, const float * get,
+ float * set, int frames)
+{
+    float m[in * out];
+    for (int k = 0; k < in * out; k ++)
+        m[k] = matrix[k];
+
+    while (frames --)
+    {
+        for (int o = 0; o < out; o ++)
+        {
+            float sum = 0;
+            for (int i = 0; i < in; i ++)
+                sum += m[o * in + i] * get[i];
+
+            set[o] = sum;
+        }
+
+        get += in;
+        set += out;
+    }
+}
+
+static inline void channel_matrix_1_2 (const float * matrix, const float * get,
+ float * set, int frames)
+{
+    float l = matrix[0], r = matrix[1];
+    int f = 0;
+
+#if defined (__SSE__)
+    __m128 g = _mm_setr_ps (l, r, l, r);
+    for (; f + 4 <= frames; f += 4)
+    {
+        __m128 v = _mm_loadu_ps (get + f);
+        _mm_storeu_ps (set + 2 * f, _mm_mul_ps (_mm_unpacklo_ps (v, v), g));
+        _mm_storeu_ps (set + 2 * f + 4, _mm_mul_ps (_mm_unpackhi_ps (v, v), g));
+    }
+#elif defined (__ARM_NEON)
+    float32x4_t g = {l, r, l, r};
+    for (; f + 4 <= frames; f += 4)
+    {
+        float32x4x2_t z = vzipq_f32 (vld1q_f32 (get + f), vld1q_f32 (get + f));
+        vst1q_f32 (set + 2 * f, vmulq_f32 (z.val[0], g));
+        vst1q_f32 (set + 2 * f + 4, vmulq_f32 (z.val[1], g));
+    }
+#endif
+
+    for (; f < frames; f ++)
+    {
+        set[2 * f] = get[f] * l;
+        set[2 * f + 1] = get[f] * r;
+    }
+}
+
+static inline void channel_matrix_2_1 (const float * matrix, const float * get,
+ float * set, int frames)
+{
+    float l = matrix[0], r = matrix[1];
+    int f = 0;
+
+#if defined (__SSE__)
+    __m128 gl = _mm_set1_ps (l), gr = _mm_set1_ps (r);
+    for (; f + 4 <= frames; f += 4)
+    {
+        __m128 a = _mm_loadu_ps (get + 2 * f);
+        __m128 b = _mm_loadu_ps (get + 2 * f + 4);
+        __m128 vl = _mm_shuffle_ps (a, b, _MM_SHUFFLE (2, 0, 2, 0));
+        __m128 vr = _mm_shuffle_ps (a, b, _MM_SHUFFLE (3, 1, 3, 1));
+        _mm_storeu_ps (set + f, _mm_add_ps (_mm_mul_ps (vl, gl), _mm_mul_ps (vr, gr)));
+    }
+#elif defined (__ARM_NEON)
+    for (; f + 4 <= frames; f += 4)
+    {
+        float32x4x2_t u = vld2q_f32 (get + 2 * f);
+        vst1q_f32 (set + f, vmlaq_n_f32 (vmulq_n_f32 (u.val[0], l), u.val[1], r));
+    }
+#endif
+
+    for (; f < frames; f ++)
+        set[f] = get[2 * f] * l + get[2 * f + 1] * r;
+}
+
+typedef void (* ChannelMatrixKernel) (const float * matrix, const float * get,
+ float * set, int frames);
+
+static inline ChannelMatrixKernel channel_matrix_kernel (int in, int out)
+{
+    switch (in * 16 + out)
+    {
+        case 1 * 16 + 2: return channel_matrix_1_2;
+        case 2 * 16 + 1: return channel_matrix_2_1;
+        case 2 * 16 + 2: return channel_matrix_fixed<2, 2>;
+        case 3 * 16 + 2: return channel_matrix_fixed<3, 2>;
+        case 4 * 16 + 2: return channel_matrix_fixed<4, 2>;
+        case 5 * 16 + 2: return channel_matrix_fixed<5, 2>;
+        case 6 * 16 + 2: return channel_matrix_fixed<6, 2>;
+        case 8 * 16 + 2: return channel_matrix_fixed<8, 2>;
+        case 8 * 16 + 6: return channel_matrix_fixed<8, 6>;
+        case 2 * 16 + 6: return channel_matrix_fixed<2, 6>;
+        case 2 * 16 + 8: return channel_matrix_fixed<2, 8>;
+        case 6 * 16 + 1: return channel_matrix_fixed<6, 1>;
+        case 8 * 16 + 1: return channel_matrix_fixed<8, 1>;
+        default: return nullptr;
+    }
+}
+
+/* Mixes <frames> frames of <in>-channel audio from <get> into <out>-channel
+ * audio in <set>. */
+static inline void channel_matrix_apply (const float * matrix, int in, int out,
+ const float * get, float * set, int frames)
+{
+    ChannelMatrixKernel kernel = (in < 16 && out < 16) ? channel_matrix_kernel (in, out) : nullptr;
+
+    if (kernel)
+    {
+        kernel (matrix, get, set, frames);
+        return;
+    }
+
+    while (frames --)
+    {
+        const float * row = matrix;
+
+        for (int o = 0; o < out; o ++)
+        {
+            float sum = 0;
+            for (int i = 0; i < in; i ++)
+                sum += row[i] * get[i];
+
+            * set ++ = sum;
+            row += in;
+        }
+
+        get += in;
+    }
+}
+
+#endif /* AUD_CHANNEL_MATRIX_H */
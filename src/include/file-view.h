@@ -0,0 +1,152 @@
+/*
+ * Mapped File View for Audacious
+ * Copyright 2015 Audacious developers
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* The contents of a VFSFile from the current position to the end, for plugins
+ * that load whole file images.  Local files are memory-mapped rather than
+ * copied with VFSFile::read_all(), so that a large image is neither copied nor
+ * held in memory twice; the kernel reads pages in as the decoder touches them.
+ * Other transports fall back to read_all().  As with read_all(), at most
+ * FILE_VIEW_MAX bytes are returned.
+ *
+ * The data must not be modified.  The mapping is private and writable anyway,
+ * since some old decoders take non-const pointers; a stray write then costs a
+ * page copy rather than a crash.  As with any mapping, truncating the file
+ * while it is in use can raise SIGBUS.
+ *
+ * This file is header-only so that it can be shared between plugins; it lives
+ * in src/include, which their Makefiles add to the include path. */
+
+#ifndef AUD_FILE_VIEW_H
+#define AUD_FILE_VIEW_H
+
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <libaudcore/audstrings.h>
+#include <libaudcore/index.h>
+#include <libaudcore/vfs.h>
+
+/* same limit as VFSFile::read_all() */
+#define FILE_VIEW_MAX 16777216
+
+class FileView
+{
+public:
+    FileView () = default;
+    FileView (const FileView &) = delete;
+    FileView & operator= (const FileView &) = delete;
+
+    explicit FileView (VFSFile & file)
+        { open (file); }
+    ~FileView ()
+        { close (); }
+
+    const char * begin () const
+        { return m_data; }
+    int len () const
+        { return m_len; }
+    bool mapped () const
+        { return m_map != nullptr; }
+
+    void open (VFSFile & file)
+    {
+        close ();
+
+#ifndef _WIN32
+        if (map (file))
+            return;
+#endif
+
+        m_copy = file.read_all ();
+        m_data = m_copy.begin ();
+        m_len = m_copy.len ();
+    }
+
+    void close ()
+    {
+#ifndef _WIN32
+        if (m_map)
+            munmap (m_map, m_map_len);
+#endif
+
+        m_copy.clear ();
+        m_map = nullptr;
+        m_map_len = 0;
+        m_data = nullptr;
+        m_len = 0;
+    }
+
+private:
+    Index<char> m_copy;
+    void * m_map = nullptr;
+    size_t m_map_len = 0;
+    const char * m_data = nullptr;
+    int m_len = 0;
+
+#ifndef _WIN32
+    bool map (VFSFile & file)
+    {
+        StringBuf filename = uri_to_filename (file.filename ());
+        if (! filename)
+            return false;
+
+        int64_t pos = file.ftell ();
+        if (pos < 0)
+            return false;
+
+        int fd = ::open (filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        void * map = MAP_FAILED;
+        int64_t size = 0;
+
+        /* empty files and pipes go through read_all() */
+        if (! fstat (fd, & info) && S_ISREG (info.st_mode) && info.st_size > pos)
+        {
+            size = aud::min ((int64_t) info.st_size, pos + FILE_VIEW_MAX);
+            map = mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+
+        ::close (fd);
+
+        if (map == MAP_FAILED)
+            return false;
+
+        /* the image is usually parsed from start to end right away */
+        madvise (map, size, MADV_SEQUENTIAL);
+        madvise (map, size, MADV_WILLNEED);
+
+        m_map = map;
+        m_map_len = size;
+        m_data = (const char *) map + pos;
+        m_len = size - pos;
+        return true;
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * Low-Latency Polyphase Resampler for Audacious
+ * Copyright 2015 Audacious developers
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* A small windowed-sinc resampler for plugins that need to convert a stream
+ * on the fly without going through a full effect chain reconfiguration.  The
+ * filter is short (POLYPHASE_TAPS input frames, i.e. a delay of half that),
+ * trading some stopband attenuation for latency.  Positions are tracked as an
+ * exact rational fraction, so there is no long-term drift; the fractional
+ * position is mapped onto a fixed table of POLYPHASE_PHASES filter phases with
+ * linear interpolation between neighboring phases.
+ *
+ * Kept in src/include for crossfade and jack-ng; it is not used by the
+ * resample plugin itself, which goes through libsamplerate. */
+
+#ifndef AUD_POLYPHASE_H
+#define AUD_POLYPHASE_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <libaudcore/index.h>
+
+#define POLYPHASE_TAPS 16
+#define POLYPHASE_PHASES 256
+
+class PolyphaseResampler
+{
+public:
+    bool active () const
+        { return m_channels && m_in_rate != m_out_rate; }
+
+    /* latency in input frames */
+    int delay () const
+        { return active () ? POLYPHASE_TAPS / 2 : 0; }
+
+    int in_rate () const
+        { return m_in_rate; }
+    int out_rate () const
+        { return m_out_rate; }
+
+    void init (int channels, int in_rate, int out_rate);
+    void reset ();
+    void destroy ();
+
+    /* Appends the resampled version of <len> interleaved samples to <out>. */
+    void process (const float * data, int len, Index<float> & out);
+
+    /* Appends whatever is left in the filter's delay line to <out>. */
+    void drain (Index<float> & out);
+
+private:
+    int m_channels = 0;
+    int m_in_rate = 0, m_out_rate = 0;
+
+    /* each output frame advances the input position by m_step / m_scale
+     * frames; m_frac is the fractional part in units of 1 / m_scale */
+    int m_step = 0, m_scale = 0;
+    int m_frac = 0;
+
+    /* input frames to drop before the next output (large downsampling ratios
+     * can step past the end of the delay line) */
+    int m_skip = 0;
+
+    Index<float> m_coefs; /* (POLYPHASE_PHASES + 1) * POLYPHASE_TAPS */
+    Index<float> m_hist;  /* interleaved input frames not yet fully consumed */
+
+    void run (Index<float> & out);
+};
+
+static inline int polyphase_gcd (int a, int b)
+{
+    while (b)
+    {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+inline void PolyphaseResampler::init (int channels, int in_rate, int out_rate)
+{
+    m_channels = channels;
+    m_in_rate = in_rate;
+    m_out_rate = out_rate;
+
+    if (in_rate == out_rate)
+    {
+        m_hist.clear ();
+        m_coefs.clear ();
+        return;
+    }
+
+    int gcd = polyphase_gcd (in_rate, out_rate);
+    m_step = in_rate / gcd;
+    m_scale = out_rate / gcd;
+
+    /* when downsampling, lower the cutoff to the output Nyquist frequency */
+    double cutoff = 0.95 * aud::min (1.0, (double) out_rate / in_rate);
+
+    m_coefs.resize ((POLYPHASE_PHASES + 1) * POLYPHASE_TAPS);
+
+    for (int p = 0; p <= POLYPHASE_PHASES; p ++)
+    {
+        float * coefs = & m_coefs[p * POLYPHASE_TAPS];
+        double frac = (double) p / POLYPHASE_PHASES;
+        double sum = 0;
+
+        for (int k = 0; k < POLYPHASE_TAPS; k ++)
+        {
+            /* distance of this tap from the output position, in input frames */
+            double x = k - (POLYPHASE_TAPS / 2 - 1) - frac;
+            double sinc = (x == 0) ? 1 : sin (M_PI * cutoff * x) / (M_PI * cutoff * x);
+
+            /* Blackman window spanning the filter length */
+            double w = 2 * M_PI * (x + POLYPHASE_TAPS / 2) / POLYPHASE_TAPS;
+            double window = 0.42 - 0.5 * cos (w) + 0.08 * cos (2 * w);
+
+            coefs[k] = sinc * window;
+            sum += coefs[k];
+        }
+
+        /* normalize each phase for unity gain at DC */
+        for (int k = 0; k < POLYPHASE_TAPS; k ++)
+            coefs[k] /= sum;
+    }
+
+    reset ();
+}
+
+inline void PolyphaseResampler::reset ()
+{
+    m_frac = 0;
+    m_skip = 0;
+
+    /* prime the delay line so that the first output frame lines up with the
+     * first input frame */
+    m_hist.resize (0);
+    if (active ())
+        m_hist.insert (0, m_channels * (POLYPHASE_TAPS / 2 - 1));
+}
+
+inline void PolyphaseResampler::destroy ()
+{
+    m_channels = 0;
+    m_in_rate = m_out_rate = 0;
+    m_coefs.clear ();
+    m_hist.clear ();
+}
+
+inline void PolyphaseResampler::process (const float * data, int len, Index<float> & out)
+{
+    if (! active ())
+    {
+        out.insert (data, -1, len);
+        return;
+    }
+
+    m_hist.insert (data, -1, len);
+    run (out);
+}
+
+inline void PolyphaseResampler::drain (Index<float> & out)
+{
+    if (! active ())
+        return;
+
+    m_hist.insert (-1, m_channels * (POLYPHASE_TAPS / 2));
+    run (out);
+    reset ();
+}
+
+inline void PolyphaseResampler::run (Index<float> & out)
+{
+    int frames = m_hist.len () / m_channels;
+
+    if (m_skip)
+    {
+        int skip = aud::min (m_skip, frames);
+        m_hist.remove (0, m_channels * skip);
+        m_skip -= skip;
+        frames -= skip;
+    }
+
+    if (frames < POLYPHASE_TAPS)
+        return;
+
+    /* upper bound on the number of output frames we can produce */
+    int64_t max_out = ((int64_t) (frames - POLYPHASE_TAPS + 1) * m_scale + m_scale) / m_step + 1;
+    int out_pos = out.len ();
+    out.insert (-1, m_channels * (int) max_out);
+
+    float * set = & out[out_pos];
+    const float * hist = m_hist.begin ();
+    float coefs[POLYPHASE_TAPS];
+    int pos = 0, produced = 0;
+
+    while (pos + POLYPHASE_TAPS <= frames)
+    {
+        /* interpolate between the two nearest filter phases */
+        int64_t scaled = (int64_t) m_frac * POLYPHASE_PHASES;
+        int phase = scaled / m_scale;
+        float alpha = (float) (scaled - (int64_t) phase * m_scale) / m_scale;
+
+        const float * c0 = & m_coefs[phase * POLYPHASE_TAPS];
+        const float * c1 = c0 + POLYPHASE_TAPS;
+
+        for (int k = 0; k < POLYPHASE_TAPS; k ++)
+            coefs[k] = c0[k] + (c1[k] - c0[k]) * alpha;
+
+        const float * get = hist + pos * m_channels;
+
+        for (int c = 0; c < m_channels; c ++)
+        {
+            float sum = 0;
+            for (int k = 0; k < POLYPHASE_TAPS; k ++)
+                sum += get[k * m_channels + c] * coefs[k];
+
+            * set ++ = sum;
+        }
+
+        produced ++;
+
+        m_frac += m_step;
+        pos += m_frac / m_scale;
+        m_frac %= m_scale;
+    }
+
+    out.resize (out_pos + m_channels * produced);
+    m_skip = aud::max (pos - frames, 0);
+    m_hist.remove (0, m_channels * aud::min (pos, frames));
+}
+
+#endif /* AUD_POLYPHASE_H */
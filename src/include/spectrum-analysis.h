@@ -0,0 +1,509 @@
+/*
+ * Shared Spectrum Analysis for Audacious Visualizers
+ * Copyright 2015 Audacious developers
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* Spectrum visualizers take mono PCM from the visualization core and pass it
+ * to a SpectrumAnalyzer, which keeps the last <fft_size> samples and computes
+ * a windowed power spectrum over them for every block received (so blocks
+ * overlap by fft_size - SPECTRUM_BLOCK samples).  A SpectrumBands object then
+ * maps the spectrum onto a number of log-, mel- or third-octave-spaced bands
+ * through a precomputed table of bin weights.
+ *
+ * The FFT size and band scale are shared settings (config section
+ * "spectrum").  Each analyzer publishes its result through the "spectrum
+ * frame" hook, so that when several visualizers are running, the spectrum of
+ * each block is computed only once and the others reuse it.
+ *
+ * Used by both cairo-spectrum and gl-spectrum, hence header-only and kept in
+ * src/include. */
+
+#ifndef AUD_SPECTRUM_ANALYSIS_H
+#define AUD_SPECTRUM_ANALYSIS_H
+
+#include <math.h>
+#include <string.h>
+
+#include <libaudcore/drct.h>
+#include <libaudcore/hook.h>
+#include <libaudcore/i18n.h>
+#include <libaudcore/index.h>
+#include <libaudcore/preferences.h>
+#include <libaudcore/runtime.h>
+
+#define SPECTRUM_BLOCK 512 /* samples per render_mono_pcm () call */
+#define SPECTRUM_MIN_FFT 512
+#define SPECTRUM_MAX_FFT 16384
+
+#define SPECTRUM_MIN_FREQ 20
+#define SPECTRUM_MAX_FREQ 20000
+
+enum SpectrumScale {
+    SPECTRUM_LOG,
+    SPECTRUM_MEL,
+    SPECTRUM_THIRD_OCTAVE
+};
+
+static const char * const spectrum_defaults[] = {
+    "fft_size", "4096",
+    "scale", aud::numeric_string<SPECTRUM_LOG>::str,
+    nullptr
+};
+
+static void spectrum_settings_changed ()
+{
+    hook_call ("spectrum settings", nullptr);
+}
+
+static const ComboItem spectrum_fft_sizes[] = {
+    ComboItem ("512", 512),
+    ComboItem ("1024", 1024),
+    ComboItem ("2048", 2048),
+    ComboItem ("4096", 4096),
+    ComboItem ("8192", 8192),
+    ComboItem ("16384", 16384)
+};
+
+static const ComboItem spectrum_scales[] = {
+    ComboItem (N_("Logarithmic"), SPECTRUM_LOG),
+    ComboItem (N_("Mel"), SPECTRUM_MEL),
+    ComboItem (N_("Third-octave"), SPECTRUM_THIRD_OCTAVE)
+};
+
+static const PreferencesWidget spectrum_widgets[] = {
+    WidgetLabel (N_("<b>Analysis</b>")),
+    WidgetCombo (N_("FFT size:"),
+        WidgetInt ("spectrum", "fft_size", spectrum_settings_changed),
+        {{spectrum_fft_sizes}}),
+    WidgetCombo (N_("Frequency scale:"),
+        WidgetInt ("spectrum", "scale", spectrum_settings_changed),
+        {{spectrum_scales}}),
+    WidgetLabel (N_("These settings are shared by all spectrum visualizers."))
+};
+
+/* Radix-2 FFT of real input, computed as a complex FFT of half the size. */
+class SpectrumFFT
+{
+public:
+    void init (int size);
+
+    /* Computes |X[k]|^2 for k = 0 .. size / 2 from <size> real samples. */
+    void power (const float * in, float * out);
+
+private:
+    int m_size = 0;
+    Index<int> m_reverse;   /* bit reversal for size / 2 */
+    Index<float> m_twiddle; /* cos, sin of -2 pi k / size for k < size / 2 */
+    Index<float> m_work;    /* size / 2 complex values */
+};
+
+inline void SpectrumFFT::init (int size)
+{
+    int half = size / 2;
+    int bits = 0;
+    while ((1 << bits) < half)
+        bits ++;
+
+    m_size = size;
+    m_reverse.resize (half);
+    m_twiddle.resize (size);
+    m_work.resize (size);
+
+    for (int i = 0; i < half; i ++)
+    {
+        int r = 0;
+        for (int b = 0; b < bits; b ++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+
+        m_reverse[i] = r;
+    }
+
+    for (int k = 0; k < half; k ++)
+    {
+        m_twiddle[2 * k] = cos (-2 * M_PI * k / size);
+        m_twiddle[2 * k + 1] = sin (-2 * M_PI * k / size);
+    }
+}
+
+inline void SpectrumFFT::power (const float * in, float * out)
+{
+    int half = m_size / 2;
+    float * z = m_work.begin ();
+
+    /* pack even samples as real parts and odd samples as imaginary parts */
+    for (int i = 0; i < half; i ++)
+    {
+        int r = m_reverse[i];
+        z[2 * r] = in[2 * i];
+        z[2 * r + 1] = in[2 * i + 1];
+    }
+
+    /* the twiddle factors for a sub-FFT of length <len> are every
+     * (m_size / len)th entry of the table */
+    for (int len = 2; len <= half; len <<= 1)
+    {
+        int step = m_size / len;
+
+        for (int start = 0; start < half; start += len)
+        {
+            for (int k = 0; k < len / 2; k ++)
+            {
+                float wr = m_twiddle[2 * k * step];
+                float wi = m_twiddle[2 * k * step + 1];
+
+                float * a = z + 2 * (start + k);
+                float * b = z + 2 * (start + k + len / 2);
+
+                float tr = b[0] * wr - b[1] * wi;
+                float ti = b[0] * wi + b[1] * wr;
+
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+
+    /* separate the spectra of the even and odd samples and combine them */
+    for (int k = 0; k <= half; k ++)
+    {
+        int k1 = k % half, k2 = (half - k) % half;
+
+        float even_re = (z[2 * k1] + z[2 * k2]) / 2;
+        float even_im = (z[2 * k1 + 1] - z[2 * k2 + 1]) / 2;
+        float odd_re = (z[2 * k1 + 1] + z[2 * k2 + 1]) / 2;
+        float odd_im = (z[2 * k2] - z[2 * k1]) / 2;
+
+        float wr = (k < half) ? m_twiddle[2 * k] : -1;
+        float wi = (k < half) ? m_twiddle[2 * k + 1] : 0;
+
+        float xr = even_re + odd_re * wr - odd_im * wi;
+        float xi = even_im + odd_re * wi + odd_im * wr;
+
+        out[k] = xr * xr + xi * xi;
+    }
+}
+
+struct SpectrumFrame {
+    const void * source;
+    const float * pcm; /* the last SPECTRUM_BLOCK samples analyzed */
+    int fft_size, rate;
+    const float * power;
+};
+
+class SpectrumAnalyzer
+{
+public:
+    void init ();
+    void cleanup ();
+    void reset ();
+
+    int fft_size () const
+        { return m_size; }
+    int rate () const
+        { return m_rate; }
+
+    /* incremented whenever the FFT size or sample rate changes */
+    int generation () const
+        { return m_generation; }
+
+    /* Takes the next SPECTRUM_BLOCK samples and returns the power spectrum
+     * (fft_size () / 2 + 1 values, scaled so that a full-scale sine wave has
+     * a power of 1) of the last fft_size () samples. */
+    const float * analyze (const float * pcm);
+
+private:
+    int m_size = 0, m_rate = 0, m_generation = 0;
+
+    SpectrumFFT m_fft;
+    Index<float> m_window;
+    Index<float> m_history; /* the last m_size samples */
+    Index<float> m_windowed;
+    Index<float> m_power;
+
+    /* a frame computed by another analyzer, not yet used */
+    bool m_shared_valid = false;
+    float m_shared_pcm[SPECTRUM_BLOCK];
+    Index<float> m_shared_power;
+
+    void configure ();
+
+    static void settings_cb (void *, void * analyzer)
+        { ((SpectrumAnalyzer *) analyzer)->configure (); }
+    static void frame_cb (void * frame, void * analyzer);
+};
+
+inline void SpectrumAnalyzer::init ()
+{
+    aud_config_set_defaults ("spectrum", spectrum_defaults);
+
+    configure ();
+
+    hook_associate ("spectrum settings", settings_cb, this);
+    hook_associate ("spectrum frame", frame_cb, this);
+}
+
+inline void SpectrumAnalyzer::cleanup ()
+{
+    hook_dissociate ("spectrum settings", settings_cb, this);
+    hook_dissociate ("spectrum frame", frame_cb, this);
+
+    m_size = 0;
+    m_window.clear ();
+    m_history.clear ();
+    m_windowed.clear ();
+    m_power.clear ();
+    m_shared_power.clear ();
+    m_shared_valid = false;
+}
+
+inline void SpectrumAnalyzer::configure ()
+{
+    int size = aud_get_int ("spectrum", "fft_size");
+
+    /* round down to a power of two */
+    int pow2 = SPECTRUM_MIN_FFT;
+    while (pow2 * 2 <= aud::min (size, SPECTRUM_MAX_FFT))
+        pow2 *= 2;
+
+    if (pow2 == m_size)
+        return;
+
+    m_size = pow2;
+    m_fft.init (m_size);
+
+    /* Hann window, scaled so that a full-scale sine wave has a peak power
+     * of 1 (the window sums to m_size / 2, and the sine's energy is split
+     * between positive and negative frequencies) */
+    m_window.resize (m_size);
+    for (int i = 0; i < m_size; i ++)
+        m_window[i] = (1 - cos (2 * M_PI * i / m_size)) * 2 / m_size;
+
+    m_windowed.resize (m_size);
+    m_power.resize (m_size / 2 + 1);
+    m_shared_power.resize (m_size / 2 + 1);
+
+    reset ();
+    m_generation ++;
+}
+
+inline void SpectrumAnalyzer::reset ()
+{
+    m_history.resize (0);
+    m_history.insert (0, m_size);
+    m_power.resize (0);
+    m_power.insert (0, m_size / 2 + 1);
+    m_shared_valid = false;
+}
+
+inline void SpectrumAnalyzer::frame_cb (void * frame_, void * analyzer_)
+{
+    auto frame = (const SpectrumFrame *) frame_;
+    auto analyzer = (SpectrumAnalyzer *) analyzer_;
+
+    if (frame->source == analyzer || frame->fft_size != analyzer->m_size)
+        return;
+
+    memcpy (analyzer->m_shared_pcm, frame->pcm, sizeof analyzer->m_shared_pcm);
+    memcpy (analyzer->m_shared_power.begin (), frame->power,
+     sizeof (float) * analyzer->m_shared_power.len ());
+
+    analyzer->m_shared_valid = true;
+}
+
+inline const float * SpectrumAnalyzer::analyze (const float * pcm)
+{
+    int bitrate, rate, channels;
+    aud_drct_get_info (bitrate, rate, channels);
+
+    if (rate > 0 && rate != m_rate)
+    {
+        m_rate = rate;
+        m_generation ++;
+    }
+    else if (! m_rate)
+        m_rate = 44100;
+
+    m_history.remove (0, SPECTRUM_BLOCK);
+    m_history.insert (pcm, -1, SPECTRUM_BLOCK);
+
+    /* all visualizers get the same block; if another one has just analyzed
+     * it (with the same history), use its result */
+    if (m_shared_valid && ! memcmp (m_shared_pcm, pcm, sizeof m_shared_pcm))
+    {
+        m_shared_valid = false;
+        std::swap (m_power, m_shared_power);
+        return m_power.begin ();
+    }
+
+    m_shared_valid = false;
+
+    for (int i = 0; i < m_size; i ++)
+        m_windowed[i] = m_history[i] * m_window[i];
+
+    m_fft.power (m_windowed.begin (), m_power.begin ());
+
+    SpectrumFrame frame = {this, pcm, m_size, m_rate, m_power.begin ()};
+    hook_call ("spectrum frame", & frame);
+
+    return m_power.begin ();
+}
+
+/* Maps a power spectrum onto bands.  Each band sums the power of the bins
+ * it covers, weighting partially covered bins by the covered fraction; bands
+ * narrower than a bin interpolate the nearest bins instead. */
+class SpectrumBands
+{
+public:
+    int bands () const
+        { return m_bands; }
+
+    /* Rebuilds the bin map if anything has changed.  For the third-octave
+     * scale, the number of bands is fixed and <bands> is ignored. */
+    void update (const SpectrumAnalyzer & analyzer, int bands);
+
+    /* Fills <levels> (bands () values) with the level of each band in dB. */
+    void compute (const float * power, float * levels) const;
+
+private:
+    int m_bands = 0, m_requested = 0, m_generation = -1;
+    SpectrumScale m_scale = SPECTRUM_LOG;
+
+    Index<int> m_first, m_count; /* range of bins per band */
+    Index<float> m_weights;      /* concatenated weights of all bands */
+
+    void add_band (float lo, float hi, float bin_width, int max_bin);
+};
+
+static inline float spectrum_mel (float freq)
+{
+    return 2595 * log10f (1 + freq / 700);
+}
+
+static inline float spectrum_mel_to_freq (float mel)
+{
+    return 700 * (powf (10, mel / 2595) - 1);
+}
+
+inline void SpectrumBands::add_band (float lo, float hi, float bin_width, int max_bin)
+{
+    /* bin b covers the frequencies ((b - 0.5) * bin_width, (b + 0.5) * bin_width) */
+    float a = lo / bin_width + 0.5f, b = hi / bin_width + 0.5f;
+    int first = aud::clamp ((int) a, 0, max_bin);
+    int last = aud::clamp ((int) b, 0, max_bin);
+
+    int start = m_weights.len ();
+    float total = 0;
+
+    for (int bin = first; bin <= last; bin ++)
+    {
+        float w = aud::min (b, (float) (bin + 1)) - aud::max (a, (float) bin);
+        w = aud::max (w, 0.0f);
+        m_weights.append (w);
+        total += w;
+    }
+
+    if (total < 1)
+    {
+        /* interpolate between the two bins nearest the band's center */
+        float center = (a + b) / 2 - 0.5f;
+        int bin = aud::clamp ((int) center, 0, max_bin - 1);
+        float frac = aud::clamp (center - bin, 0.0f, 1.0f);
+
+        m_weights.remove (start, -1);
+        m_weights.append (1 - frac);
+        m_weights.append (frac);
+        first = bin;
+        last = bin + 1;
+    }
+
+    m_first.append (first);
+    m_count.append (last - first + 1);
+}
+
+inline void SpectrumBands::update (const SpectrumAnalyzer & analyzer, int bands)
+{
+    auto scale = (SpectrumScale) aud_get_int ("spectrum", "scale");
+
+    if (analyzer.generation () == m_generation && bands == m_requested && scale == m_scale)
+        return;
+
+    m_generation = analyzer.generation ();
+    m_requested = bands;
+    m_scale = scale;
+
+    m_first.clear ();
+    m_count.clear ();
+    m_weights.clear ();
+
+    int max_bin = analyzer.fft_size () / 2;
+    float bin_width = (float) analyzer.rate () / analyzer.fft_size ();
+    float max_freq = aud::min ((float) SPECTRUM_MAX_FREQ, analyzer.rate () / 2.0f);
+
+    if (scale == SPECTRUM_THIRD_OCTAVE)
+    {
+        /* ISO bands are centered on 1 kHz * 2 ^ (k / 3) */
+        for (int k = -17; ; k ++)
+        {
+            float center = 1000 * powf (2, k / 3.0f);
+            if (center * powf (2, 1 / 6.0f) > max_freq)
+                break;
+
+            if (center >= SPECTRUM_MIN_FREQ)
+                add_band (center * powf (2, -1 / 6.0f), center * powf (2, 1 / 6.0f), bin_width, max_bin);
+        }
+    }
+    else if (scale == SPECTRUM_MEL)
+    {
+        float lo = spectrum_mel (SPECTRUM_MIN_FREQ), hi = spectrum_mel (max_freq);
+
+        for (int i = 0; i < bands; i ++)
+            add_band (spectrum_mel_to_freq (lo + (hi - lo) * i / bands),
+             spectrum_mel_to_freq (lo + (hi - lo) * (i + 1) / bands), bin_width, max_bin);
+    }
+    else
+    {
+        float ratio = max_freq / SPECTRUM_MIN_FREQ;
+
+        for (int i = 0; i < bands; i ++)
+            add_band (SPECTRUM_MIN_FREQ * powf (ratio, (float) i / bands),
+             SPECTRUM_MIN_FREQ * powf (ratio, (float) (i + 1) / bands), bin_width, max_bin);
+    }
+
+    m_bands = m_first.len ();
+}
+
+inline void SpectrumBands::compute (const float * power, float * levels) const
+{
+    const float * w = m_weights.begin ();
+
+    for (int i = 0; i < m_bands; i ++)
+    {
+        const float * p = power + m_first[i];
+        float sum = 0;
+
+        for (int j = 0; j < m_count[i]; j ++)
+            sum += p[j] * w[j];
+
+        w += m_count[i];
+
+        levels[i] = 10 * log10f (aud::max (sum, 1e-12f));
+    }
+}
+
+#endif /* AUD_SPECTRUM_ANALYSIS_H */
@@ -19,21 +19,38 @@
  * the use of this software.
  */
 
+/*
+ * The JACK process callback runs in a realtime thread, so it must not take
+ * locks.  Audio is handed to it through a jack_ringbuffer_t (which is safe for
+ * one reader and one writer), and everything else it needs is in variables
+ * accessed with atomic operations.  Other threads that need to wait for the
+ * callback (to find room in the buffer, for a flush to complete, etc.) raise
+ * m_waiting and are woken by a semaphore, which is safe to post from the
+ * callback.
+ *
+ * If the JACK server runs at a different sample rate than the audio being
+ * played, the audio is converted in write_audio(), before it goes into the
+ * ring buffer.
+ */
+
 #include <libaudcore/audstrings.h>
 #include <libaudcore/i18n.h>
 #include <libaudcore/interface.h>
 #include <libaudcore/plugin.h>
 #include <libaudcore/preferences.h>
-#include <libaudcore/ringbuf.h>
 #include <libaudcore/runtime.h>
 
 #include <algorithm>
 
 #include <assert.h>
-#include <pthread.h>
-#include <sys/time.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <time.h>
 
 #include <jack/jack.h>
+#include <jack/ringbuffer.h>
+
+#include "polyphase.h"
 
 static_assert(std::is_same<jack_default_audio_sample_t, float>::value,
  "JACK must be compiled to use float samples");
@@ -52,9 +69,8 @@ public:
         & prefs
     };
 
-    constexpr JACKOutput (RingBuf<float> & buffer) :
-        OutputPlugin (info, 0),
-        m_buffer (buffer) {}
+    constexpr JACKOutput () :
+        OutputPlugin (info, 0) {}
 
     bool init ();
 
@@ -76,32 +92,46 @@ public:
 private:
     bool connect_ports (int channels);
     void generate (jack_nframes_t frames);
+    void wait_for_cycle ();
+    int space_frames ();
+    void write_ring (const void * data, int bytes);
 
     static void error_cb (const char * error)
         { AUDWARN ("%s\n", error); }
     static int generate_cb (jack_nframes_t frames, void * obj)
         { ((JACKOutput *) obj)->generate (frames); return 0; }
+    static int rate_cb (jack_nframes_t rate, void * obj)
+        { __atomic_store_n (& ((JACKOutput *) obj)->m_jack_rate, (int) rate, __ATOMIC_RELEASE); return 0; }
+    static int period_cb (jack_nframes_t frames, void * obj)
+        { __atomic_store_n (& ((JACKOutput *) obj)->m_period, (int) frames, __ATOMIC_RELEASE); return 0; }
 
     int m_rate = 0, m_channels = 0;
-    bool m_paused = false, m_prebuffer = false;
+    int m_frame_size = 0; /* bytes */
+    int m_buffer_size = 0; /* bytes, as requested */
 
+    /* shared with the process callback */
+    int m_jack_rate = 0, m_period = 0;
+    bool m_paused = false, m_prebuffer = false;
+    bool m_waiting = false;
+    int m_volume_left = 0, m_volume_right = 0;
+    int m_flush_request = 0, m_flush_done = 0;
+    size_t m_written = 0, m_flush_point = 0; /* bytes, modulo SIZE_MAX + 1 */
     int m_last_write_frames = 0;
-    timeval m_last_write_time = timeval ();
-    bool m_rate_mismatch = false;
 
-    RingBuf<float> & m_buffer;
+    /* used only by the process callback */
+    size_t m_read = 0; /* bytes, modulo SIZE_MAX + 1 */
 
     jack_client_t * m_client = nullptr;
     jack_port_t * m_ports[AUD_MAX_CHANNELS] = {};
-
-    pthread_mutex_t m_mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_cond_t m_cond = PTHREAD_COND_INITIALIZER;
+    jack_ringbuffer_t * m_ring = nullptr;
 };
 
 // must be separate in order for JACKOutput() to be constexpr
-static RingBuf<float> s_buffer;
+static PolyphaseResampler s_resampler;
+static Index<float> s_converted;
+static sem_t s_wake;
 
-EXPORT JACKOutput aud_plugin_instance (s_buffer);
+EXPORT JACKOutput aud_plugin_instance;
 
 const char * const JACKOutput::defaults[] = {
     "auto_connect", "TRUE",
@@ -120,6 +150,10 @@ const PluginPreferences JACKOutput::prefs = {{widgets}};
 bool JACKOutput::init ()
 {
     aud_config_set_defaults ("jack", defaults);
+
+    m_volume_left = aud_get_int ("jack", "volume_left");
+    m_volume_right = aud_get_int ("jack", "volume_right");
+
     return true;
 }
 
@@ -127,11 +161,15 @@ void JACKOutput::set_volume (StereoVolume v)
 {
     aud_set_int ("jack", "volume_left", v.left);
     aud_set_int ("jack", "volume_right", v.right);
+
+    __atomic_store_n (& m_volume_left, v.left, __ATOMIC_RELAXED);
+    __atomic_store_n (& m_volume_right, v.right, __ATOMIC_RELAXED);
 }
 
 StereoVolume JACKOutput::get_volume ()
 {
-    return {aud_get_int ("jack", "volume_left"), aud_get_int ("jack", "volume_right")};
+    return {__atomic_load_n (& m_volume_left, __ATOMIC_RELAXED),
+     __atomic_load_n (& m_volume_right, __ATOMIC_RELAXED)};
 }
 
 bool JACKOutput::connect_ports (int channels)
@@ -209,19 +247,42 @@ bool JACKOutput::open_audio (int format, int rate, int channels)
         }
     }
 
-    buffer_time = aud_get_int (nullptr, "output_buffer_size");
-    m_buffer.alloc (aud::rescale (buffer_time, 1000, rate) * channels);
-
     m_rate = rate;
     m_channels = channels;
+    m_frame_size = sizeof (float) * channels;
+    m_jack_rate = jack_get_sample_rate (m_client);
+    m_period = jack_get_buffer_size (m_client);
+
+    if (m_jack_rate != rate)
+        AUDINFO ("Converting from %d Hz to the JACK server rate of %d Hz.\n",
+         rate, m_jack_rate);
+
+    s_resampler.init (channels, rate, m_jack_rate);
+
+    /* the ring buffer holds audio at the JACK server rate */
+    buffer_time = aud_get_int (nullptr, "output_buffer_size");
+    m_buffer_size = aud::rescale (buffer_time, 1000, m_jack_rate) * m_frame_size;
+
+    if (! (m_ring = jack_ringbuffer_create (m_buffer_size)))
+    {
+        AUDERR ("jack_ringbuffer_create() failed\n");
+        goto fail;
+    }
+
+    jack_ringbuffer_mlock (m_ring);
+
+    sem_init (& s_wake, 0, 0);
+
     m_paused = false;
     m_prebuffer = true;
-
+    m_waiting = false;
+    m_flush_request = m_flush_done = 0;
+    m_written = m_flush_point = m_read = 0;
     m_last_write_frames = 0;
-    m_last_write_time = timeval ();
-    m_rate_mismatch = false;
 
     jack_set_process_callback (m_client, generate_cb, this);
+    jack_set_sample_rate_callback (m_client, rate_cb, this);
+    jack_set_buffer_size_callback (m_client, period_cb, this);
 
     if (jack_activate (m_client) != 0)
     {
@@ -247,156 +308,232 @@ void JACKOutput::close_audio ()
     if (m_client)
         jack_client_close (m_client);
 
-    m_buffer.destroy ();
+    if (m_ring)
+    {
+        jack_ringbuffer_free (m_ring);
+        sem_destroy (& s_wake);
+    }
+
+    s_resampler.destroy ();
+    s_converted.clear ();
 
     std::fill (m_ports, std::end (m_ports), nullptr);
     m_client = nullptr;
+    m_ring = nullptr;
 }
 
+/* realtime thread */
 void JACKOutput::generate (jack_nframes_t frames)
 {
-    pthread_mutex_lock (& m_mutex);
-
-    m_last_write_frames = 0;
-    gettimeofday (& m_last_write_time, nullptr);
-
     float * out[AUD_MAX_CHANNELS];
     for (int i = 0; i < m_channels; i ++)
         out[i] = (float *) jack_port_get_buffer (m_ports[i], frames);
 
-    int jack_rate = jack_get_sample_rate (m_client);
+    int written = 0;
 
-    if (jack_rate != m_rate)
+    /* drop only what was written before the flush; if flush() gave up
+     * waiting for us, audio written since then must be kept */
+    int flush_request = __atomic_load_n (& m_flush_request, __ATOMIC_ACQUIRE);
+    if (flush_request != m_flush_done)
     {
-        if (! m_rate_mismatch)
+        size_t flushed = __atomic_load_n (& m_flush_point, __ATOMIC_ACQUIRE) - m_read;
+        if (flushed <= jack_ringbuffer_read_space (m_ring))
         {
-            aud_ui_show_error (str_printf (_("The JACK server requires a "
-             "sample rate of %d Hz, but Audacious is playing at %d Hz.  Please "
-             "use the Sample Rate Converter effect to correct the mismatch."),
-             jack_rate, m_rate));
-            m_rate_mismatch = true;
+            jack_ringbuffer_read_advance (m_ring, flushed);
+            m_read += flushed;
         }
 
-        goto silence;
+        __atomic_store_n (& m_flush_done, flush_request, __ATOMIC_RELEASE);
     }
 
-    m_rate_mismatch = false;
-
-    if (m_paused || m_prebuffer)
+    if (__atomic_load_n (& m_paused, __ATOMIC_ACQUIRE) ||
+     __atomic_load_n (& m_prebuffer, __ATOMIC_ACQUIRE))
         goto silence;
 
-    while (frames && m_buffer.len ())
+    while (frames)
     {
-        int linear_samples = m_buffer.linear ();
-        assert (linear_samples % m_channels == 0);
+        jack_ringbuffer_data_t vec[2];
+        jack_ringbuffer_get_read_vector (m_ring, vec);
 
-        int frames_to_copy = aud::min (frames, (jack_nframes_t) linear_samples / m_channels);
+        float frame[AUD_MAX_CHANNELS];
+        float * data = (float *) vec[0].buf;
+        int count = aud::min (frames, (jack_nframes_t) (vec[0].len / m_frame_size));
 
-        audio_amplify (& m_buffer[0], m_channels, frames_to_copy, get_volume ());
-        audio_deinterlace (& m_buffer[0], FMT_FLOAT, m_channels,
-         (void * const *) out, frames_to_copy);
+        if (! count)
+        {
+            /* a frame may be split where the buffer wraps around */
+            if (jack_ringbuffer_read_space (m_ring) < (size_t) m_frame_size)
+                break;
+
+            jack_ringbuffer_read (m_ring, (char *) frame, m_frame_size);
+            m_read += m_frame_size;
+            data = frame;
+            count = 1;
+        }
 
-        m_last_write_frames += frames_to_copy;
-        m_buffer.discard (frames_to_copy * m_channels);
+        audio_amplify (data, m_channels, count, get_volume ());
+        audio_deinterlace (data, FMT_FLOAT, m_channels, (void * const *) out, count);
+
+        if (data != frame)
+        {
+            jack_ringbuffer_read_advance (m_ring, count * m_frame_size);
+            m_read += count * m_frame_size;
+        }
 
         for (int i = 0; i < m_channels; i ++)
-            out[i] += frames_to_copy;
+            out[i] += count;
 
-        frames -= frames_to_copy;
+        written += count;
+        frames -= count;
     }
 
 silence:
     for (int i = 0; i < m_channels; i ++)
         std::fill (out[i], out[i] + frames, 0.0);
 
-    pthread_cond_broadcast (& m_cond);
-    pthread_mutex_unlock (& m_mutex);
+    __atomic_store_n (& m_last_write_frames, written, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n (& m_waiting, __ATOMIC_ACQUIRE))
+        sem_post (& s_wake);
 }
 
-void JACKOutput::period_wait ()
+/* Waits for the next process cycle, but not too long in case the server has
+ * stopped calling us. */
+void JACKOutput::wait_for_cycle ()
+{
+    int period_ms = aud::rescale (__atomic_load_n (& m_period, __ATOMIC_ACQUIRE),
+     __atomic_load_n (& m_jack_rate, __ATOMIC_ACQUIRE), 1000);
+
+    timespec timeout;
+    clock_gettime (CLOCK_REALTIME, & timeout);
+
+    int64_t ns = timeout.tv_nsec + (int64_t) aud::clamp (2 * period_ms, 5, 100) * 1000000;
+    timeout.tv_sec += ns / 1000000000;
+    timeout.tv_nsec = ns % 1000000000;
+
+    __atomic_store_n (& m_waiting, true, __ATOMIC_SEQ_CST);
+    while (sem_timedwait (& s_wake, & timeout) < 0 && errno == EINTR)
+        ;
+    __atomic_store_n (& m_waiting, false, __ATOMIC_SEQ_CST);
+}
+
+/* room in the ring buffer, in frames at the JACK server rate */
+int JACKOutput::space_frames ()
 {
-    pthread_mutex_lock (& m_mutex);
+    return jack_ringbuffer_write_space (m_ring) / m_frame_size;
+}
 
-    while (! m_buffer.space ())
+void JACKOutput::write_ring (const void * data, int bytes)
+{
+    size_t done = jack_ringbuffer_write (m_ring, (const char *) data, bytes);
+    __atomic_store_n (& m_written, m_written + done, __ATOMIC_RELEASE);
+}
+
+void JACKOutput::period_wait ()
+{
+    /* leave room for what the resampler may produce beyond the exact ratio */
+    while (space_frames () <= POLYPHASE_TAPS)
     {
-        m_prebuffer = false;
-        pthread_cond_wait (& m_cond, & m_mutex);
+        __atomic_store_n (& m_prebuffer, false, __ATOMIC_RELEASE);
+        wait_for_cycle ();
     }
-
-    pthread_mutex_unlock (& m_mutex);
 }
 
 int JACKOutput::write_audio (const void * data, int size)
 {
-    pthread_mutex_lock (& m_mutex);
-
     int samples = size / sizeof (float);
     assert (samples % m_channels == 0);
 
-    samples = aud::min (samples, m_buffer.space ());
+    int jack_rate = __atomic_load_n (& m_jack_rate, __ATOMIC_ACQUIRE);
+    if (jack_rate != s_resampler.out_rate ())
+    {
+        AUDINFO ("JACK server rate changed to %d Hz.\n", jack_rate);
+        s_resampler.init (m_channels, m_rate, jack_rate);
+    }
 
-    m_buffer.copy_in ((const float *) data, samples);
+    int frames = samples / m_channels;
+    int space = space_frames ();
 
-    if (m_buffer.len () >= m_buffer.size () / 4)
-        m_prebuffer = false;
+    if (s_resampler.active ())
+        frames = aud::min (frames, (int) ((int64_t) (space - POLYPHASE_TAPS) * m_rate / jack_rate));
+    else
+        frames = aud::min (frames, space);
+
+    if (frames <= 0)
+        return 0;
+
+    samples = frames * m_channels;
+
+    if (s_resampler.active ())
+    {
+        s_converted.resize (0);
+        s_resampler.process ((const float *) data, samples, s_converted);
+        write_ring (s_converted.begin (), sizeof (float) * s_converted.len ());
+    }
+    else
+        write_ring (data, sizeof (float) * samples);
+
+    if (jack_ringbuffer_read_space (m_ring) >= (size_t) m_buffer_size / 4)
+        __atomic_store_n (& m_prebuffer, false, __ATOMIC_RELEASE);
 
-    pthread_mutex_unlock (& m_mutex);
     return samples * sizeof (float);
 }
 
 void JACKOutput::drain ()
 {
-    pthread_mutex_lock (& m_mutex);
+    if (s_resampler.active ())
+    {
+        s_converted.resize (0);
+        s_resampler.drain (s_converted);
 
-    m_prebuffer = false;
+        int len = aud::min ((int) s_converted.len (), space_frames () * m_channels);
+        write_ring (s_converted.begin (), sizeof (float) * len);
+    }
 
-    while (m_buffer.len () || m_last_write_frames)
-        pthread_cond_wait (& m_cond, & m_mutex);
+    __atomic_store_n (& m_prebuffer, false, __ATOMIC_RELEASE);
 
-    pthread_mutex_unlock (& m_mutex);
+    while (jack_ringbuffer_read_space (m_ring) >= (size_t) m_frame_size ||
+     __atomic_load_n (& m_last_write_frames, __ATOMIC_ACQUIRE))
+        wait_for_cycle ();
 }
 
 int JACKOutput::get_delay ()
 {
-    auto timediff = [] (const timeval & a, const timeval & b) -> int64_t
-        { return 1000 * (int64_t) (b.tv_sec - a.tv_sec) + (b.tv_usec - a.tv_usec) / 1000; };
-
-    pthread_mutex_lock (& m_mutex);
+    int jack_rate = __atomic_load_n (& m_jack_rate, __ATOMIC_ACQUIRE);
+    int buffered = jack_ringbuffer_read_space (m_ring) / m_frame_size;
 
-    int delay = aud::rescale (m_buffer.len (), m_channels * m_rate, 1000);
+    /* frames handed to JACK in the last cycle and not yet played */
+    int last = __atomic_load_n (& m_last_write_frames, __ATOMIC_ACQUIRE);
+    buffered += aud::max (last - (int) jack_frames_since_cycle_start (m_client), 0);
 
-    if (m_last_write_frames)
-    {
-        timeval now;
-        gettimeofday (& now, nullptr);
-
-        int written = aud::rescale (m_last_write_frames, m_rate, 1000);
-        delay += aud::max (written - timediff (m_last_write_time, now), (int64_t) 0);
-    }
-
-    pthread_mutex_unlock (& m_mutex);
-    return delay;
+    return aud::rescale (buffered, jack_rate, 1000) +
+     aud::rescale (s_resampler.delay (), m_rate, 1000);
 }
 
 void JACKOutput::pause (bool pause)
 {
-    pthread_mutex_lock (& m_mutex);
-    m_paused = pause;
-    pthread_cond_broadcast (& m_cond);
-    pthread_mutex_unlock (& m_mutex);
+    __atomic_store_n (& m_paused, pause, __ATOMIC_RELEASE);
 }
 
 void JACKOutput::flush ()
 {
-    pthread_mutex_lock (& m_mutex);
-
-    m_buffer.discard ();
+    /* only the process callback may discard data from the ring buffer; it
+     * drops everything up to the current write position, even if we stop
+     * waiting for it */
+    int request = m_flush_request + 1;
+    __atomic_store_n (& m_flush_point, m_written, __ATOMIC_RELEASE);
+    __atomic_store_n (& m_flush_request, request, __ATOMIC_RELEASE);
+
+    for (int tries = 0; tries < 10; tries ++)
+    {
+        if (__atomic_load_n (& m_flush_done, __ATOMIC_ACQUIRE) == request)
+            break;
 
-    m_prebuffer = true;
+        wait_for_cycle ();
+    }
 
-    m_last_write_frames = 0;
-    m_last_write_time = timeval ();
+    s_resampler.reset ();
 
-    pthread_cond_broadcast (& m_cond);
-    pthread_mutex_unlock (& m_mutex);
+    __atomic_store_n (& m_prebuffer, true, __ATOMIC_RELEASE);
+    __atomic_store_n (& m_last_write_frames, 0, __ATOMIC_RELEASE);
 }
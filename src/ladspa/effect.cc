@@ -19,6 +19,9 @@
 
 #include <assert.h>
 
+#include <utility>
+#include <glib.h>
+
 #include "ladspa.h"
 #include "plugin.h"
 
@@ -26,6 +29,53 @@
 
 static int ladspa_channels, ladspa_rate;
 
+/* The audio thread never takes the mutex.  Instead, it runs a snapshot of the
+ * loaded plugin list, which the main thread replaces whenever the list
+ * changes.  The audio thread raises <reading> while it uses the snapshot; once
+ * a new snapshot has been published, a reader that starts afterward is
+ * guaranteed to see it, so the main thread only has to wait for the current
+ * block (if any) to finish before freeing the old one or shutting down
+ * plugins that are no longer in it. */
+
+static Index<LoadedPlugin *> * chain;
+static int reading;
+
+/* Planar buffers, LADSPA_BUFLEN frames per channel.  Each plugin reads from
+ * one and writes to the other, so the audio is deinterleaved only once on the
+ * way into the chain and interleaved once on the way out. */
+static Index<float> planar[2];
+
+void update_chain_locked ()
+{
+    Index<LoadedPlugin *> * next = nullptr;
+
+    if (loadeds.len ())
+    {
+        next = new Index<LoadedPlugin *>;
+
+        for (auto & loaded : loadeds)
+            next->append (loaded.get ());
+    }
+
+    auto prev = __atomic_exchange_n (& chain, next, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n (& reading, __ATOMIC_SEQ_CST))
+        g_usleep (1000);
+
+    delete prev;
+}
+
+static Index<LoadedPlugin *> * begin_read ()
+{
+    __atomic_store_n (& reading, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n (& chain, __ATOMIC_SEQ_CST);
+}
+
+static void end_read ()
+{
+    __atomic_store_n (& reading, 0, __ATOMIC_SEQ_CST);
+}
+
 static void start_plugin (LoadedPlugin & loaded)
 {
     if (loaded.active)
@@ -53,9 +103,6 @@ static void start_plugin (LoadedPlugin & loaded)
 
     int instances = ladspa_channels / ports;
 
-    loaded.in_bufs.insert (0, ladspa_channels);
-    loaded.out_bufs.insert (0, ladspa_channels);
-
     for (int i = 0; i < instances; i ++)
     {
         LADSPA_Handle handle = desc.instantiate (& desc, ladspa_rate);
@@ -65,28 +112,17 @@ static void start_plugin (LoadedPlugin & loaded)
         for (int c = 0; c < controls; c ++)
             desc.connect_port (handle, plugin.controls[c].port, & loaded.values[c]);
 
-        for (int p = 0; p < ports; p ++)
-        {
-            int channel = ports * i + p;
-
-            Index<float> & in = loaded.in_bufs[channel];
-            in.insert (0, LADSPA_BUFLEN);
-            desc.connect_port (handle, plugin.in_ports[p], in.begin ());
-
-            Index<float> & out = loaded.out_bufs[channel];
-            out.insert (0, LADSPA_BUFLEN);
-            desc.connect_port (handle, plugin.out_ports[p], out.begin ());
-        }
-
         if (desc.activate)
             desc.activate (handle);
     }
 }
 
-static void run_plugin (LoadedPlugin & loaded, float * data, int samples)
+/* Runs <frames> frames of planar audio from <in> to <out>.  Returns false if
+ * the plugin is not usable, in which case <out> is left untouched. */
+static bool run_plugin (LoadedPlugin & loaded, float * in, float * out, int frames)
 {
     if (! loaded.instances.len ())
-        return;
+        return false;
 
     PluginData & plugin = loaded.plugin;
     const LADSPA_Descriptor & desc = plugin.desc;
@@ -95,43 +131,65 @@ static void run_plugin (LoadedPlugin & loaded, float * data, int samples)
     int instances = loaded.instances.len ();
     assert (ports * instances == ladspa_channels);
 
+    for (int i = 0; i < instances; i ++)
+    {
+        LADSPA_Handle handle = loaded.instances[i];
+
+        for (int p = 0; p < ports; p ++)
+        {
+            int channel = ports * i + p;
+            desc.connect_port (handle, plugin.in_ports[p], in + LADSPA_BUFLEN * channel);
+            desc.connect_port (handle, plugin.out_ports[p], out + LADSPA_BUFLEN * channel);
+        }
+
+        desc.run (handle, frames);
+    }
+
+    return true;
+}
+
+static void run_chain (Index<LoadedPlugin *> & plugins, float * data, int samples)
+{
+    if (! plugins.len ())
+        return;
+
+    for (auto & buf : planar)
+    {
+        if (buf.len () < ladspa_channels * LADSPA_BUFLEN)
+            buf.insert (-1, ladspa_channels * LADSPA_BUFLEN - buf.len ());
+    }
+
+    for (LoadedPlugin * loaded : plugins)
+        start_plugin (* loaded);
+
     while (samples / ladspa_channels > 0)
     {
         int frames = aud::min (samples / ladspa_channels, LADSPA_BUFLEN);
+        float * in = planar[0].begin ();
+        float * out = planar[1].begin ();
 
-        for (int i = 0; i < instances; i ++)
+        for (int c = 0; c < ladspa_channels; c ++)
         {
-            LADSPA_Handle handle = loaded.instances[i];
-
-            for (int p = 0; p < ports; p ++)
-            {
-                int channel = ports * i + p;
-                float * get = data + channel;
-                float * in = loaded.in_bufs[channel].begin ();
-                float * in_end = in + frames;
-
-                while (in < in_end)
-                {
-                    * in ++ = * get;
-                    get += ladspa_channels;
-                }
-            }
-
-            desc.run (handle, frames);
-
-            for (int p = 0; p < ports; p ++)
-            {
-                int channel = ports * i + p;
-                float * set = data + channel;
-                float * out = loaded.out_bufs[channel].begin ();
-                float * out_end = out + frames;
-
-                while (out < out_end)
-                {
-                    * set = * out ++;
-                    set += ladspa_channels;
-                }
-            }
+            const float * get = data + c;
+            float * set = in + LADSPA_BUFLEN * c;
+
+            for (int f = 0; f < frames; f ++, get += ladspa_channels)
+                set[f] = * get;
+        }
+
+        for (LoadedPlugin * loaded : plugins)
+        {
+            if (run_plugin (* loaded, in, out, frames))
+                std::swap (in, out);
+        }
+
+        for (int c = 0; c < ladspa_channels; c ++)
+        {
+            const float * get = in + LADSPA_BUFLEN * c;
+            float * set = data + c;
+
+            for (int f = 0; f < frames; f ++, set += ladspa_channels)
+                * set = get[f];
         }
 
         data += ladspa_channels * frames;
@@ -181,61 +239,64 @@ void shutdown_plugin_locked (LoadedPlugin & loaded)
     }
 
     loaded.instances.clear ();
-    loaded.in_bufs.clear ();
-    loaded.out_bufs.clear ();
 }
 
 void LADSPAHost::start (int & channels, int & rate)
 {
-    pthread_mutex_lock (& mutex);
+    auto plugins = begin_read ();
 
-    for (auto & loaded : loadeds)
-        shutdown_plugin_locked (* loaded);
+    if (plugins)
+    {
+        for (LoadedPlugin * loaded : * plugins)
+            shutdown_plugin_locked (* loaded);
+    }
 
     ladspa_channels = channels;
     ladspa_rate = rate;
 
-    pthread_mutex_unlock (& mutex);
+    end_read ();
 }
 
 Index<float> & LADSPAHost::process (Index<float> & data)
 {
-    pthread_mutex_lock (& mutex);
+    auto plugins = begin_read ();
 
-    for (auto & loaded : loadeds)
-    {
-        start_plugin (* loaded);
-        run_plugin (* loaded, data.begin (), data.len ());
-    }
+    if (plugins)
+        run_chain (* plugins, data.begin (), data.len ());
 
-    pthread_mutex_unlock (& mutex);
+    end_read ();
     return data;
 }
 
 bool LADSPAHost::flush (bool force)
 {
-    pthread_mutex_lock (& mutex);
+    auto plugins = begin_read ();
 
-    for (auto & loaded : loadeds)
-        flush_plugin (* loaded);
+    if (plugins)
+    {
+        for (LoadedPlugin * loaded : * plugins)
+            flush_plugin (* loaded);
+    }
 
-    pthread_mutex_unlock (& mutex);
+    end_read ();
     return true;
 }
 
 Index<float> & LADSPAHost::finish (Index<float> & data, bool end_of_playlist)
 {
-    pthread_mutex_lock (& mutex);
+    auto plugins = begin_read ();
 
-    for (auto & loaded : loadeds)
+    if (plugins)
     {
-        start_plugin (* loaded);
-        run_plugin (* loaded, data.begin (), data.len ());
+        run_chain (* plugins, data.begin (), data.len ());
 
         if (end_of_playlist)
-            shutdown_plugin_locked (* loaded);
+        {
+            for (LoadedPlugin * loaded : * plugins)
+                shutdown_plugin_locked (* loaded);
+        }
     }
 
-    pthread_mutex_unlock (& mutex);
+    end_read ();
     return data;
 }
@@ -93,6 +93,7 @@ static void shift_rows (void * user, int row, int before)
         move.move_from (others, 0, 0, -1, true, true);
 
     loadeds.move_from (move, 0, begin, end - begin, false, true);
+    update_chain_locked ();
 
     pthread_mutex_unlock (& mutex);
 
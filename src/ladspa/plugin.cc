@@ -249,11 +249,14 @@ static void save_enabled_to_config ()
 
         aud_set_str ("ladspa", str_printf ("plugin%d_controls", i),
          double_array_to_str (temp.begin (), temp.len ()));
-
-        disable_plugin_locked (loaded);
     }
 
-    loadeds.clear ();
+    /* take the plugins out of the chain before shutting them down */
+    Index<SmartPtr<LoadedPlugin>> removed = std::move (loadeds);
+    update_chain_locked ();
+
+    for (auto & loaded : removed)
+        disable_plugin_locked (* loaded);
 
     for (int i = count; i < old_count; i ++)
     {
@@ -308,6 +311,7 @@ bool LADSPAHost::init ()
 
     open_modules ();
     load_enabled_from_config ();
+    update_chain_locked ();
 
     pthread_mutex_unlock (& mutex);
     return true;
@@ -341,6 +345,7 @@ static void set_module_path (GtkEntry * entry)
 
     open_modules ();
     load_enabled_from_config ();
+    update_chain_locked ();
 
     pthread_mutex_unlock (& mutex);
 
@@ -360,6 +365,8 @@ static void enable_selected ()
             enable_plugin_locked (* plugin);
     }
 
+    update_chain_locked ();
+
     pthread_mutex_unlock (& mutex);
 
     if (loaded_list)
@@ -370,35 +377,44 @@ static void disable_selected ()
 {
     pthread_mutex_lock (& mutex);
 
-    for (int i = 0; i < loadeds.len (); i ++)
+    Index<SmartPtr<LoadedPlugin>> removed;
+
+    for (int i = 0; i < loadeds.len ();)
     {
         if (loadeds[i]->selected)
         {
-            disable_plugin_locked (* loadeds[i]);
+            removed.append (std::move (loadeds[i]));
             loadeds.remove (i, 1);
         }
         else
             i ++;
     }
 
+    /* take the plugins out of the chain before shutting them down */
+    update_chain_locked ();
+
+    for (auto & loaded : removed)
+        disable_plugin_locked (* loaded);
+
     pthread_mutex_unlock (& mutex);
 
     if (loaded_list)
         update_loaded_list (loaded_list);
 }
 
+/* Control values are read by the plugins in the audio thread; a single float
+ * store is all that is needed to change one. */
+
 static void control_toggled (GtkToggleButton * toggle, float * value)
 {
-    pthread_mutex_lock (& mutex);
-    * value = gtk_toggle_button_get_active (toggle) ? 1 : 0;
-    pthread_mutex_unlock (& mutex);
+    float set = gtk_toggle_button_get_active (toggle) ? 1 : 0;
+    __atomic_store (value, & set, __ATOMIC_RELAXED);
 }
 
 static void control_changed (GtkSpinButton * spin, float * value)
 {
-    pthread_mutex_lock (& mutex);
-    * value = gtk_spin_button_get_value (spin);
-    pthread_mutex_unlock (& mutex);
+    float set = gtk_spin_button_get_value (spin);
+    __atomic_store (value, & set, __ATOMIC_RELAXED);
 }
 
 static void configure_plugin (LoadedPlugin & loaded)
@@ -59,7 +59,6 @@ struct LoadedPlugin
     bool selected = false;
     bool active = false;
     Index<LADSPA_Handle> instances;
-    Index<Index<float>> in_bufs, out_bufs;
     GtkWidget * settings_win = nullptr;
 
     LoadedPlugin (PluginData & plugin) :
@@ -95,8 +94,9 @@ public:
 /* plugin.c */
 
 /* The mutex needs to be locked when the main thread is writing to the data
- * structures below (but not when it is only reading from them) and when the
- * audio thread is reading from them. */
+ * structures below (but not when it is only reading from them).  The audio
+ * thread does not use them directly; it runs a snapshot of <loadeds>, which
+ * must be refreshed with update_chain_locked() after every change. */
 
 extern pthread_mutex_t mutex;
 extern String module_path;
@@ -112,6 +112,7 @@ void disable_plugin_locked (LoadedPlugin & loaded);
 
 /* effect.c */
 
+void update_chain_locked ();
 void shutdown_plugin_locked (LoadedPlugin & loaded);
 
 /* plugin-list.c */
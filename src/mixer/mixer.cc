@@ -17,8 +17,6 @@
  * the use of this software.
  */
 
-/* TODO: implement more surround converters */
-
 #include <stdlib.h>
 
 #include <libaudcore/i18n.h>
@@ -26,6 +24,8 @@
 #include <libaudcore/plugin.h>
 #include <libaudcore/preferences.h>
 
+#include "channel-matrix.h"
+
 class ChannelMixer : public EffectPlugin
 {
 public:
@@ -53,119 +53,42 @@ public:
 
 EXPORT ChannelMixer aud_plugin_instance;
 
-typedef Index<float> & (* Converter) (Index<float> & data);
-
-static Index<float> mixer_buf;
-
-static Index<float> & mono_to_stereo (Index<float> & data)
-{
-    int frames = data.len ();
-    mixer_buf.resize (2 * frames);
-
-    float * get = data.begin ();
-    float * set = mixer_buf.begin ();
-
-    while (frames --)
-    {
-        float val = * get ++;
-        * set ++ = val;
-        * set ++ = val;
-    }
-
-    return mixer_buf;
-}
+static Index<float> mixer_buf, matrix;
+static int input_channels, output_channels;
 
-static Index<float> & stereo_to_mono (Index<float> & data)
+void ChannelMixer::start (int & channels, int & rate)
 {
-    int frames = data.len () / 2;
-    mixer_buf.resize (frames);
+    input_channels = channels;
+    output_channels = aud::clamp (aud_get_int ("mixer", "channels"), 1, AUD_MAX_CHANNELS);
 
-    float * get = data.begin ();
-    float * set = mixer_buf.begin ();
+    matrix.clear ();
 
-    while (frames --)
+    if (aud_get_bool ("mixer", "custom"))
     {
-        float val = * get ++;
-        val += * get ++;
-        * set ++ = val / 2;
-    }
-
-    return mixer_buf;
-}
+        String str = aud_get_str ("mixer", "matrix");
 
-static Index<float> & quadro_to_stereo (Index<float> & data)
-{
-    int frames = data.len () / 4;
-    mixer_buf.resize (2 * frames);
-
-    float * get = data.begin ();
-    float * set = mixer_buf.begin ();
-
-    while (frames --)
-    {
-        float front_left  = * get ++;
-        float front_right = * get ++;
-        float back_left   = * get ++;
-        float back_right  = * get ++;
-        * set ++ = front_left + (back_left * 0.7);
-        * set ++ = front_right + (back_right * 0.7);
-    }
+        if (channel_matrix_parse (str, input_channels, output_channels, matrix))
+        {
+            channels = output_channels;
+            return;
+        }
 
-    return mixer_buf;
-}
-
-static Index<float> & surround_5p1_to_stereo (Index<float> & data)
-{
-    int frames = data.len () / 6;
-    mixer_buf.resize (2 * frames);
-
-    float * get = data.begin ();
-    float * set = mixer_buf.begin ();
-
-    while (frames --)
-    {
-        float front_left  = * get ++;
-        float front_right = * get ++;
-        float center = * get ++;
-        float lfe    = * get ++;
-        float rear_left   = * get ++;
-        float rear_right  = * get ++;
-        * set ++ = front_left + (center * 0.5) + (lfe * 0.5) + (rear_left * 0.5);
-        * set ++ = front_right + (center * 0.5) + (lfe * 0.5) + (rear_right * 0.5);
+        AUDWARN ("Custom matrix does not describe %d to %d channels.\n",
+         input_channels, output_channels);
+        matrix.clear ();
     }
 
-    return mixer_buf;
-}
-
-static Converter get_converter (int in, int out)
-{
-    if (in == 1 && out == 2)
-        return mono_to_stereo;
-    if (in == 2 && out == 1)
-        return stereo_to_mono;
-    if (in == 4 && out == 2)
-        return quadro_to_stereo;
-    if (in == 6 && out == 2)
-        return surround_5p1_to_stereo;
-
-    return nullptr;
-}
-
-static int input_channels, output_channels;
-
-void ChannelMixer::start (int & channels, int & rate)
-{
-    input_channels = channels;
-    output_channels = aud_get_int ("mixer", "channels");
-
     if (input_channels == output_channels)
         return;
 
-    if (! get_converter (input_channels, output_channels))
+    /* Passing the audio through unconverted would leave later plugins (e.g.
+     * crossfade) with a channel count that changes from song to song, so
+     * fall back to simply mapping the channels across. */
+    if (! channel_matrix_get (input_channels, output_channels, matrix))
     {
-        AUDERR ("Converting %d to %d channels is not implemented.\n",
-         input_channels, output_channels);
-        return;
+        AUDWARN ("No standard conversion from %d to %d channels; "
+         "mapping channels directly.\n", input_channels, output_channels);
+        channel_matrix_get_passthrough (input_channels, output_channels, matrix);
     }
 
     channels = output_channels;
@@ -173,18 +96,22 @@ void ChannelMixer::start (int & channels, int & rate)
 
 Index<float> & ChannelMixer::process (Index<float> & data)
 {
-    if (input_channels == output_channels)
+    if (! matrix.len ())
         return data;
 
-    Converter converter = get_converter (input_channels, output_channels);
-    if (converter)
-        return converter (data);
+    int frames = data.len () / input_channels;
+    mixer_buf.resize (output_channels * frames);
+
+    channel_matrix_apply (matrix.begin (), input_channels, output_channels,
+     data.begin (), mixer_buf.begin (), frames);
 
-    return data;
+    return mixer_buf;
 }
 
 const char * const ChannelMixer::defaults[] = {
  "channels", "2",
+ "custom", "FALSE",
+ "matrix", "",
   nullptr};
 
 bool ChannelMixer::init ()
@@ -196,6 +123,7 @@ bool ChannelMixer::init ()
 void ChannelMixer::cleanup ()
 {
     mixer_buf.clear ();
+    matrix.clear ();
 }
 
 const char ChannelMixer::about[] =
@@ -206,7 +134,14 @@ const PreferencesWidget ChannelMixer::widgets[] = {
     WidgetLabel (N_("<b>Channel Mixer</b>")),
     WidgetSpin (N_("Output channels:"),
         WidgetInt ("mixer", "channels"),
-        {1, AUD_MAX_CHANNELS, 1})
+        {1, AUD_MAX_CHANNELS, 1}),
+    WidgetCheck (N_("Use custom matrix"),
+        WidgetBool ("mixer", "custom")),
+    WidgetEntry (N_("Matrix:"),
+        WidgetString ("mixer", "matrix"),
+        WIDGET_CHILD),
+    WidgetLabel (N_("<small>One row per output channel, separated by "
+     "semicolons,\neach with one coefficient per input channel.</small>"))
 };
 
 const PluginPreferences ChannelMixer::prefs = {{widgets}};
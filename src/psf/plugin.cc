@@ -35,6 +35,7 @@
 #include "ao.h"
 #include "corlett.h"
 #include "eng_protos.h"
+#include "file-view.h"
 
 class PSFPlugin : public InputPlugin
 {
@@ -120,7 +121,7 @@ Tuple PSFPlugin::read_tuple(const char *filename, VFSFile &file)
 	Tuple t;
 	corlett_t *c;
 
-	Index<char> buf = file.read_all ();
+	FileView buf (file);
 
 	if (!buf.len())
 		return t;
@@ -153,7 +154,7 @@ bool PSFPlugin::play(const char *filename, VFSFile &file)
 
 	dirpath = String (str_copy (filename, slash + 1 - filename));
 
-	Index<char> buf = file.read_all ();
+	FileView buf (file);
 
 	PSFEngine eng = psf_probe(buf.begin(), buf.len());
 	if (eng == ENG_NONE || eng == ENG_COUNT)
@@ -27,17 +27,22 @@
 
 #include <libaudcore/runtime.h>
 #include <libaudcore/plugin.h>
+#include <libaudcore/preferences.h>
 #include <libaudcore/i18n.h>
 
 class PulseOutput : public OutputPlugin
 {
 public:
     static const char about[];
+    static const char * const defaults[];
+    static const PreferencesWidget widgets[];
+    static const PluginPreferences prefs;
 
     static constexpr PluginInfo info = {
         N_("PulseAudio Output"),
         PACKAGE,
-        about
+        about,
+        & prefs
     };
 
     constexpr PulseOutput () : OutputPlugin (info, 8) {}
@@ -71,6 +76,13 @@ static bool volume_valid = false;
 
 static bool connected = false;
 
+/* bytes per frame, for keeping writes aligned */
+static size_t frame_size = 0;
+
+/* whether playback has been started explicitly since the stream was opened
+ * or flushed (see period_wait) */
+static bool triggered = false;
+
 #define CHECK_DEAD_GOTO(label, warn) do { \
 if (!mainloop || \
     !context || pa_context_get_state(context) != PA_CONTEXT_READY || \
@@ -174,9 +186,16 @@ static void stream_request_cb(pa_stream *s, size_t length, void *userdata) {
     pa_threaded_mainloop_signal(mainloop, 0);
 }
 
+static int last_latency = 0; /* milliseconds */
+
 static void stream_latency_update_cb(pa_stream *s, void *userdata) {
     assert(s);
 
+    pa_usec_t usec;
+    int neg;
+    if (pa_stream_get_latency (s, & usec, & neg) == PA_OK)
+        last_latency = neg ? 0 : usec / 1000;
+
     pa_threaded_mainloop_signal(mainloop, 0);
 }
 
@@ -277,10 +296,14 @@ int PulseOutput::get_delay ()
 
     pa_threaded_mainloop_lock(mainloop);
 
+    /* interpolated from the last timing update; fall back to the value from
+     * that update if there is nothing to interpolate from yet */
     pa_usec_t usec;
     int neg;
     if (pa_stream_get_latency (stream, & usec, & neg) == PA_OK)
-        delay = usec / 1000;
+        delay = neg ? 0 : usec / 1000;
+    else
+        delay = last_latency;
 
     pa_threaded_mainloop_unlock(mainloop);
 
@@ -340,6 +363,8 @@ void PulseOutput::flush ()
     if (!success)
         AUDDBG("pa_stream_flush() failed: %s\n", pa_strerror(pa_context_errno(context)));
 
+    triggered = false;
+
 fail:
     if (o)
         pa_operation_unref(o);
@@ -357,20 +382,29 @@ void PulseOutput::period_wait ()
     pa_threaded_mainloop_lock (mainloop);
     CHECK_DEAD_GOTO (fail, 1);
 
-    if (! (o = pa_stream_trigger (stream, stream_success_cb, & success)))
+    /* The buffer is full, so make sure playback has started even if the
+     * server's prebuffering threshold has not been reached.  This takes a
+     * round trip to the server, so it is done only once; after that, we
+     * simply sleep until the write callback says there is room. */
+    if (! triggered)
     {
-        AUDDBG ("pa_stream_trigger() failed: %s\n", pa_strerror (pa_context_errno (context)));
-        goto fail;
-    }
+        if (! (o = pa_stream_trigger (stream, stream_success_cb, & success)))
+        {
+            AUDDBG ("pa_stream_trigger() failed: %s\n", pa_strerror (pa_context_errno (context)));
+            goto fail;
+        }
 
-    while (pa_operation_get_state (o) != PA_OPERATION_DONE)
-    {
-        CHECK_DEAD_GOTO (fail, 1);
-        pa_threaded_mainloop_wait (mainloop);
-    }
+        while (pa_operation_get_state (o) != PA_OPERATION_DONE)
+        {
+            CHECK_DEAD_GOTO (fail, 1);
+            pa_threaded_mainloop_wait (mainloop);
+        }
 
-    if (! success)
-        AUDDBG ("pa_stream_trigger() failed: %s\n", pa_strerror (pa_context_errno (context)));
+        if (! success)
+            AUDDBG ("pa_stream_trigger() failed: %s\n", pa_strerror (pa_context_errno (context)));
+
+        triggered = true;
+    }
 
     while (! pa_stream_writable_size (stream))
     {
@@ -393,15 +427,43 @@ int PulseOutput::write_audio (const void * ptr, int length)
     pa_threaded_mainloop_lock(mainloop);
     CHECK_DEAD_GOTO(fail, 1);
 
-    length = aud::min ((size_t) length, pa_stream_writable_size (stream));
+    void * buf;
+    size_t size;
+
+    /* write straight into memory provided by the server, saving the copy
+     * pa_stream_write() would otherwise make */
+    size = aud::min ((size_t) length, pa_stream_writable_size (stream));
+    size -= size % frame_size;
+
+    /* the server buffer is full; pa_stream_begin_write() would reject a
+     * zero-size request */
+    if (! size)
+        goto fail;
+
+    if (pa_stream_begin_write (stream, & buf, & size) < 0)
+    {
+        AUDDBG ("pa_stream_begin_write() failed: %s\n", pa_strerror (pa_context_errno (context)));
+        goto fail;
+    }
+
+    size = aud::min (size, (size_t) length);
+    size -= size % frame_size;
 
-    if (pa_stream_write (stream, ptr, length, nullptr, 0, PA_SEEK_RELATIVE) < 0)
+    if (! size)
+    {
+        pa_stream_cancel_write (stream);
+        goto fail;
+    }
+
+    memcpy (buf, ptr, size);
+
+    if (pa_stream_write (stream, buf, size, nullptr, 0, PA_SEEK_RELATIVE) < 0)
     {
         AUDDBG ("pa_stream_write() failed: %s\n", pa_strerror (pa_context_errno (context)));
         goto fail;
     }
 
-    ret = length;
+    ret = size;
 
 fail:
     pa_threaded_mainloop_unlock(mainloop);
@@ -433,6 +495,7 @@ void PulseOutput::close_audio ()
     }
 
     volume_valid = false;
+    last_latency = 0;
 }
 
 static pa_sample_format_t to_pulse_format (int aformat)
@@ -523,16 +586,38 @@ FAIL1:
     /* Connect stream with sink and default volume */
     /* Buffer struct */
 
-    int aud_buffer = aud_get_int(nullptr, "output_buffer_size");
-    size_t buffer_size = pa_usec_to_bytes(aud_buffer, &ss) * 1000;
-    pa_buffer_attr buffer = {(uint32_t) -1, (uint32_t) buffer_size,
-     (uint32_t) -1, (uint32_t) -1, (uint32_t) buffer_size};
+    pa_buffer_attr buffer;
+    int flags = PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+
+    if (aud_get_bool ("pulse", "low_latency"))
+    {
+        /* Size the server-side buffer for the target latency (including the
+         * sink's own latency, via PA_STREAM_ADJUST_LATENCY), ask for data in
+         * quarters of that, and start playback as soon as one quarter has
+         * arrived. */
+        int latency = aud::clamp (aud_get_int ("pulse", "latency"), 5, 1000);
+        uint32_t target = pa_usec_to_bytes ((pa_usec_t) latency * 1000, & ss);
+        uint32_t quarter = aud::max ((uint32_t) pa_frame_size (& ss), target / 4);
+
+        buffer = {(uint32_t) -1, target, quarter, quarter, (uint32_t) -1};
+        flags |= PA_STREAM_ADJUST_LATENCY;
+    }
+    else
+    {
+        int aud_buffer = aud_get_int(nullptr, "output_buffer_size");
+        size_t buffer_size = pa_usec_to_bytes(aud_buffer, &ss) * 1000;
+        buffer = {(uint32_t) -1, (uint32_t) buffer_size,
+         (uint32_t) -1, (uint32_t) -1, (uint32_t) buffer_size};
+    }
+
+    frame_size = pa_frame_size (& ss);
+    triggered = false;
 
     pa_operation *o = nullptr;
     int success;
 
-    if (pa_stream_connect_playback (stream, nullptr, & buffer, (pa_stream_flags_t)
-     (PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE), nullptr, nullptr) < 0)
+    if (pa_stream_connect_playback (stream, nullptr, & buffer,
+     (pa_stream_flags_t) flags, nullptr, nullptr) < 0)
     {
         AUDERR ("Failed to connect stream: %s\n", pa_strerror(pa_context_errno(context)));
         goto FAIL2;
@@ -547,6 +632,11 @@ FAIL1:
         goto FAIL2;
     }
 
+    if (const pa_buffer_attr * attr = pa_stream_get_buffer_attr (stream))
+        AUDINFO ("Server buffer: %d ms, requests of %d ms.\n",
+         (int) (pa_bytes_to_usec (attr->tlength, & ss) / 1000),
+         (int) (pa_bytes_to_usec (attr->minreq, & ss) / 1000));
+
     /* Now subscribe to events */
     if (!(o = pa_context_subscribe(context, PA_SUBSCRIPTION_MASK_SINK_INPUT, context_success_cb, &success))) {
         AUDERR ("pa_context_subscribe() failed: %s\n", pa_strerror(pa_context_errno(context)));
@@ -598,8 +688,27 @@ FAIL2:
     return false;
 }
 
+const char * const PulseOutput::defaults[] = {
+    "low_latency", "FALSE",
+    "latency", "25",
+    nullptr
+};
+
+const PreferencesWidget PulseOutput::widgets[] = {
+    WidgetCheck (N_("Low latency mode"),
+        WidgetBool ("pulse", "low_latency")),
+    WidgetSpin (N_("Target latency:"),
+        WidgetInt ("pulse", "latency"),
+        {5, 1000, 5, N_("ms")},
+        WIDGET_CHILD)
+};
+
+const PluginPreferences PulseOutput::prefs = {{widgets}};
+
 bool PulseOutput::init ()
 {
+    aud_config_set_defaults ("pulse", defaults);
+
     if (! open_audio (FMT_S16_NE, 44100, 2))
         return false;
 
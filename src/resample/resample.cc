@@ -17,6 +17,12 @@
  * the use of this software.
  */
 
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
 #include <samplerate.h>
 
 #include <libaudcore/i18n.h>
@@ -31,6 +37,16 @@
 
 #define RESAMPLE_ERROR(e) AUDERR ("%s\n", src_strerror (e))
 
+/* "method" value for picking a libsamplerate converter automatically */
+#define METHOD_AUTO -1
+
+/* integer upsampling ratios handled by the dedicated kernel */
+#define MAX_INT_FACTOR 8
+#define INT_TAPS 32
+
+/* bump this whenever the calibration procedure changes */
+#define CALIBRATION_VERSION 2
+
 class Resampler : public EffectPlugin
 {
 public:
@@ -54,6 +70,9 @@ public:
 
     void start (int & channels, int & rate);
     bool flush (bool force);
+    int adjust_delay (int delay);
+
+    static void recalibrate ();
 
     Index<float> & process (Index<float> & data)
         { return resample (data, false); }
@@ -68,6 +87,8 @@ EXPORT Resampler aud_plugin_instance;
 
 const char * const Resampler::defaults[] = {
  "method", aud::numeric_string<SRC_SINC_FASTEST>::str,
+ "cpu-budget", "10",
+ "calibration", "",
  "default-rate", "44100",
  "use-mappings", "FALSE",
  "8000", "48000",
@@ -83,13 +104,28 @@ const char * const Resampler::defaults[] = {
  nullptr};
 
 static SRC_STATE * state;
-static int stored_channels;
+static int int_factor; /* nonzero when the integer kernel is in use */
+static Index<float> int_coefs; /* int_factor * INT_TAPS */
+static Index<float> int_hist;  /* interleaved input not yet fully consumed */
+static int stored_channels, stored_rate;
 static double ratio;
+
+/* The output buffer is never shrunk between blocks, only cleared on cleanup,
+ * so once it has grown to fit the largest block no further allocation
+ * happens in the audio path. */
 static Index<float> buffer;
 
+/* frames fed into and received from the converter since the last reset, used
+ * to work out how much audio is held in its filter */
+static int64_t frames_in, frames_out;
+
+static void start_calibration ();
+static void stop_calibration ();
+
 bool Resampler::init ()
 {
     aud_config_set_defaults ("resample", defaults);
+    start_calibration ();
     return true;
 }
 
@@ -101,7 +137,365 @@ void Resampler::cleanup ()
         state = nullptr;
     }
 
+    int_factor = 0;
     buffer.clear ();
+    int_coefs.clear ();
+    int_hist.clear ();
+
+    stop_calibration ();
+}
+
+/* Makes room for at least <frames> more output frames at the end of the
+ * buffer and returns a pointer to the first of them.  The buffer is resized
+ * back down to the frames actually produced by the caller. */
+static float * reserve_output (int frames)
+{
+    int pos = buffer.len ();
+    buffer.insert (-1, stored_channels * frames);
+    return & buffer[pos];
+}
+
+/* libsamplerate converters, best quality first */
+static const int methods_by_quality[] = {
+    SRC_SINC_BEST_QUALITY,
+    SRC_SINC_MEDIUM_QUALITY,
+    SRC_SINC_FASTEST,
+    SRC_LINEAR,
+    SRC_ZERO_ORDER_HOLD
+};
+
+#define N_METHODS aud::n_elems (methods_by_quality)
+
+/* Cost of each converter on this machine, in nanoseconds per output frame
+ * and channel at a 44.1 -> 48 kHz ratio.  Measured once and kept in the
+ * config (as whole picoseconds, so that the string does not depend on the
+ * locale), since it only changes if the hardware does.  The measurement is
+ * made in a background thread when the plugin is first loaded, or when the
+ * user asks for it; until it is done, rough figures for a modest desktop
+ * processor are used.  The table is guarded by cost_mutex, since it is
+ * written from the main thread or the calibration thread and read from the
+ * playback thread.  calibrate_done is set, under the same lock, when the
+ * calibration thread has finished. */
+static const double default_cost[N_METHODS] = {100, 30, 10, 2, 1};
+static double method_cost[N_METHODS];
+static pthread_mutex_t cost_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t calibrate_thread;
+static bool calibrate_running, calibrate_done;
+
+static double now_ns ()
+{
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, & ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double measure_method (int method)
+{
+    const int in_frames = 8192;
+    const double test_ratio = 48000.0 / 44100.0;
+
+    Index<float> in, out;
+    in.resize (in_frames);
+    out.resize ((int) (in_frames * test_ratio) + 256);
+
+    for (float & sample : in)
+        sample = (float) rand () / RAND_MAX - 0.5f;
+
+    double best = 0;
+
+    /* take the best of a few runs to filter out scheduling noise */
+    for (int run = 0; run < 3; run ++)
+    {
+        int error;
+        SRC_STATE * test = src_new (method, 1, & error);
+        if (! test)
+        {
+            RESAMPLE_ERROR (error);
+            return 0;
+        }
+
+        SRC_DATA d = SRC_DATA ();
+        d.data_in = in.begin ();
+        d.input_frames = in_frames;
+        d.data_out = out.begin ();
+        d.output_frames = out.len ();
+        d.src_ratio = test_ratio;
+        d.end_of_input = true;
+
+        double start = now_ns ();
+        error = src_process (test, & d);
+        double cost = (now_ns () - start) / aud::max (d.output_frames_gen, 1L);
+
+        src_delete (test);
+
+        if (error)
+        {
+            RESAMPLE_ERROR (error);
+            return 0;
+        }
+
+        if (! run || cost < best)
+            best = cost;
+    }
+
+    return best;
+}
+
+static void set_costs (const double * costs)
+{
+    pthread_mutex_lock (& cost_mutex);
+    for (int i = 0; i < N_METHODS; i ++)
+        method_cost[i] = costs[i];
+    pthread_mutex_unlock (& cost_mutex);
+}
+
+/* returns false if there is no valid saved calibration */
+static bool load_calibration ()
+{
+    String saved = aud_get_str ("resample", "calibration");
+    const char * get = saved;
+    char * end;
+
+    if (strtol (get, & end, 10) != CALIBRATION_VERSION || * end != ':')
+        return false;
+
+    double costs[N_METHODS];
+    get = end + 1;
+
+    for (int i = 0; i < N_METHODS; i ++)
+    {
+        long ps = strtol (get, & end, 10);
+        if (end == get || ps <= 0)
+            return false;
+
+        costs[i] = ps / 1000.0;
+        get = end + (* end == ',');
+    }
+
+    set_costs (costs);
+    return true;
+}
+
+static void calibrate ()
+{
+    double costs[N_METHODS];
+    char saved[256];
+    int len = snprintf (saved, sizeof saved, "%d:", CALIBRATION_VERSION);
+
+    for (int i = 0; i < N_METHODS; i ++)
+    {
+        costs[i] = measure_method (methods_by_quality[i]);
+        len += snprintf (saved + len, sizeof saved - len, i ? ",%ld" : "%ld",
+         lround (costs[i] * 1000));
+
+        AUDINFO ("%s: %.2f ns per frame.\n",
+         src_get_name (methods_by_quality[i]), costs[i]);
+
+        /* a failed measurement is saved as 0, so that it is tried again */
+        if (costs[i] <= 0)
+            costs[i] = default_cost[i];
+    }
+
+    set_costs (costs);
+    aud_set_str ("resample", "calibration", saved);
+}
+
+static void * calibrate_worker (void *)
+{
+    calibrate ();
+
+    pthread_mutex_lock (& cost_mutex);
+    calibrate_done = true;
+    pthread_mutex_unlock (& cost_mutex);
+
+    return nullptr;
+}
+
+static void launch_calibration ()
+{
+    calibrate_done = false;
+    calibrate_running = ! pthread_create (& calibrate_thread, nullptr,
+     calibrate_worker, nullptr);
+
+    if (! calibrate_running)
+        AUDERR ("Failed to start calibration thread.\n");
+}
+
+static void start_calibration ()
+{
+    if (load_calibration ())
+        return;
+
+    set_costs (default_cost);
+    launch_calibration ();
+}
+
+static void stop_calibration ()
+{
+    if (calibrate_running)
+    {
+        pthread_join (calibrate_thread, nullptr);
+        calibrate_running = false;
+    }
+}
+
+/* called from the preferences window; the measurement runs in the
+ * calibration thread, so that the window stays responsive */
+void Resampler::recalibrate ()
+{
+    pthread_mutex_lock (& cost_mutex);
+    bool busy = calibrate_running && ! calibrate_done;
+    pthread_mutex_unlock (& cost_mutex);
+
+    if (busy)
+    {
+        AUDINFO ("Calibration already in progress.\n");
+        return;
+    }
+
+    /* reap the previous run, which has finished */
+    stop_calibration ();
+    launch_calibration ();
+}
+
+/* Picks the best converter whose estimated load fits the configured CPU
+ * budget (in percent of one core). */
+static int pick_method (int channels, int rate, int new_rate)
+{
+    double costs[N_METHODS];
+
+    pthread_mutex_lock (& cost_mutex);
+    for (int i = 0; i < N_METHODS; i ++)
+        costs[i] = method_cost[i];
+    pthread_mutex_unlock (& cost_mutex);
+
+    double budget = aud_get_int ("resample", "cpu-budget") / 100.0;
+
+    /* the sinc filters widen in proportion when downsampling */
+    double scale = aud::max (1.0, (double) rate / new_rate);
+
+    for (int i = 0; i < N_METHODS; i ++)
+    {
+        double load = costs[i] * scale * channels * new_rate / 1e9;
+
+        if (load <= budget || i == N_METHODS - 1)
+        {
+            AUDINFO ("Using %s (estimated load %.1f%%).\n",
+             src_get_name (methods_by_quality[i]), load * 100);
+            return methods_by_quality[i];
+        }
+    }
+
+    return SRC_ZERO_ORDER_HOLD;
+}
+
+/* Dedicated kernel for integer upsampling ratios (e.g. 44.1 -> 88.2 kHz).
+ * Every input frame yields exactly <int_factor> output frames, one from each
+ * filter phase, so unlike the general case there is no fractional position
+ * to track and no interpolation between phases. */
+
+static double bessel_i0 (double x)
+{
+    double sum = 1, term = 1;
+
+    for (int k = 1; k < 32; k ++)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+
+    return sum;
+}
+
+static void start_integer (int factor)
+{
+    const double cutoff = 0.95; /* relative to the input Nyquist frequency */
+    const double beta = 8.0;    /* Kaiser window, about 80 dB stopband */
+
+    int_factor = factor;
+    int_coefs.resize (factor * INT_TAPS);
+
+    for (int p = 0; p < factor; p ++)
+    {
+        float * coefs = & int_coefs[p * INT_TAPS];
+        double sum = 0;
+
+        for (int k = 0; k < INT_TAPS; k ++)
+        {
+            double x = k - (INT_TAPS / 2 - 1) - (double) p / factor;
+            double sinc = (x == 0) ? 1 : sin (M_PI * cutoff * x) / (M_PI * cutoff * x);
+            double r = x / (INT_TAPS / 2);
+            double window = (r * r < 1) ? bessel_i0 (beta * sqrt (1 - r * r)) / bessel_i0 (beta) : 0;
+
+            coefs[k] = sinc * window;
+            sum += coefs[k];
+        }
+
+        for (int k = 0; k < INT_TAPS; k ++)
+            coefs[k] /= sum;
+    }
+}
+
+static void reset_integer ()
+{
+    int_hist.resize (0);
+    int_hist.insert (0, stored_channels * (INT_TAPS / 2 - 1));
+}
+
+static void run_integer (const float * data, int len, bool finish)
+{
+    int_hist.insert (data, -1, len);
+    if (finish)
+        int_hist.insert (-1, stored_channels * (INT_TAPS / 2));
+
+    int frames = int_hist.len () / stored_channels - (INT_TAPS - 1);
+    if (frames <= 0)
+        return;
+
+    float * set = reserve_output (frames * int_factor);
+    const float * get = int_hist.begin ();
+
+    for (int f = 0; f < frames; f ++)
+    {
+        for (int p = 0; p < int_factor; p ++)
+        {
+            const float * coefs = & int_coefs[p * INT_TAPS];
+
+            if (stored_channels == 2)
+            {
+                float left = 0, right = 0;
+
+                for (int k = 0; k < INT_TAPS; k ++)
+                {
+                    left += get[2 * k] * coefs[k];
+                    right += get[2 * k + 1] * coefs[k];
+                }
+
+                * set ++ = left;
+                * set ++ = right;
+            }
+            else
+            {
+                for (int c = 0; c < stored_channels; c ++)
+                {
+                    float sum = 0;
+                    for (int k = 0; k < INT_TAPS; k ++)
+                        sum += get[k * stored_channels + c] * coefs[k];
+
+                    * set ++ = sum;
+                }
+            }
+        }
+
+        get += stored_channels;
+    }
+
+    int_hist.remove (0, stored_channels * frames);
+    frames_out += frames * int_factor;
+
+    if (finish)
+        reset_integer ();
 }
 
 void Resampler::start (int & channels, int & rate)
@@ -112,6 +506,8 @@ void Resampler::start (int & channels, int & rate)
         state = nullptr;
     }
 
+    int_factor = 0;
+
     int new_rate = 0;
 
     if (aud_get_bool ("resample", "use-mappings"))
@@ -125,7 +521,28 @@ void Resampler::start (int & channels, int & rate)
     if (new_rate == rate)
         return;
 
+    stored_channels = channels;
+    stored_rate = new_rate;
+    ratio = (double) new_rate / rate;
+
+    frames_in = frames_out = 0;
+
     int method = aud_get_int ("resample", "method");
+
+    if (method == METHOD_AUTO)
+    {
+        if (new_rate % rate == 0 && new_rate / rate <= MAX_INT_FACTOR)
+        {
+            AUDINFO ("Using integer kernel (x%d).\n", new_rate / rate);
+            start_integer (new_rate / rate);
+            reset_integer ();
+            rate = new_rate;
+            return;
+        }
+
+        method = pick_method (channels, rate, new_rate);
+    }
+
     int error;
 
     if ((state = src_new (method, channels, & error)) == nullptr)
@@ -134,35 +551,61 @@ void Resampler::start (int & channels, int & rate)
         return;
     }
 
-    stored_channels = channels;
-    ratio = (double) new_rate / rate;
     rate = new_rate;
 }
 
 Index<float> & Resampler::resample (Index<float> & data, bool finish)
 {
-    if (! state || ! data.len ())
+    if (int_factor)
+    {
+        buffer.resize (0);
+        frames_in += data.len () / stored_channels;
+        run_integer (data.begin (), data.len (), finish);
+        return buffer;
+    }
+
+    if (! state)
         return data;
 
-    buffer.resize ((int) (data.len () * ratio) + 256);
+    buffer.resize (0);
 
     SRC_DATA d = SRC_DATA ();
 
     d.data_in = data.begin ();
     d.input_frames = data.len () / stored_channels;
-    d.data_out = buffer.begin ();
-    d.output_frames = buffer.len () / stored_channels;
     d.src_ratio = ratio;
     d.end_of_input = finish;
 
-    int error;
-    if ((error = src_process (state, & d)))
+    frames_in += d.input_frames;
+
+    /* At the end of a song, keep going until the converter has emptied its
+     * filter; otherwise one pass is normally enough. */
+    while (1)
     {
-        RESAMPLE_ERROR (error);
-        return data;
-    }
+        int room = (int) (d.input_frames * ratio) + 256;
+        int pos = buffer.len ();
+
+        d.data_out = reserve_output (room);
+        d.output_frames = room;
+
+        int error;
+        if ((error = src_process (state, & d)))
+        {
+            RESAMPLE_ERROR (error);
+            return data;
+        }
 
-    buffer.resize (stored_channels * d.output_frames_gen);
+        buffer.resize (pos + stored_channels * d.output_frames_gen);
+        frames_out += d.output_frames_gen;
+
+        d.data_in += stored_channels * d.input_frames_used;
+        d.input_frames -= d.input_frames_used;
+
+        if (! d.input_frames_used && ! d.output_frames_gen)
+            break;
+        if (! d.input_frames && ! finish)
+            break;
+    }
 
     if (finish)
         flush (true);
@@ -176,14 +619,29 @@ bool Resampler::flush (bool force)
     if (state && (error = src_reset (state)))
         RESAMPLE_ERROR (error);
 
+    if (int_factor)
+        reset_integer ();
+
+    frames_in = frames_out = 0;
+
     return true;
 }
 
+int Resampler::adjust_delay (int delay)
+{
+    if (! state && ! int_factor)
+        return delay;
+
+    int64_t held = (int64_t) (frames_in * ratio) - frames_out;
+    return delay + aud::rescale<int64_t> (aud::max (held, (int64_t) 0), stored_rate, 1000);
+}
+
 const char Resampler::about[] =
  N_("Sample Rate Converter Plugin for Audacious\n"
     "Copyright 2010-2012 John Lindgren");
 
 static const ComboItem method_list[] = {
+    ComboItem(N_("Automatic"), METHOD_AUTO),
     ComboItem(N_("Skip/repeat samples"), SRC_ZERO_ORDER_HOLD),
     ComboItem(N_("Linear interpolation"), SRC_LINEAR),
     ComboItem(N_("Fast sinc interpolation"), SRC_SINC_FASTEST),
@@ -196,6 +654,11 @@ const PreferencesWidget Resampler::widgets[] = {
     WidgetCombo (N_("Method:"),
         WidgetInt ("resample", "method"),
         {{method_list}}),
+    WidgetSpin (N_("CPU budget (automatic):"),
+        WidgetInt ("resample", "cpu-budget"),
+        {1, 100, 1, N_("% of one core")}),
+    WidgetButton (N_("Recalibrate"),
+        {Resampler::recalibrate}),
     WidgetSpin (N_("Rate:"),
         WidgetInt ("resample", "default-rate"),
         {MIN_RATE, MAX_RATE, RATE_STEP, N_("Hz")}),
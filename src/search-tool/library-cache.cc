@@ -0,0 +1,325 @@
+/*
+ * library-cache.cc
+ * Copyright 2015 Audacious developers
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include "library-cache.h"
+
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include <libaudcore/audstrings.h>
+#include <libaudcore/runtime.h>
+
+/* File layout (all integers in native byte order):
+ *
+ *   char magic[8]
+ *   uint32 n_fields, then per field: char type ('i' or 's'), name, '\0'
+ *   uint32 n_records, then uint32 offsets[n_records], sorted by URI
+ *   records: URI, '\0', int64 mtime, int64 size,
+ *            (uint8 field, int32 or string + '\0') ..., uint8 FIELD_END
+ *   '\0'
+ *
+ * The trailing zero byte guarantees that any string read from the file is
+ * terminated within the mapping. */
+
+static const char cache_magic[8] = {'A', 'U', 'D', 'L', 'I', 'B', 'C', '1'};
+
+#define FIELD_END 0xff
+
+bool library_cache_stat (const char * uri, FileStat & stat)
+{
+    StringBuf filename = uri_to_filename (uri);
+    if (! filename)
+        return false;
+
+    GStatBuf info;
+    if (g_stat (filename, & info) < 0)
+        return false;
+
+    stat.mtime = info.st_mtime;
+    stat.size = info.st_size;
+    return true;
+}
+
+static bool read_u32 (const char * & p, const char * end, unsigned & val)
+{
+    if (end - p < 4)
+        return false;
+
+    uint32_t v;
+    memcpy (& v, p, 4);
+    p += 4;
+    val = v;
+    return true;
+}
+
+bool LibraryCache::open (const char * path)
+{
+    close ();
+
+    m_file = g_mapped_file_new (path, false, nullptr);
+    if (! m_file)
+        return false;
+
+    m_data = g_mapped_file_get_contents (m_file);
+    m_end = m_data + g_mapped_file_get_length (m_file);
+
+    const char * p = m_data;
+    unsigned n_fields, n_records;
+
+    if (m_end - p < (int) sizeof cache_magic || memcmp (p, cache_magic, sizeof cache_magic))
+        goto ERR;
+
+    if (m_end[-1])
+        goto ERR;
+
+    p += sizeof cache_magic;
+
+    if (! read_u32 (p, m_end, n_fields) || n_fields >= FIELD_END)
+        goto ERR;
+
+    for (unsigned f = 0; f < n_fields; f ++)
+    {
+        if (p >= m_end || (* p != 'i' && * p != 's'))
+            goto ERR;
+
+        bool is_int = (* p ++ == 'i');
+        auto field = Tuple::field_by_name (p);
+
+        /* ignore fields that are unknown or have changed type */
+        if (field != Tuple::Invalid && Tuple::field_get_type (field) !=
+         (is_int ? Tuple::Int : Tuple::String))
+            field = Tuple::Invalid;
+
+        CacheField cache_field = {field, is_int};
+        m_fields.append (cache_field);
+        p += strlen (p) + 1;
+    }
+
+    if (! read_u32 (p, m_end, n_records) || (m_end - p) / 4 < n_records)
+        goto ERR;
+
+    m_records = n_records;
+    m_offsets = p;
+    return true;
+
+ERR:
+    AUDWARN ("Library cache %s is invalid.\n", path);
+    close ();
+    return false;
+}
+
+void LibraryCache::close ()
+{
+    if (m_file)
+        g_mapped_file_unref (m_file);
+
+    m_file = nullptr;
+    m_data = m_end = m_offsets = nullptr;
+    m_records = 0;
+    m_fields.clear ();
+}
+
+const char * LibraryCache::find (const char * uri) const
+{
+    int lo = 0, hi = m_records;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        uint32_t offset;
+        memcpy (& offset, m_offsets + 4 * mid, 4);
+
+        if (offset >= (uint32_t) (m_end - m_data))
+            return nullptr;
+
+        const char * record = m_data + offset;
+        int cmp = strcmp (uri, record);
+
+        if (cmp < 0)
+            hi = mid;
+        else if (cmp > 0)
+            lo = mid + 1;
+        else
+            return record + strlen (record) + 1;
+    }
+
+    return nullptr;
+}
+
+bool LibraryCache::lookup_stat (const char * uri, FileStat & stat) const
+{
+    const char * p = find (uri);
+    if (! p || m_end - p < 16)
+        return false;
+
+    memcpy (& stat.mtime, p, 8);
+    memcpy (& stat.size, p + 8, 8);
+    return true;
+}
+
+Tuple LibraryCache::lookup (const char * uri, const FileStat & stat) const
+{
+    FileStat cached;
+    if (! lookup_stat (uri, cached) || cached.mtime != stat.mtime || cached.size != stat.size)
+        return Tuple ();
+
+    const char * p = find (uri) + 16;
+
+    Tuple tuple;
+    tuple.set_filename (uri);
+
+    while (p < m_end)
+    {
+        unsigned char f = * p ++;
+
+        if (f == FIELD_END)
+            return tuple;
+        if (f >= m_fields.len ())
+            break;
+
+        const CacheField & field = m_fields[f];
+
+        if (field.is_int)
+        {
+            int32_t val;
+            if (m_end - p < 4)
+                break;
+
+            memcpy (& val, p, 4);
+            p += 4;
+
+            if (field.field != Tuple::Invalid)
+                tuple.set_int (field.field, val);
+        }
+        else
+        {
+            if (field.field != Tuple::Invalid)
+                tuple.set_str (field.field, p);
+
+            p += strlen (p) + 1;
+        }
+    }
+
+    return Tuple ();
+}
+
+static void put (Index<char> & buf, const void * data, int len)
+{
+    buf.insert ((const char *) data, -1, len);
+}
+
+static void put_str (Index<char> & buf, const char * str)
+{
+    put (buf, str, strlen (str) + 1);
+}
+
+static void put_u32 (Index<char> & buf, uint32_t val)
+{
+    put (buf, & val, 4);
+}
+
+/* fields that are derived from the filename when it is set */
+static bool field_is_derived (Tuple::Field f)
+{
+    return f == Tuple::Path || f == Tuple::Basename || f == Tuple::Suffix ||
+     f == Tuple::FormattedTitle;
+}
+
+void LibraryCacheWriter::add (const char * uri, const FileStat & stat, const Tuple & tuple)
+{
+    Record & record = m_records.append ();
+    record.uri = String (uri);
+    record.offset = m_data.len ();
+
+    put_str (m_data, uri);
+    put (m_data, & stat.mtime, 8);
+    put (m_data, & stat.size, 8);
+
+    for (auto f : Tuple::all_fields ())
+    {
+        if (field_is_derived (f))
+            continue;
+
+        Tuple::ValueType type = tuple.get_value_type (f);
+
+        if (type == Tuple::Int)
+        {
+            int32_t val = tuple.get_int (f);
+            m_data.append ((char) f);
+            put (m_data, & val, 4);
+        }
+        else if (type == Tuple::String)
+        {
+            m_data.append ((char) f);
+            put_str (m_data, tuple.get_str (f));
+        }
+    }
+
+    m_data.append ((char) FIELD_END);
+}
+
+int LibraryCacheWriter::record_compare (const Record & a, const Record & b, void *)
+{
+    return strcmp (a.uri, b.uri);
+}
+
+bool LibraryCacheWriter::write (const char * path)
+{
+    m_records.sort (record_compare, nullptr);
+
+    Index<char> buf;
+    put (buf, cache_magic, sizeof cache_magic);
+
+    int n_fields = 0;
+    for (auto f : Tuple::all_fields ())
+        n_fields = (int) f + 1;
+
+    put_u32 (buf, n_fields);
+
+    for (auto f : Tuple::all_fields ())
+    {
+        buf.append ((Tuple::field_get_type (f) == Tuple::Int) ? 'i' : 's');
+        put_str (buf, Tuple::field_get_name (f));
+    }
+
+    put_u32 (buf, m_records.len ());
+
+    int base = buf.len () + 4 * m_records.len ();
+
+    for (const Record & record : m_records)
+        put_u32 (buf, base + record.offset);
+
+    buf.insert (m_data.begin (), -1, m_data.len ());
+    buf.append (0);
+
+    m_records.clear ();
+    m_data.clear ();
+
+    GError * error = nullptr;
+
+    if (! g_file_set_contents (path, buf.begin (), buf.len (), & error))
+    {
+        AUDWARN ("Failed to write library cache: %s\n", error->message);
+        g_error_free (error);
+        return false;
+    }
+
+    return true;
+}
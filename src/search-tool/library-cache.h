@@ -0,0 +1,98 @@
+/*
+ * library-cache.h
+ * Copyright 2015 Audacious developers
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef SEARCH_TOOL_LIBRARY_CACHE_H
+#define SEARCH_TOOL_LIBRARY_CACHE_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#include <libaudcore/index.h>
+#include <libaudcore/objects.h>
+#include <libaudcore/tuple.h>
+
+/* The library cache stores the scanned tuple of each file in the library,
+ * together with the modification time and size the file had when it was
+ * scanned, so that unchanged files need not be scanned again.  The file is
+ * memory-mapped and searched in place; records are sorted by URI. */
+
+struct FileStat {
+    int64_t mtime, size;
+};
+
+/* Returns false for files that are not local or cannot be accessed. */
+bool library_cache_stat (const char * uri, FileStat & stat);
+
+class LibraryCache
+{
+public:
+    LibraryCache () = default;
+    LibraryCache (const LibraryCache &) = delete;
+    LibraryCache & operator= (const LibraryCache &) = delete;
+
+    ~LibraryCache ()
+        { close (); }
+
+    bool open (const char * path);
+    void close ();
+
+    /* Finds the file modification time and size stored for <uri>. */
+    bool lookup_stat (const char * uri, FileStat & stat) const;
+
+    /* Returns the cached tuple for <uri>, or an empty tuple if there is none
+     * or the file has changed since it was cached. */
+    Tuple lookup (const char * uri, const FileStat & stat) const;
+
+private:
+    GMappedFile * m_file = nullptr;
+    const char * m_data = nullptr;
+    const char * m_end = nullptr;
+    int m_records = 0;
+    const char * m_offsets = nullptr;
+
+    /* the fields as numbered in the file */
+    struct CacheField {
+        Tuple::Field field; /* Tuple::Invalid if not known */
+        bool is_int;
+    };
+
+    Index<CacheField> m_fields;
+
+    const char * find (const char * uri) const;
+};
+
+class LibraryCacheWriter
+{
+public:
+    void add (const char * uri, const FileStat & stat, const Tuple & tuple);
+    bool write (const char * path);
+
+private:
+    struct Record {
+        String uri;
+        int offset;
+    };
+
+    Index<Record> m_records;
+    Index<char> m_data;
+
+    static int record_compare (const Record & a, const Record & b, void *);
+};
+
+#endif
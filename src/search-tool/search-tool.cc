@@ -17,12 +17,14 @@
  * the use of this software.
  */
 
+#include <pthread.h>
 #include <string.h>
 #include <gtk/gtk.h>
 
 #include <libaudcore/audstrings.h>
 #include <libaudcore/hook.h>
 #include <libaudcore/i18n.h>
+#include <libaudcore/mainloop.h>
 #include <libaudcore/playlist.h>
 #include <libaudcore/plugin.h>
 #include <libaudcore/multihash.h>
@@ -30,9 +32,17 @@
 #include <libaudgui/list.h>
 #include <libaudgui/menu.h>
 
+#include "library-cache.h"
+
 #define MAX_RESULTS 20
 #define SEARCH_DELAY 300
 
+/* entries added to the database per lock/unlock of the database mutex */
+#define ADD_CHUNK 256
+
+/* length of the substrings indexed for fast searching */
+#define NGRAM_LEN 3
+
 class SearchTool : public GeneralPlugin
 {
 public:
@@ -74,30 +84,62 @@ struct Item
     String name, folded;
     Item * parent;
     SimpleHash<Key, Item> children;
-    Index<int> matches;
+    Index<int> matches; /* sorted playlist positions */
+    int id;             /* position in item_table */
 
     Item (SearchField field, const String & name, Item * parent) :
         field (field),
         name (name),
         folded (str_tolower_utf8 (name)),
-        parent (parent) {}
+        parent (parent),
+        id (-1) {}
 
     Item (Item &&) = default;
     Item & operator= (Item &&) = default;
 };
 
+struct NGram
+{
+    unsigned code;
+
+    bool operator== (const NGram & b) const
+        { return code == b.code; }
+    unsigned hash () const
+        { return code * 0x9e3779b1; }
+};
+
+/* the items that a playlist entry was added to, for removing it later */
+typedef aud::array<SearchField, Item *> EntryItems;
+
+/* A change to the playlist: entries [before, before + removed) have been
+ * replaced by the entries with the given filenames.  A reset job first clears
+ * the whole database.  The tuples are fetched by the update thread, so that
+ * copying them does not stall the main thread. */
+struct UpdateJob
+{
+    bool reset;
+    int list_id;
+    int before, removed;
+    Index<String> filenames;
+};
+
 struct SearchState {
     Index<const Item *> items;
     int mask;
 };
 
+/* a search result, copied out of the database so that the list remains
+ * valid while the database is being updated */
+struct Result {
+    String name, text;
+    Index<int> matches;
+};
+
 static int playlist_id;
 static Index<String> search_terms;
 
 static SimpleHash<String, bool> added_table;
-static SimpleHash<Key, Item> database;
-static bool database_valid;
-static Index<const Item *> items;
+static Index<Result> items;
 static int hidden_items;
 static Index<bool> selection;
 
@@ -106,6 +148,40 @@ static int search_source;
 
 static GtkWidget * entry, * help_label, * wait_label, * scrolled, * results_list, * stats_label;
 
+/* The database is modified only by the update thread, and read by the main
+ * thread while searching; both hold db_mutex while doing so. */
+static pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SimpleHash<Key, Item> database;
+static Index<EntryItems> db_entries;
+static Index<Item *> item_table; /* by id; nullptr once an item is removed */
+static int dead_items;
+static SimpleHash<NGram, Index<int>> ngram_index; /* item ids by substring */
+
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t update_thread;
+static Index<UpdateJob> jobs;
+static bool job_running, update_quit;
+static QueuedFunc update_done_func;
+
+/* main thread's view of the database, once all queued jobs are done */
+static bool database_valid;
+static int db_playlist_id = -1;
+static int db_length;
+
+/* playlist changes not yet sent to the update thread */
+static bool change_pending, structure_pending;
+static int change_before, change_after;
+
+/* The library cache is consulted from the playlist add thread while the
+ * library folder is being added; cache_mutex protects these variables. */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LibraryCache cache;
+static SimpleHash<String, FileStat> file_stats;
+static Index<PlaylistAddItem> cached_items;
+static Index<String> changed_files; /* already in the playlist, but stale */
+static bool cache_dirty;
+
 static void find_playlist ()
 {
     playlist_id = -1;
@@ -166,62 +242,294 @@ static String get_path ()
     return String (g_get_home_dir ());
 }
 
+static unsigned ngram_code (const char * s)
+{
+    return (unsigned char) s[0] | (unsigned char) s[1] << 8 | (unsigned char) s[2] << 16;
+}
+
+static void index_item (Item * item)
+{
+    item->id = item_table.len ();
+    item_table.append (item);
+
+    const char * s = item->folded;
+    int len = strlen (s);
+
+    for (int i = 0; i + NGRAM_LEN <= len; i ++)
+    {
+        NGram ngram = {ngram_code (s + i)};
+        Index<int> * ids = ngram_index.lookup (ngram);
+
+        if (! ids)
+            ids = ngram_index.add (ngram, Index<int> ());
+
+        /* ids are assigned in increasing order, so a repeated substring
+         * within the same name can only be at the end of the list */
+        if (! ids->len () || (* ids)[ids->len () - 1] != item->id)
+            ids->append (item->id);
+    }
+}
+
+/* Removed items are only marked as such in the substring index; once they
+ * make up half of it, the index is rebuilt with the remaining ones. */
+static void compact_index ()
+{
+    Index<Item *> live;
+
+    for (Item * item : item_table)
+    {
+        if (item)
+            live.append (item);
+    }
+
+    item_table.clear ();
+    ngram_index.clear ();
+    dead_items = 0;
+
+    for (Item * item : live)
+        index_item (item);
+}
+
 static void destroy_database ()
 {
-    items.clear ();
-    hidden_items = 0;
     database.clear ();
-    database_valid = false;
+    db_entries.clear ();
+    item_table.clear ();
+    ngram_index.clear ();
+    dead_items = 0;
 }
 
-static void create_database (int list)
+static int match_pos (const Index<int> & matches, int entry)
 {
-    destroy_database ();
-
-    int entries = aud_playlist_entry_count (list);
+    int lo = 0, hi = matches.len ();
 
-    for (int e = 0; e < entries; e ++)
+    while (lo < hi)
     {
-        Tuple tuple = aud_playlist_entry_get_tuple (list, e, Playlist::Guess);
+        int mid = (lo + hi) / 2;
+        if (matches[mid] < entry)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
 
-        aud::array<SearchField, String> fields;
-        fields[SearchField::Genre] = tuple.get_str (Tuple::Genre);
-        fields[SearchField::Artist] = tuple.get_str (Tuple::Artist);
-        fields[SearchField::Album] = tuple.get_str (Tuple::Album);
-        fields[SearchField::Title] = tuple.get_str (Tuple::Title);
+static void add_entry (int e, const Tuple & tuple)
+{
+    aud::array<SearchField, String> fields;
+    fields[SearchField::Genre] = tuple.get_str (Tuple::Genre);
+    fields[SearchField::Artist] = tuple.get_str (Tuple::Artist);
+    fields[SearchField::Album] = tuple.get_str (Tuple::Album);
+    fields[SearchField::Title] = tuple.get_str (Tuple::Title);
 
-        Item * parent = nullptr;
-        SimpleHash<Key, Item> * hash = & database;
+    Item * parent = nullptr;
+    SimpleHash<Key, Item> * hash = & database;
 
-        for (auto f : aud::range<SearchField> ())
+    for (auto f : aud::range<SearchField> ())
+    {
+        if (fields[f])
         {
-            if (fields[f])
-            {
-                Key key = {f, fields[f]};
-                Item * item = hash->lookup (key);
+            Key key = {f, fields[f]};
+            Item * item = hash->lookup (key);
 
-                if (! item)
-                    item = hash->add (key, Item (f, fields[f], parent));
+            if (! item)
+            {
+                item = hash->add (key, Item (f, fields[f], parent));
+                index_item (item);
+            }
 
-                item->matches.append (e);
+            int pos = match_pos (item->matches, e);
+            item->matches.insert (pos, 1);
+            item->matches[pos] = e;
+            db_entries[e][f] = item;
 
-                /* genre is outside the normal hierarchy */
-                if (f != SearchField::Genre)
-                {
-                    parent = item;
-                    hash = & item->children;
-                }
+            /* genre is outside the normal hierarchy */
+            if (f != SearchField::Genre)
+            {
+                parent = item;
+                hash = & item->children;
             }
         }
     }
+}
+
+static void remove_entry (int e)
+{
+    EntryItems & entry_items = db_entries[e];
+
+    /* go from the bottom of the hierarchy up, so that an item is always
+     * removed before its parent */
+    for (int f = (int) SearchField::count; f --; )
+    {
+        Item * item = entry_items[(SearchField) f];
+        if (! item)
+            continue;
+
+        item->matches.remove (match_pos (item->matches, e), 1);
+
+        if (! item->matches.len ())
+        {
+            item_table[item->id] = nullptr;
+            dead_items ++;
+
+            SimpleHash<Key, Item> * hash = item->parent ? & item->parent->children : & database;
+            hash->remove ({item->field, item->name});
+        }
+    }
+}
+
+/* renumbers the entries from <from> onward */
+static void shift_entries (int from, int delta)
+{
+    if (! delta)
+        return;
+
+    for (Item * item : item_table)
+    {
+        if (! item)
+            continue;
+
+        for (int m = match_pos (item->matches, from); m < item->matches.len (); m ++)
+            item->matches[m] += delta;
+    }
+}
 
-    database_valid = true;
+static bool update_cancelled ()
+{
+    pthread_mutex_lock (& job_mutex);
+    bool quit = update_quit;
+    pthread_mutex_unlock (& job_mutex);
+    return quit;
 }
 
-static void search_cb (const Key & key, Item & item, void * _state)
+/* Fetches the tuples of entries [first, first + count) of a job.  If the
+ * playlist has changed since the job was queued, an entry may no longer be
+ * where it was; it is left blank, and the job queued for the change will
+ * fill it in.  The playlist API is thread-safe. */
+static void fetch_tuples (const UpdateJob & job, int first, int count, Index<Tuple> & tuples)
 {
-    SearchState * state = (SearchState *) _state;
+    int list = aud_playlist_by_unique_id (job.list_id);
+    int length = (list >= 0) ? aud_playlist_entry_count (list) : 0;
 
+    tuples.clear ();
+    tuples.insert (0, count);
+
+    for (int i = 0; i < count; i ++)
+    {
+        int e = job.before + first + i;
+        if (e >= length)
+            break;
+
+        String filename = aud_playlist_entry_get_filename (list, e);
+        if (filename && ! strcmp (filename, job.filenames[first + i]))
+            tuples[i] = aud_playlist_entry_get_tuple (list, e, Playlist::Guess);
+    }
+}
+
+static void run_job (const UpdateJob & job)
+{
+    int added = job.filenames.len ();
+    Index<Tuple> tuples;
+
+    pthread_mutex_lock (& db_mutex);
+
+    if (job.reset)
+        destroy_database ();
+
+    for (int e = job.before + job.removed; e -- > job.before; )
+        remove_entry (e);
+
+    if (dead_items > 1024 && dead_items > item_table.len () / 2)
+        compact_index ();
+
+    shift_entries (job.before + job.removed, added - job.removed);
+
+    db_entries.remove (job.before, job.removed);
+    db_entries.insert (job.before, added);
+
+    pthread_mutex_unlock (& db_mutex);
+
+    /* the main thread may search in between chunks; it will see some of
+     * the new entries missing, which is fine */
+    for (int i = 0; i < added; i += ADD_CHUNK)
+    {
+        if (update_cancelled ())
+            return;
+
+        int count = aud::min (ADD_CHUNK, added - i);
+        fetch_tuples (job, i, count, tuples);
+
+        pthread_mutex_lock (& db_mutex);
+
+        for (int j = 0; j < count; j ++)
+            add_entry (job.before + i + j, tuples[j]);
+
+        pthread_mutex_unlock (& db_mutex);
+    }
+}
+
+static void update_done_cb (void * unused);
+
+static void * update_worker (void * unused)
+{
+    pthread_mutex_lock (& job_mutex);
+
+    while (! update_quit)
+    {
+        if (! jobs.len ())
+        {
+            pthread_cond_wait (& job_cond, & job_mutex);
+            continue;
+        }
+
+        UpdateJob job = std::move (jobs[0]);
+        jobs.remove (0, 1);
+        job_running = true;
+
+        pthread_mutex_unlock (& job_mutex);
+        run_job (job);
+        pthread_mutex_lock (& job_mutex);
+
+        job_running = false;
+
+        if (! jobs.len ())
+            update_done_func.queue (update_done_cb, nullptr);
+    }
+
+    pthread_mutex_unlock (& job_mutex);
+    return nullptr;
+}
+
+static void start_update_thread ()
+{
+    update_quit = false;
+    pthread_create (& update_thread, nullptr, update_worker, nullptr);
+}
+
+static void stop_update_thread ()
+{
+    pthread_mutex_lock (& job_mutex);
+    update_quit = true;
+    jobs.clear ();
+    pthread_cond_signal (& job_cond);
+    pthread_mutex_unlock (& job_mutex);
+
+    pthread_join (update_thread, nullptr);
+    update_done_func.stop ();
+
+    destroy_database ();
+}
+
+static void search_item (Item & item, SearchState * state);
+
+static void search_cb (const Key & key, Item & item, void * state)
+{
+    search_item (item, (SearchState *) state);
+}
+
+static void search_item (Item & item, SearchState * state)
+{
     int oldmask = state->mask;
     int count = search_terms.len ();
 
@@ -245,6 +553,72 @@ static void search_cb (const Key & key, Item & item, void * _state)
     state->mask = oldmask;
 }
 
+/* Picks the search term with the shortest list of candidate items in the
+ * substring index.  Returns false if no term is long enough to be looked up,
+ * in which case the whole database has to be searched. */
+static bool find_candidates (int & term, const Index<int> * & candidates)
+{
+    static const Index<int> empty;
+
+    term = -1;
+    candidates = nullptr;
+
+    for (int t = 0; t < search_terms.len (); t ++)
+    {
+        const char * s = search_terms[t];
+        int len = strlen (s);
+
+        for (int i = 0; i + NGRAM_LEN <= len; i ++)
+        {
+            const Index<int> * ids = ngram_index.lookup ({ngram_code (s + i)});
+            if (! ids)
+                ids = & empty;
+
+            if (! candidates || ids->len () < candidates->len ())
+            {
+                term = t;
+                candidates = ids;
+            }
+        }
+    }
+
+    return candidates;
+}
+
+static void search_indexed (int term, const Index<int> & candidates, SearchState & state)
+{
+    const char * s = search_terms[term];
+    int count = search_terms.len ();
+    int mask = (1 << count) - 1;
+
+    for (int id : candidates)
+    {
+        Item * item = item_table[id];
+        if (! item || ! strstr (item->folded, s))
+            continue;
+
+        /* Every descendant of a matching item is a candidate too, but if an
+         * ancestor also matches, its search already covers this item. */
+        bool covered = false;
+        state.mask = mask;
+
+        for (Item * p = item->parent; p && ! covered; p = p->parent)
+        {
+            if (strstr (p->folded, s))
+                covered = true;
+
+            for (int t = 0, bit = 1; t < count; t ++, bit <<= 1)
+            {
+                if (strstr (p->folded, search_terms[t]))
+                    state.mask &= ~bit;
+            }
+        }
+
+        if (! covered)
+            search_item (* item, & state);
+    }
+}
+
 static int item_compare (const Item * const & a, const Item * const & b, void *)
 {
     if (a->field < b->field)
@@ -272,45 +646,164 @@ static int item_compare_pass1 (const Item * const & a, const Item * const & b, v
     return item_compare (a, b, nullptr);
 }
 
+static String describe_item (const Item * item)
+{
+    StringBuf string = str_concat ({item->name, "\n"});
+
+    if (item->field != SearchField::Title)
+    {
+        string.insert (-1, " ");
+        string.combine (str_printf (dngettext (PACKAGE, "%d song", "%d songs",
+         item->matches.len ()), item->matches.len ()));
+    }
+
+    if (item->field == SearchField::Genre)
+    {
+        string.insert (-1, " ");
+        string.insert (-1, _("of this genre"));
+    }
+
+    while ((item = item->parent))
+    {
+        string.insert (-1, " ");
+        string.insert (-1, (item->field == SearchField::Album) ? _("on") : _("by"));
+        string.insert (-1, " ");
+        string.insert (-1, item->name);
+    }
+
+    return String (string);
+}
+
 static void do_search ()
 {
     items.clear ();
     hidden_items = 0;
+    selection.remove (0, -1);
 
     if (! database_valid)
         return;
 
+    pthread_mutex_lock (& db_mutex);
+
     SearchState state;
+    int term;
+    const Index<int> * candidates;
 
     /* effectively limits number of search terms to 32 */
     state.mask = (1 << search_terms.len ()) - 1;
 
-    database.iterate (search_cb, & state);
-
-    items = std::move (state.items);
+    if (find_candidates (term, candidates))
+        search_indexed (term, * candidates, state);
+    else
+        database.iterate (search_cb, & state);
 
     /* first sort by number of songs per item */
-    items.sort (item_compare_pass1, nullptr);
+    state.items.sort (item_compare_pass1, nullptr);
 
     /* limit to items with most songs */
-    if (items.len () > MAX_RESULTS)
+    if (state.items.len () > MAX_RESULTS)
     {
-        hidden_items = items.len () - MAX_RESULTS;
-        items.remove (MAX_RESULTS, -1);
+        hidden_items = state.items.len () - MAX_RESULTS;
+        state.items.remove (MAX_RESULTS, -1);
     }
 
     /* sort by item type, then item name */
-    items.sort (item_compare, nullptr);
+    state.items.sort (item_compare, nullptr);
+
+    for (const Item * item : state.items)
+    {
+        Result & result = items.append ();
+        result.name = item->name;
+        result.text = describe_item (item);
+        result.matches.insert (item->matches.begin (), 0, item->matches.len ());
+    }
+
+    pthread_mutex_unlock (& db_mutex);
 
-    selection.remove (0, -1);
     selection.insert (0, items.len ());
     if (items.len ())
         selection[0] = true;
 }
 
+static StringBuf get_cache_path ()
+{
+    return filename_build ({aud_get_path (AudPath::UserDir), "search-tool.cache"});
+}
+
+/* Files that are unchanged since they were cached are not added through the
+ * playlist (which would scan them again) but collected with their cached
+ * tuples, to be inserted all at once when adding is complete.  Files that are
+ * already in the playlist are not added again, but those that have changed on
+ * disk since they were cached are collected to be rescanned. */
 static bool filter_cb (const char * filename, void * unused)
 {
-    return ! added_table.lookup (String (filename));
+    String key (filename);
+    bool present = added_table.lookup (key);
+
+    FileStat stat;
+    if (! library_cache_stat (filename, stat))
+        return ! present;
+
+    pthread_mutex_lock (& cache_mutex);
+
+    bool cached = false;
+
+    if (present)
+    {
+        FileStat old_stat;
+        if (cache.lookup_stat (filename, old_stat) &&
+         (old_stat.mtime != stat.mtime || old_stat.size != stat.size))
+            changed_files.append (key);
+    }
+    else
+    {
+        Tuple tuple = cache.lookup (filename, stat);
+        cached = (bool) tuple;
+
+        if (cached)
+            cached_items.append (key, std::move (tuple));
+    }
+
+    file_stats.add (key, std::move (stat));
+
+    pthread_mutex_unlock (& cache_mutex);
+
+    return ! present && ! cached;
+}
+
+static void save_cache (int list)
+{
+    LibraryCacheWriter writer;
+    int entries = aud_playlist_entry_count (list);
+
+    pthread_mutex_lock (& cache_mutex);
+
+    for (int e = 0; e < entries; e ++)
+    {
+        Tuple tuple = aud_playlist_entry_get_tuple (list, e, Playlist::Nothing);
+        if (! tuple)
+            continue;
+
+        String filename = aud_playlist_entry_get_filename (list, e);
+        FileStat * stat = file_stats.lookup (filename);
+        FileStat old_stat;
+
+        /* files that could not be checked keep their old cache entry */
+        if (stat)
+            writer.add (filename, * stat, tuple);
+        else if (cache.lookup_stat (filename, old_stat))
+            writer.add (filename, old_stat, tuple);
+    }
+
+    cache.close ();
+    file_stats.clear ();
+    cached_items.clear ();
+    changed_files.clear ();
+    cache_dirty = false;
+
+    pthread_mutex_unlock (& cache_mutex);
+
+    writer.write (get_cache_path ());
 }
 
 static void begin_add (const char * path)
@@ -348,6 +841,14 @@ static void begin_add (const char * path)
     aud_playlist_delete_selected (list);
     aud_playlist_remove_failed (list);
 
+    pthread_mutex_lock (& cache_mutex);
+    cache.open (get_cache_path ());
+    file_stats.clear ();
+    cached_items.clear ();
+    changed_files.clear ();
+    cache_dirty = true;
+    pthread_mutex_unlock (& cache_mutex);
+
     Index<PlaylistAddItem> add;
     add.append (String (uri));
     aud_playlist_entry_insert_filtered (list, -1, std::move (add), filter_cb, nullptr, false);
@@ -420,18 +921,125 @@ static void schedule_search ()
     search_source = g_timeout_add (SEARCH_DELAY, search_timeout, nullptr);
 }
 
+static void queue_job (UpdateJob && job)
+{
+    pthread_mutex_lock (& job_mutex);
+    jobs.append (std::move (job));
+    pthread_cond_signal (& job_cond);
+    pthread_mutex_unlock (& job_mutex);
+}
+
+static void invalidate_database ()
+{
+    if (database_valid)
+    {
+        database_valid = false;
+        search_timeout ();
+    }
+}
+
+static void update_done_cb (void * unused)
+{
+    pthread_mutex_lock (& job_mutex);
+    bool idle = ! jobs.len () && ! job_running;
+    pthread_mutex_unlock (& job_mutex);
+
+    if (! idle)
+        return;
+
+    if (db_playlist_id >= 0 && ! structure_pending)
+        database_valid = true;
+
+    search_timeout ();
+    show_hide_widgets ();
+}
+
+/* accumulates the range of entries changed since the last job was queued */
+static void note_change (const Playlist::Update & update)
+{
+    if (change_pending)
+    {
+        change_before = aud::min (change_before, update.before);
+        change_after = aud::min (change_after, update.after);
+    }
+    else
+    {
+        change_before = update.before;
+        change_after = update.after;
+        change_pending = true;
+    }
+
+    /* the positions stored in the search results are no longer valid */
+    if (update.level >= Playlist::Structure)
+    {
+        structure_pending = true;
+        invalidate_database ();
+    }
+}
+
 static void update_database ()
 {
     int list = get_playlist (true, true);
 
     if (list >= 0)
     {
-        create_database (list);
-        search_timeout ();
+        int length = aud_playlist_entry_count (list);
+        UpdateJob job = UpdateJob ();
+        int first, last;
+
+        if (db_playlist_id != playlist_id ||
+         change_before + change_after > aud::min (db_length, length))
+        {
+            /* first build, or the changes were not tracked */
+            job.reset = true;
+            first = 0;
+            last = length;
+        }
+        else if (change_pending)
+        {
+            job.before = change_before;
+            job.removed = db_length - change_before - change_after;
+            first = change_before;
+            last = length - change_after;
+        }
+        else
+        {
+            update_done_cb (nullptr);
+            return;
+        }
+
+        job.list_id = playlist_id;
+
+        for (int e = first; e < last; e ++)
+            job.filenames.append (aud_playlist_entry_get_filename (list, e));
+
+        queue_job (std::move (job));
+
+        db_playlist_id = playlist_id;
+        db_length = length;
+        change_before = change_after = 0;
+        change_pending = false;
+        structure_pending = false;
     }
-    else
+    else if (playlist_id < 0)
     {
-        destroy_database ();
+        if (db_playlist_id >= 0)
+        {
+            UpdateJob job = UpdateJob ();
+            job.reset = true;
+            queue_job (std::move (job));
+
+            db_playlist_id = -1;
+            db_length = 0;
+        }
+
+        change_pending = false;
+        structure_pending = false;
+
+        database_valid = false;
+        items.clear ();
+        hidden_items = 0;
+        selection.clear ();
         audgui_list_delete_rows (results_list, 0, audgui_list_row_count (results_list));
         gtk_label_set_text ((GtkLabel *) stats_label, "");
     }
@@ -449,10 +1057,23 @@ static void add_complete_cb (void * unused, void * unused2)
     {
         adding = false;
         added_table.clear ();
+
+        pthread_mutex_lock (& cache_mutex);
+        Index<PlaylistAddItem> add = std::move (cached_items);
+        Index<String> changed = std::move (changed_files);
+        pthread_mutex_unlock (& cache_mutex);
+
+        for (const String & filename : changed)
+            aud_playlist_rescan_file (filename);
+
+        aud_playlist_entry_insert_batch (list, -1, std::move (add), false);
         aud_playlist_sort_by_scheme (list, Playlist::Path);
     }
 
-    if (! database_valid && ! aud_playlist_update_pending (list))
+    if (cache_dirty && ! aud_playlist_scan_in_progress (list))
+        save_cache (list);
+
+    if (! aud_playlist_update_pending (list))
         update_database ();
 }
 
@@ -462,26 +1083,38 @@ static void scan_complete_cb (void * unused, void * unused2)
     if (list < 0)
         return;
 
-    if (! database_valid && ! aud_playlist_update_pending (list))
+    if (cache_dirty)
+        save_cache (list);
+
+    if (! aud_playlist_update_pending (list))
         update_database ();
 }
 
 static void playlist_update_cb (void * data, void * unused)
 {
-    if (! database_valid)
-        update_database ();
-    else
+    int list = get_playlist (false, false);
+
+    if (list >= 0)
     {
-        int list = get_playlist (true, true);
-        if (list < 0 || aud_playlist_update_detail (list).level >= Playlist::Metadata)
-            update_database ();
+        Playlist::Update update = aud_playlist_update_detail (list);
+        if (update.level >= Playlist::Metadata)
+            note_change (update);
     }
+
+    if (list < 0 || change_pending)
+        update_database ();
 }
 
 static void search_init ()
 {
     find_playlist ();
 
+    database_valid = false;
+    db_playlist_id = -1;
+    db_length = 0;
+    change_pending = structure_pending = false;
+
+    start_update_thread ();
     update_database ();
 
     hook_associate ("playlist add complete", add_complete_cb, nullptr);
@@ -501,12 +1134,22 @@ static void search_cleanup ()
         search_source = 0;
     }
 
+    stop_update_thread ();
+
     search_terms.clear ();
     items.clear ();
     selection.clear ();
 
     added_table.clear ();
-    destroy_database ();
+    database_valid = false;
+
+    pthread_mutex_lock (& cache_mutex);
+    cache.close ();
+    file_stats.clear ();
+    cached_items.clear ();
+    changed_files.clear ();
+    cache_dirty = false;
+    pthread_mutex_unlock (& cache_mutex);
 }
 
 static void do_add (gboolean play, String & title)
@@ -525,9 +1168,9 @@ static void do_add (gboolean play, String & title)
         if (! selection[i])
             continue;
 
-        const Item * item = items[i];
+        const Result & item = items[i];
 
-        for (int entry : item->matches)
+        for (int entry : item.matches)
         {
             add.append (
                 aud_playlist_entry_get_filename (list, entry),
@@ -537,7 +1180,7 @@ static void do_add (gboolean play, String & title)
 
         n_selected ++;
         if (n_selected == 1)
-            title = item->name;
+            title = item.name;
     }
 
     if (n_selected != 1)
@@ -585,31 +1228,7 @@ static void list_get_value (void * user, int row, int column, GValue * value)
 {
     g_return_if_fail (row >= 0 && row < items.len ());
 
-    const Item * item = items[row];
-    StringBuf string = str_concat ({item->name, "\n"});
-
-    if (item->field != SearchField::Title)
-    {
-        string.insert (-1, " ");
-        string.combine (str_printf (dngettext (PACKAGE, "%d song", "%d songs",
-         item->matches.len ()), item->matches.len ()));
-    }
-
-    if (item->field == SearchField::Genre)
-    {
-        string.insert (-1, " ");
-        string.insert (-1, _("of this genre"));
-    }
-
-    while ((item = item->parent))
-    {
-        string.insert (-1, " ");
-        string.insert (-1, (item->field == SearchField::Album) ? _("on") : _("by"));
-        string.insert (-1, " ");
-        string.insert (-1, item->name);
-    }
-
-    g_value_set_string (value, string);
+    g_value_set_string (value, items[row].text);
 }
 
 static bool list_get_selected (void * user, int row)
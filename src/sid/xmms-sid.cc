@@ -31,6 +31,7 @@
 #include <libaudcore/plugin.h>
 #include <libaudcore/runtime.h>
 
+#include "file-view.h"
 #include "xs_config.h"
 #include "xs_sidplay2.h"
 
@@ -130,7 +131,7 @@ bool SIDPlugin::play(const char *filename, VFSFile &file)
         return false;
 
     /* Load file */
-    Index<char> buf = file.read_all ();
+    FileView buf(file);
     if (!xs_sidplayfp_probe(buf.begin(), buf.len()))
         return false;
 
@@ -185,8 +186,25 @@ bool SIDPlugin::play(const char *filename, VFSFile &file)
 
     while (! check_stop ())
     {
-        if (check_seek () >= 0)
-            AUDWARN ("Seeking is not implemented, ignoring.\n");
+        int seek_value = check_seek ();
+
+        if (seek_value >= 0)
+        {
+            int64_t target = aud::rescale<int64_t> (seek_value, 1000,
+             xs_cfg.audioFrequency) * xs_cfg.audioChannels * 2;
+
+            /* seeking backward means starting the tune over */
+            if (target < bytes_played)
+            {
+                if (!xs_sidplayfp_initsong(subTune))
+                    break;
+
+                bytes_played = 0;
+            }
+
+            bytes_played += xs_sidplayfp_skip(audioBuffer, audioBufSize,
+             target - bytes_played);
+        }
 
         int bufRemaining = xs_sidplayfp_fillbuffer(audioBuffer, audioBufSize);
 
@@ -300,7 +318,7 @@ Tuple SIDPlugin::read_tuple(const char *filename, VFSFile &file)
     xs_tuneinfo_t info;
     int tune = -1;
 
-    Index<char> buf = file.read_all ();
+    FileView buf(file);
     if (!xs_sidplayfp_probe(buf.begin(), buf.len()))
         return tuple;
 
@@ -215,6 +215,46 @@ unsigned xs_sidplayfp_fillbuffer(char * audioBuffer, unsigned audioBufSize)
 }
 
 
+/* Skip ahead by the given number of bytes of audio, running the emulation
+ * at maximum speed with the output discarded. Returns the number of bytes
+ * actually skipped, which may be less at the end of the tune.
+ */
+int64_t xs_sidplayfp_skip(char * audioBuffer, unsigned audioBufSize, int64_t bytes)
+{
+    /* in fast-forward mode, each sample output stands for this many */
+    const int factor = 32;
+    int64_t skipped = 0;
+
+    if (state.currEng->fastForward(factor * 100))
+    {
+        /* keep to whole stereo frames, so that the rest is aligned too */
+        unsigned size;
+        while ((size = aud::min((int64_t) audioBufSize, (bytes - skipped) / factor) & ~3))
+        {
+            unsigned got = xs_sidplayfp_fillbuffer(audioBuffer, size);
+            if (!got)
+                break;
+
+            skipped += (int64_t) got * factor;
+        }
+
+        state.currEng->fastForward(100);
+    }
+
+    while (skipped < bytes)
+    {
+        unsigned size = aud::min((int64_t) audioBufSize, bytes - skipped);
+        unsigned got = xs_sidplayfp_fillbuffer(audioBuffer, size);
+        if (!got)
+            break;
+
+        skipped += got;
+    }
+
+    return skipped;
+}
+
+
 /* Load a given SID-tune file
  */
 bool xs_sidplayfp_load(const void *buf, int64_t bufSize)
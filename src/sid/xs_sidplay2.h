@@ -10,6 +10,7 @@ void xs_sidplayfp_close();
 bool xs_sidplayfp_init();
 bool xs_sidplayfp_initsong(int subtune);
 unsigned xs_sidplayfp_fillbuffer(char *, unsigned);
+int64_t xs_sidplayfp_skip(char *, unsigned, int64_t);
 bool xs_sidplayfp_load(const void *buf, int64_t bufSize);
 bool xs_sidplayfp_getinfo(xs_tuneinfo_t &ti, const char *filename, const void *buf, int64_t bufSize);
 bool xs_sidplayfp_updateinfo(xs_tuneinfo_t &ti, int subtune);
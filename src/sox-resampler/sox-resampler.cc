@@ -56,6 +56,8 @@ public:
     void start (int & channels, int & rate);
     Index<float> & process (Index<float> & data);
     bool flush (bool force);
+    Index<float> & finish (Index<float> & data, bool end_of_playlist);
+    int adjust_delay (int delay);
 };
 
 EXPORT SoXResampler aud_plugin_instance;
@@ -67,8 +69,12 @@ const char * const SoXResampler::defaults[] = {
 
 static soxr_t soxr;
 static soxr_error_t error;
-static int stored_channels;
+static int stored_channels, stored_rate;
 static double ratio;
+
+/* The output buffer is never shrunk between blocks, only cleared on cleanup,
+ * so once it has grown to fit the largest block no further allocation
+ * happens in the audio path. */
 static Index<float> buffer;
 
 bool SoXResampler::init ()
@@ -106,40 +112,106 @@ void SoXResampler::start (int & channels, int & rate)
     }
 
     stored_channels = channels;
+    stored_rate = new_rate;
     ratio = (double) new_rate / rate;
     rate = new_rate;
 }
 
+/* Makes room for at least <frames> more output frames at the end of the
+ * buffer and returns a pointer to the first of them.  The buffer is resized
+ * back down to the frames actually produced by the caller. */
+static float * reserve_output (int frames)
+{
+    int pos = buffer.len ();
+    buffer.insert (-1, stored_channels * frames);
+    return & buffer[pos];
+}
+
+/* Feeds <frames> frames into the resampler, appending the output to the
+ * buffer.  Passing null data signals the end of input, and the resampler is
+ * then emptied of everything left in its filter. */
+static bool resample (const float * data, int frames)
+{
+    while (1)
+    {
+        int room = (int) (frames * ratio) + 256;
+        int pos = buffer.len ();
+        size_t frames_used = 0, frames_done = 0;
+
+        error = soxr_process (soxr, data, frames, data ? & frames_used : nullptr,
+         reserve_output (room), room, & frames_done);
+
+        if (error)
+        {
+            AUDERR ("%s\n", error);
+            buffer.resize (pos);
+            return false;
+        }
+
+        buffer.resize (pos + stored_channels * frames_done);
+
+        if (data)
+        {
+            data += stored_channels * frames_used;
+            frames -= frames_used;
+
+            if (! frames || (! frames_used && ! frames_done))
+                return true;
+        }
+        else if (! frames_done)
+            return true;
+    }
+}
+
 Index<float> & SoXResampler::process (Index<float> & data)
 {
     if (! soxr)
          return data;
 
-    buffer.resize ((int) (data.len () * ratio) + 256);
+    buffer.resize (0);
 
-    size_t samples_done;
-    error = soxr_process (soxr, data.begin (), data.len () / stored_channels,
-     nullptr, buffer.begin (), buffer.len () / stored_channels, & samples_done);
+    if (data.len () && ! resample (data.begin (), data.len () / stored_channels))
+        return data;
 
-    if (error)
-    {
-        AUDERR (error);
+    return buffer;
+}
+
+Index<float> & SoXResampler::finish (Index<float> & data, bool end_of_playlist)
+{
+    if (! soxr)
+         return data;
+
+    buffer.resize (0);
+
+    if (data.len () && ! resample (data.begin (), data.len () / stored_channels))
         return data;
-    }
 
-    buffer.resize (samples_done * stored_channels);
+    /* drain the filter so that the end of the song is not cut off */
+    if (! resample (nullptr, 0))
+        return data;
+
+    if ((error = soxr_clear (soxr)))
+        AUDERR ("%s\n", error);
 
     return buffer;
 }
 
 bool SoXResampler::flush (bool force)
 {
-    if (soxr && (error = soxr_process(soxr, nullptr, 0, nullptr, nullptr, 0, nullptr)))
-        AUDERR (error);
+    if (soxr && (error = soxr_clear (soxr)))
+        AUDERR ("%s\n", error);
 
     return true;
 }
 
+int SoXResampler::adjust_delay (int delay)
+{
+    if (! soxr)
+        return delay;
+
+    return delay + (int) (soxr_delay (soxr) * 1000 / stored_rate);
+}
+
 const char SoXResampler::about[] =
  N_("SoX Resampler Plugin for Audacious\n"
     "Copyright 2013 Michał Lipski\n\n"
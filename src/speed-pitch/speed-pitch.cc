@@ -18,28 +18,61 @@
  */
 
 #include <math.h>
+#include <string.h>
 #include <samplerate.h>
 
+#include <atomic>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include <libaudcore/i18n.h>
 #include <libaudcore/runtime.h>
 #include <libaudcore/plugin.h>
 #include <libaudcore/preferences.h>
+#include <libaudcore/ringbuf.h>
 
 /* The general idea of the speed change algorithm is to divide the input signal
  * into pieces, spaced at a time interval A, using a cosine-shaped window
  * function.  The pieces are then reassembled by adding them together again,
  * spaced at another time interval B.  By varying the ratio A:B, we change the
- * speed of the audio. */
+ * speed of the audio.
+ *
+ * That is all the "fast" mode does.  The WSOLA mode uses shorter pieces and
+ * moves each one by up to a few milliseconds so that it lines up best (by
+ * cross-correlation) with the natural continuation of the previous piece,
+ * which avoids most of the phasing.  The phase vocoder mode instead takes the
+ * FFT of each piece and advances the phase of every frequency bin to match the
+ * output spacing, which keeps tones clean at the cost of softer transients. */
+
+enum {
+    MODE_FAST,
+    MODE_WSOLA,
+    MODE_PHASE_VOCODER
+};
 
 #define FREQ    10
 #define OVERLAP  3
 
+#define WSOLA_FREQ   40
+#define WSOLA_SEARCH 0.01 /* seconds */
+
+#define PV_WINDOW 0.04 /* seconds, rounded up to a power of two in samples */
+#define PV_OVERLAP 4
+
 #define CFGSECT "speed-pitch"
 #define MINSPEED 0.5
 #define MAXSPEED 2.0
 #define MINPITCH 0.5
 #define MAXPITCH 2.0
 
+/* time constant for gliding to new speed/pitch settings, in seconds */
+#define SMOOTH_TIME 0.15
+
 class SpeedPitch : public EffectPlugin
 {
 public:
@@ -74,46 +107,482 @@ private:
 
 EXPORT SpeedPitch aud_plugin_instance;
 
-static int curchans, currate;
+static int curchans, currate, mode;
 static SRC_STATE * srcstate;
 static int outstep, width;
-static Index<float> cosine;
-static Index<float> in, out;
+static Index<float> cosine, scratch;
+static RingBuf<float> in, out;
 static int src, dst;
 
-static void add_data (Index<float> & b, Index<float> & data, float ratio)
+/* WSOLA: maximum shift of a piece (in samples) and the actual input position
+ * of the previous piece (relative to the input buffer, like src) */
+static int search, last_src;
+static bool have_last;
+
+/* phase vocoder: FFT size (in frames), analysis window, bit-reversal table,
+ * twiddle factors for each stage, work buffers, and per-channel phases */
+static int fft_size;
+static Index<float> pv_window;
+static Index<int> fft_bitrev;
+static Index<float> fft_tw_re, fft_tw_im;
+static Index<float> fft_re, fft_im;
+static Index<float> last_phase, sum_phase;
+static int pv_hop; /* input spacing since the previous analysis */
+static bool pv_first;
+
+/* The settings are written by the main thread and picked up by the audio
+ * thread without locking.  The audio thread glides toward them rather than
+ * jumping, so that moving a slider does not click. */
+static std::atomic<float> target_speed, target_pitch;
+static float speed, pitch;
+
+static void update_targets ()
+{
+    target_speed.store (aud_get_double (CFGSECT, "speed"), std::memory_order_relaxed);
+    target_pitch.store (aud_get_double (CFGSECT, "pitch"), std::memory_order_relaxed);
+}
+
+static void glide (float & value, const std::atomic<float> & target, int frames)
+{
+    float goal = target.load (std::memory_order_relaxed);
+    float alpha = 1.0f - expf (-frames / (float) (SMOOTH_TIME * currate));
+
+    value += (goal - value) * alpha;
+
+    /* snap once close enough, so that the step sizes settle */
+    if (fabsf (goal - value) < 0.001f)
+        value = goal;
+}
+
+#if defined (__SSE__)
+#define HAVE_VEC4
+typedef __m128 vec4;
+static inline vec4 vec4_load (const float * p) { return _mm_loadu_ps (p); }
+static inline void vec4_store (float * p, vec4 v) { _mm_storeu_ps (p, v); }
+static inline vec4 vec4_mul (vec4 a, vec4 b) { return _mm_mul_ps (a, b); }
+static inline vec4 vec4_add (vec4 a, vec4 b) { return _mm_add_ps (a, b); }
+static inline vec4 vec4_sub (vec4 a, vec4 b) { return _mm_sub_ps (a, b); }
+static inline vec4 vec4_zero () { return _mm_setzero_ps (); }
+static inline float vec4_sum (vec4 v)
+{
+    float f[4];
+    _mm_storeu_ps (f, v);
+    return (f[0] + f[1]) + (f[2] + f[3]);
+}
+#elif defined (__ARM_NEON)
+#define HAVE_VEC4
+typedef float32x4_t vec4;
+static inline vec4 vec4_load (const float * p) { return vld1q_f32 (p); }
+static inline void vec4_store (float * p, vec4 v) { vst1q_f32 (p, v); }
+static inline vec4 vec4_mul (vec4 a, vec4 b) { return vmulq_f32 (a, b); }
+static inline vec4 vec4_add (vec4 a, vec4 b) { return vaddq_f32 (a, b); }
+static inline vec4 vec4_sub (vec4 a, vec4 b) { return vsubq_f32 (a, b); }
+static inline vec4 vec4_zero () { return vdupq_n_f32 (0); }
+static inline float vec4_sum (vec4 v)
+{
+    float f[4];
+    vst1q_f32 (f, v);
+    return (f[0] + f[1]) + (f[2] + f[3]);
+}
+#endif
+
+/* out[i] += in[i] * window[i] */
+static void window_add (float * out, const float * in, const float * window, int len)
+{
+    int i = 0;
+
+#ifdef HAVE_VEC4
+    for (; i + 4 <= len; i += 4)
+        vec4_store (out + i, vec4_add (vec4_load (out + i),
+         vec4_mul (vec4_load (in + i), vec4_load (window + i))));
+#endif
+
+    for (; i < len; i ++)
+        out[i] += in[i] * window[i];
+}
+
+/* xy += sum (x[i] * y[i]), yy += sum (y[i] * y[i]) */
+static void correlate (const float * x, const float * y, int len, float & xy, float & yy)
+{
+    int i = 0;
+
+#ifdef HAVE_VEC4
+    vec4 sxy = vec4_zero (), syy = vec4_zero ();
+
+    for (; i + 4 <= len; i += 4)
+    {
+        vec4 vy = vec4_load (y + i);
+        sxy = vec4_add (sxy, vec4_mul (vec4_load (x + i), vy));
+        syy = vec4_add (syy, vec4_mul (vy, vy));
+    }
+
+    xy += vec4_sum (sxy);
+    yy += vec4_sum (syy);
+#endif
+
+    for (; i < len; i ++)
+    {
+        xy += x[i] * y[i];
+        yy += y[i] * y[i];
+    }
+}
+
+/* The input and output buffers are rings, allocated at start() for one second
+ * of audio plus a few windows, so no memory is moved around as the windows
+ * advance.  They only grow if a block larger than that comes along. */
+
+static void ring_reserve (RingBuf<float> & ring, int len)
+{
+    if (ring.space () < len)
+        ring.alloc (ring.len () + len + curchans * currate);
+}
+
+/* number of samples stored contiguously in <ring> from position <pos> on */
+static int ring_contiguous (RingBuf<float> & ring, int pos)
+{
+    int split = ring.linear ();
+    return (pos < split) ? split - pos : ring.len () - pos;
+}
+
+static void ring_add_silence (RingBuf<float> & ring, int len)
+{
+    ring_reserve (ring, len);
+
+    int pos = ring.len ();
+    ring.add (len);
+
+    while (len > 0)
+    {
+        int span = aud::min (len, ring_contiguous (ring, pos));
+        memset (& ring[pos], 0, sizeof (float) * span);
+        pos += span;
+        len -= span;
+    }
+}
+
+/* Applies the cosine window centered at input position <pos> to the output
+ * centered at the destination pointer. */
+static void copy_window (int pos)
+{
+    const float * cosine_center = & cosine[width / 2];
+
+    /* Truncate the window to avoid overflows if necessary. */
+    int begin = aud::max (-(width / 2), aud::max (-pos, -dst));
+    int end = aud::min (width / 2, aud::min (in.len () - pos, out.len () - dst));
+
+    /* Either ring may wrap around within the window, so the window is applied
+     * in pieces that are contiguous in both. */
+    for (int i = begin; i < end; )
+    {
+        int len = aud::min (end - i, aud::min (ring_contiguous (in, pos + i),
+         ring_contiguous (out, dst + i)));
+
+        window_add (& out[dst + i], & in[pos + i], cosine_center + i, len);
+        i += len;
+    }
+}
+
+/* Scores a WSOLA candidate: normalized correlation between the input around
+ * <pos> and the natural continuation of the previous piece. */
+static float wsola_score (int pos, int ref, int len)
+{
+    float xy = 0, yy = 0;
+
+    for (int i = 0; i < len; )
+    {
+        int span = aud::min (len - i, aud::min (ring_contiguous (in, ref + i),
+         ring_contiguous (in, pos + i)));
+
+        correlate (& in[ref + i], & in[pos + i], span, xy, yy);
+        i += span;
+    }
+
+    return xy / sqrtf (yy + 1e-9f);
+}
+
+/* Returns the offset (in samples, a whole number of frames) from <src> at which
+ * the next piece should be taken. */
+static int wsola_search ()
+{
+    if (! have_last)
+        return 0;
+
+    /* compare one output step's worth of audio, centered */
+    int len = outstep;
+    int ref = last_src + outstep - len / 2;
+
+    int lo = aud::max (-search, -(src - len / 2));
+    int hi = aud::min (search, in.len () - (src + len / 2));
+
+    if (ref < 0 || ref + len > in.len () || lo > hi)
+        return 0;
+
+    /* coarse pass every 4 frames, then refine around the best match */
+    int coarse = 4 * curchans;
+    int best = 0;
+    float best_score = -1e30f;
+
+    for (int off = lo - lo % curchans; off <= hi; off += coarse)
+    {
+        float score = wsola_score (src - len / 2 + off, ref, len);
+        if (score > best_score)
+        {
+            best = off;
+            best_score = score;
+        }
+    }
+
+    int center = best;
+
+    for (int off = center - coarse + curchans; off < center + coarse; off += curchans)
+    {
+        if (off < lo || off > hi || off == center)
+            continue;
+
+        float score = wsola_score (src - len / 2 + off, ref, len);
+        if (score > best_score)
+        {
+            best = off;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+static void fft_init (int size)
+{
+    fft_size = size;
+
+    int bits = 0;
+    while ((1 << bits) < size)
+        bits ++;
+
+    fft_bitrev.resize (size);
+    for (int i = 0; i < size; i ++)
+    {
+        int r = 0;
+        for (int b = 0; b < bits; b ++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+
+        fft_bitrev[i] = r;
+    }
+
+    /* twiddles for the stage with half-size h start at index h - 1 */
+    fft_tw_re.resize (size - 1);
+    fft_tw_im.resize (size - 1);
+
+    for (int h = 1; h < size; h *= 2)
+    {
+        for (int j = 0; j < h; j ++)
+        {
+            fft_tw_re[h - 1 + j] = cos (M_PI * j / h);
+            fft_tw_im[h - 1 + j] = -sin (M_PI * j / h);
+        }
+    }
+
+    fft_re.resize (size);
+    fft_im.resize (size);
+}
+
+/* In-place radix-2 FFT on split real/imaginary arrays.  The butterflies of
+ * each stage run over contiguous runs of the arrays, which vectorizes once the
+ * runs are four or more long.  The inverse is computed by conjugation and is
+ * not scaled. */
+static void fft (float * re, float * im, bool inverse)
+{
+    int n = fft_size;
+
+    for (int i = 0; i < n; i ++)
+    {
+        int j = fft_bitrev[i];
+        if (j > i)
+        {
+            aud::swap (re[i], re[j]);
+            aud::swap (im[i], im[j]);
+        }
+    }
+
+    if (inverse)
+    {
+        for (int i = 0; i < n; i ++)
+            im[i] = -im[i];
+    }
+
+    for (int h = 1; h < n; h *= 2)
+    {
+        const float * tw_re = & fft_tw_re[h - 1];
+        const float * tw_im = & fft_tw_im[h - 1];
+
+        for (int k = 0; k < n; k += 2 * h)
+        {
+            float * ar = re + k, * ai = im + k;
+            float * br = ar + h, * bi = ai + h;
+            int j = 0;
+
+#ifdef HAVE_VEC4
+            for (; j + 4 <= h; j += 4)
+            {
+                vec4 wr = vec4_load (tw_re + j), wi = vec4_load (tw_im + j);
+                vec4 xr = vec4_load (br + j), xi = vec4_load (bi + j);
+                vec4 tr = vec4_sub (vec4_mul (xr, wr), vec4_mul (xi, wi));
+                vec4 ti = vec4_add (vec4_mul (xr, wi), vec4_mul (xi, wr));
+                vec4 yr = vec4_load (ar + j), yi = vec4_load (ai + j);
+
+                vec4_store (br + j, vec4_sub (yr, tr));
+                vec4_store (bi + j, vec4_sub (yi, ti));
+                vec4_store (ar + j, vec4_add (yr, tr));
+                vec4_store (ai + j, vec4_add (yi, ti));
+            }
+#endif
+
+            for (; j < h; j ++)
+            {
+                float tr = br[j] * tw_re[j] - bi[j] * tw_im[j];
+                float ti = br[j] * tw_im[j] + bi[j] * tw_re[j];
+
+                br[j] = ar[j] - tr;
+                bi[j] = ai[j] - ti;
+                ar[j] += tr;
+                ai[j] += ti;
+            }
+        }
+    }
+
+    if (inverse)
+    {
+        for (int i = 0; i < n; i ++)
+            im[i] = -im[i];
+    }
+}
+
+static void pv_init ()
+{
+    int size = 2;
+    while (size < currate * PV_WINDOW)
+        size *= 2;
+
+    fft_init (size);
+
+    /* Hann window, applied on both analysis and synthesis; the squared windows
+     * add up to 3/8 times the overlap */
+    pv_window.resize (size);
+    for (int i = 0; i < size; i ++)
+        pv_window[i] = 0.5 - 0.5 * cos (2.0 * M_PI * i / size);
+
+    last_phase.resize (curchans * (size / 2 + 1));
+    sum_phase.resize (curchans * (size / 2 + 1));
+}
+
+static float wrap_phase (float phase)
+{
+    return phase - 2 * (float) M_PI * roundf (phase / (2 * (float) M_PI));
+}
+
+/* Runs one phase vocoder step: analysis at <src>, synthesis at <dst>.  The
+ * input has moved by <pv_hop> and the output by <outstep> since the previous
+ * step. */
+static void pv_step ()
+{
+    int n = fft_size;
+    int bins = n / 2 + 1;
+    float ha = (float) pv_hop / curchans;
+    float hs = (float) outstep / curchans;
+    float norm = 1.0f / (n * (3.0f / 8) * PV_OVERLAP);
+
+    float * re = fft_re.begin ();
+    float * im = fft_im.begin ();
+
+    for (int c = 0; c < curchans; c ++)
+    {
+        float * last = & last_phase[c * bins];
+        float * sum = & sum_phase[c * bins];
+
+        int get = src - width / 2 + c;
+        for (int i = 0; i < n; i ++, get += curchans)
+        {
+            re[i] = (get >= 0 && get < in.len ()) ? in[get] * pv_window[i] : 0;
+            im[i] = 0;
+        }
+
+        fft (re, im, false);
+
+        for (int k = 0; k < bins; k ++)
+        {
+            float mag = sqrtf (re[k] * re[k] + im[k] * im[k]);
+            float phase = atan2f (im[k], re[k]);
+            float omega = 2 * (float) M_PI * k / n;
+
+            if (pv_first)
+                sum[k] = phase;
+            else
+            {
+                float delta = wrap_phase (phase - last[k] - omega * ha);
+                sum[k] = wrap_phase (sum[k] + (omega + delta / ha) * hs);
+            }
+
+            last[k] = phase;
+            re[k] = mag * cosf (sum[k]);
+            im[k] = mag * sinf (sum[k]);
+        }
+
+        for (int k = bins; k < n; k ++)
+        {
+            re[k] = re[n - k];
+            im[k] = -im[n - k];
+        }
+
+        fft (re, im, true);
+
+        int set = dst - width / 2 + c;
+        for (int i = 0; i < n; i ++, set += curchans)
+        {
+            if (set >= 0 && set < out.len ())
+                out[set] += re[i] * pv_window[i] * norm;
+        }
+    }
+
+    pv_first = false;
+}
+
+static void add_data (Index<float> & data, float ratio)
 {
-    int oldlen = b.len ();
     int inframes = data.len () / curchans;
     int maxframes = (int) (inframes * ratio) + 256;
-    b.resize (oldlen + maxframes * curchans);
+    scratch.resize (maxframes * curchans);
 
     SRC_DATA d = SRC_DATA ();
 
     d.data_in = data.begin ();
     d.input_frames = inframes;
-    d.data_out = & b[oldlen];
+    d.data_out = scratch.begin ();
     d.output_frames = maxframes;
     d.src_ratio = ratio;
 
     src_process (srcstate, & d);
-    b.resize (oldlen + d.output_frames_gen * curchans);
+
+    int len = d.output_frames_gen * curchans;
+    ring_reserve (in, len);
+    in.copy_in (scratch.begin (), len);
 }
 
 bool SpeedPitch::flush (bool force)
 {
     src_reset (srcstate);
 
-    in.resize (0);
-    out.resize (0);
+    in.discard ();
+    out.discard ();
 
     /* The source and destination pointers give the center of the next cosine
      * window to be copied, relative to the current input and output buffers. */
     src = dst = 0;
 
+    have_last = false;
+    pv_first = true;
+
     /* The output buffer always extends right of the destination pointer by half
      * the width of a cosine window. */
-    out.insert (0, width / 2);
+    ring_add_silence (out, width / 2);
 
     return true;
 }
@@ -128,64 +597,105 @@ void SpeedPitch::start (int & chans, int & rate)
 
     srcstate = src_new (SRC_LINEAR, curchans, nullptr);
 
-    /* Calculate the width of the cosine window and the spacing interval for
-     * output.  Make them both even numbers for convenience.  Note that the
-     * cosine window is applied without deinterleaving the audio samples. */
-    outstep = ((currate / FREQ) & ~1) * curchans;
-    width = outstep * OVERLAP;
+    mode = aud_get_int (CFGSECT, "mode");
+    search = (mode == MODE_WSOLA) ? (int) (currate * WSOLA_SEARCH) * curchans : 0;
+
+    if (mode == MODE_PHASE_VOCODER)
+    {
+        pv_init ();
+
+        outstep = (fft_size / PV_OVERLAP) * curchans;
+        width = fft_size * curchans;
+    }
+    else
+    {
+        /* Calculate the width of the cosine window and the spacing interval
+         * for output.  Make them both even numbers for convenience.  Note that
+         * the cosine window is applied without deinterleaving the audio
+         * samples. */
+        outstep = ((currate / (mode == MODE_WSOLA ? WSOLA_FREQ : FREQ)) & ~1) * curchans;
+        width = outstep * OVERLAP;
+
+        /* Generate the cosine window, scaled vertically to compensate for the
+         * overlap of the reassembled pieces of audio. */
+        cosine.resize (width);
+        for (int i = 0; i < width; i ++)
+            cosine[i] = (1.0 - cos (2.0 * M_PI * i / width)) / OVERLAP;
+    }
+
+    in.destroy ();
+    out.destroy ();
+    in.alloc (curchans * currate + 2 * width);
+    out.alloc (curchans * currate + 2 * width);
 
-    /* Generate the cosine window, scaled vertically to compensate for the
-     * overlap of the reassembled pieces of audio. */
-    cosine.resize (width);
-    for (int i = 0; i < width; i ++)
-        cosine[i] = (1.0 - cos (2.0 * M_PI * i / width)) / OVERLAP;
+    /* start at the current settings rather than gliding from the last song */
+    update_targets ();
+    speed = target_speed.load (std::memory_order_relaxed);
+    pitch = target_pitch.load (std::memory_order_relaxed);
 
     flush (true);
 }
 
 Index<float> & SpeedPitch::process (Index<float> & data, bool ending)
 {
-    const float * cosine_center = & cosine[width / 2];
-    float pitch = aud_get_double (CFGSECT, "pitch");
-    float speed = aud_get_double (CFGSECT, "speed");
-
     /* Copy the passed audio to the input buffer, scaled to adjust pitch. */
-    add_data (in, data, 1.0 / pitch);
+    glide (pitch, target_pitch, data.len () / curchans);
+    add_data (data, 1.0 / pitch);
+
+    /* Stop copying half a window's width (plus the WSOLA search range) before
+     * the end of the input buffer (or right up to the end of the buffer if the
+     * song is ending). */
+    int stop = in.len () - (ending ? 0 : width / 2 + search);
 
     /* Calculate the spacing interval for input. */
     int instep = (int) round ((outstep / curchans) * speed / pitch) * curchans;
 
-    /* Stop copying half a window's width before the end of the input buffer (or
-     * right up to the end of the buffer if the song is ending). */
-    int stop = in.len () - (ending ? 0 : width / 2);
-
     while (src <= stop)
     {
-        /* Truncate the window to avoid overflows if necessary. */
-        int begin = aud::max (-(width / 2), aud::max (-src, -dst));
-        int end = aud::min (width / 2, aud::min (in.len () - src, out.len () - dst));
-
-        for (int i = begin; i < end; i ++)
-            out[dst + i] += in[src + i] * cosine_center[i];
+        /* Follow speed changes from one window to the next. */
+        glide (speed, target_speed, outstep / curchans);
+        instep = (int) round ((outstep / curchans) * speed / pitch) * curchans;
+
+        if (mode == MODE_PHASE_VOCODER)
+        {
+            pv_step ();
+            pv_hop = instep;
+        }
+        else if (mode == MODE_WSOLA)
+        {
+            last_src = src + wsola_search ();
+            have_last = true;
+            copy_window (last_src);
+        }
+        else
+            copy_window (src);
 
         src += instep;
         dst += outstep;
 
-        out.insert (-1, outstep);
+        ring_add_silence (out, outstep);
     }
 
     /* Discard input up to half a window's width before the source pointer (or
      * right up to the previous source pointer if the song is ending. */
-    int seek = aud::clamp (0, src - (ending ? instep : width / 2), in.len ());
-    in.remove (0, seek);
+    int seek = src - (ending ? instep : width / 2);
+
+    /* WSOLA also needs the continuation of the last piece for the next
+     * comparison. */
+    if (have_last)
+        seek = aud::min (seek, last_src + outstep / 2);
+
+    seek = aud::clamp (0, seek, in.len ());
+    in.discard (seek);
     src -= seek;
+    last_src -= seek;
 
     data.resize (0);
 
     /* Return output up to half a window's width before the destination pointer
      * (or right up to the previous destination pointer if the song is ending). */
     int ret = aud::clamp (0, dst - (ending ? outstep : width / 2), out.len ());
-    data.move_from (out, 0, 0, ret, true, true);
+    out.move_out (data, -1, ret);
     dst -= ret;
 
     return data;
@@ -194,9 +704,8 @@ Index<float> & SpeedPitch::process (Index<float> & data, bool ending)
 int SpeedPitch::adjust_delay (int delay)
 {
     float samples_to_ms = 1000.0 / (curchans * currate);
-    float speed = aud_get_double (CFGSECT, "speed");
-    int in_samples = in.len () - src;
-    int out_samples = dst;
+    int in_samples = aud::max (in.len () - src, 0);
+    int out_samples = aud::max (dst, 0);
 
     return (delay + in_samples * samples_to_ms) * speed + out_samples * samples_to_ms;
 }
@@ -204,16 +713,26 @@ int SpeedPitch::adjust_delay (int delay)
 const char * const SpeedPitch::defaults[] = {
  "speed", "1",
  "pitch", "1",
+ "mode", "0",
  nullptr};
 
+static const ComboItem mode_list[] = {
+    ComboItem (N_("Fast"), MODE_FAST),
+    ComboItem (N_("WSOLA"), MODE_WSOLA),
+    ComboItem (N_("Phase vocoder"), MODE_PHASE_VOCODER)
+};
+
 const PreferencesWidget SpeedPitch::widgets[] = {
     WidgetLabel (N_("<b>Speed and Pitch</b>")),
     WidgetSpin (N_("Speed:"),
-        WidgetFloat (CFGSECT, "speed"),
+        WidgetFloat (CFGSECT, "speed", update_targets),
         {MINSPEED, MAXSPEED, 0.05}),
     WidgetSpin (N_("Pitch:"),
-        WidgetFloat (CFGSECT, "pitch"),
-        {MINPITCH, MAXPITCH, 0.05})
+        WidgetFloat (CFGSECT, "pitch", update_targets),
+        {MINPITCH, MAXPITCH, 0.05}),
+    WidgetCombo (N_("Quality:"),
+        WidgetInt (CFGSECT, "mode"),
+        {{mode_list}})
 };
 
 const PluginPreferences SpeedPitch::prefs = {{widgets}};
@@ -221,6 +740,7 @@ const PluginPreferences SpeedPitch::prefs = {{widgets}};
 bool SpeedPitch::init ()
 {
     aud_config_set_defaults (CFGSECT, defaults);
+    update_targets ();
     return true;
 }
 
@@ -232,6 +752,15 @@ void SpeedPitch::cleanup ()
     srcstate = nullptr;
 
     cosine.clear ();
-    in.clear ();
-    out.clear ();
+    scratch.clear ();
+    pv_window.clear ();
+    fft_bitrev.clear ();
+    fft_tw_re.clear ();
+    fft_tw_im.clear ();
+    fft_re.clear ();
+    fft_im.clear ();
+    last_phase.clear ();
+    sum_phase.clear ();
+    in.destroy ();
+    out.destroy ();
 }
@@ -34,6 +34,7 @@
 #include <libaudcore/audstrings.h>
 #include <libaudcore/runtime.h>
 
+#include "file-view.h"
 #include "ao.h"
 #include "corlett.h"
 #include "vio2sf.h"
@@ -95,7 +96,7 @@ Tuple XSFPlugin::read_tuple(const char *filename, VFSFile &fd)
 	Tuple t;
 	corlett_t *c;
 
-	Index<char> buf = fd.read_all ();
+	FileView buf (fd);
 
 	if (!buf.len())
 		return t;
@@ -118,7 +119,7 @@ Tuple XSFPlugin::read_tuple(const char *filename, VFSFile &fd)
 	return t;
 }
 
-static int xsf_get_length(const Index<char> &buf)
+static int xsf_get_length(const FileView &buf)
 {
 	corlett_t *c;
 
@@ -147,7 +148,7 @@ bool XSFPlugin::play(const char *filename, VFSFile &file)
 
 	dirpath = String (str_copy (filename, slash + 1 - filename));
 
-	Index<char> buf = file.read_all ();
+	FileView buf (file);
 
 	if (!buf.len())
 	{
@@ -157,7 +158,7 @@ bool XSFPlugin::play(const char *filename, VFSFile &file)
 
 	length = xsf_get_length(buf);
 
-	if (xsf_start(buf.begin(), buf.len()) != AO_SUCCESS)
+	if (xsf_start((void *)buf.begin(), buf.len()) != AO_SUCCESS)
 	{
 		error = true;
 		goto ERR_NO_CLOSE;
@@ -184,7 +185,7 @@ bool XSFPlugin::play(const char *filename, VFSFile &file)
 			{
 				xsf_term();
 
-				if (xsf_start(buf.begin(), buf.len()) == AO_SUCCESS)
+				if (xsf_start((void *)buf.begin(), buf.len()) == AO_SUCCESS)
 				{
 					pos = 0.0;
 					while (pos < seek_value)